@@ -0,0 +1,118 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Per-update bump allocator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "arena.h"
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_BLOCK_SIZE 16384
+#define ARENA_ALIGN 16
+
+struct arena_block {
+    struct arena_block* prev;
+    size_t size, used;
+    char data[];
+};
+
+static size_t align_up(size_t size) {
+    return (size + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1);
+}
+
+static struct arena_block* block_new(size_t size) {
+    struct arena_block* block = malloc(align_up(sizeof(struct arena_block)) + size);
+    if (block == NULL) {
+        config_error("Memory allocation error!");
+        return NULL;
+    }
+    block->prev = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void arena_init(struct arena* arena) {
+    memset(arena, 0, sizeof(struct arena));
+}
+
+void* arena_alloc(struct arena* arena, size_t size) {
+    size = align_up(size);
+    struct arena_block* block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        size_t blocksize = (size > ARENA_BLOCK_SIZE) ? size : ARENA_BLOCK_SIZE;
+        struct arena_block* newblock = block_new(blocksize);
+        if (newblock == NULL) {
+            return NULL;
+        }
+        newblock->prev = block;
+        arena->head = block = newblock;
+        arena->total += blocksize;
+    }
+    void* ptr = &block->data[block->used];
+    block->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+void* arena_grow(struct arena* arena, void* ptr, size_t oldsize, size_t newsize) {
+    struct arena_block* block = arena->head;
+    if (ptr != NULL && ptr == arena->last) {
+        size_t offset = (char*)ptr - block->data;
+        if (offset + align_up(newsize) <= block->size) {
+            block->used = offset + align_up(newsize);
+            return ptr;
+        }
+    }
+    void* newptr = arena_alloc(arena, newsize);
+    if (newptr != NULL && ptr != NULL) {
+        memcpy(newptr, ptr, (oldsize < newsize) ? oldsize : newsize);
+    }
+    return newptr;
+}
+
+void arena_reset(struct arena* arena) {
+    struct arena_block* block = arena->head;
+    if (block == NULL) {
+        return;
+    }
+    if (block->prev != NULL) {
+        //this round outgrew a single block: replace them all with one big one
+        size_t total = arena->total;
+        arena_free(arena);
+        if ((arena->head = block_new(total)) != NULL) {
+            arena->total = total;
+        }
+        return;
+    }
+    block->used = 0;
+    arena->last = NULL;
+}
+
+void arena_free(struct arena* arena) {
+    struct arena_block* block = arena->head;
+    while (block != NULL) {
+        struct arena_block* prev = block->prev;
+        free(block);
+        block = prev;
+    }
+    arena_init(arena);
+}
@@ -0,0 +1,49 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include <stddef.h>
+
+//Bump allocator for everything that lives for one update: frames, parsed
+//text, packets and the sequence built from them. Nothing is freed on its own,
+//the owner resets the whole arena once the update is done.
+struct arena_block;
+struct arena {
+    struct arena_block* head;//block being allocated from
+    size_t total;//capacity of all blocks, the size to coalesce into on reset
+    void* last;//most recent allocation, which may still grow in place
+};
+
+void arena_init(struct arena* arena);
+
+//Returns uninitialized memory which stays valid until the next reset, or NULL.
+void* arena_alloc(struct arena* arena, size_t size);
+//Resizes an allocation, in place if it's the most recent one and fits.
+//ptr may be NULL. Returns the new location, or NULL (ptr is left as-is).
+void* arena_grow(struct arena* arena, void* ptr, size_t oldsize, size_t newsize);
+
+//Drops everything allocated so far. Memory is kept for the next round, merged
+//into one block so that a same-sized round doesn't need to allocate again.
+void arena_reset(struct arena* arena);
+void arena_free(struct arena* arena);
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef __BBUSB_PLUGIN_H__
+#define __BBUSB_PLUGIN_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+//ABI for content plugins, loaded with a config line of:
+//  plugin <mode> [ttl=<secs>] <lib.so> [args]
+//A plugin fills a STRING the way a cmd's output does, without starting a
+//process. It stays loaded for as long as bbusb runs (eg --daemon, or a
+//libbbusb program), so it can keep connections or data around between calls.
+//
+//A plugin library exports a "bbusb_plugin" symbol:
+//  #include <bbusb-plugin.h>
+//  static int fill(void* state, char* buf, size_t size) {
+//      return snprintf(buf, size, "Hello <color030>world");
+//  }
+//  const struct bbusb_plugin bbusb_plugin = { BBUSB_PLUGIN_ABI, NULL, fill, NULL, 0 };
+//and is built with eg "cc -shared -fPIC -o hello.so hello.c".
+
+#include <stddef.h>
+
+#define BBUSB_PLUGIN_ABI 1
+
+struct bbusb_plugin {
+    int abi;//BBUSB_PLUGIN_ABI
+
+    //Optional. Called once when the plugin is loaded, with the rest of its
+    //config line (NULL if there's nothing after the library), which stays
+    //valid until fini(). Whatever is put in *state is passed to the other
+    //calls. Returns <0 on failure.
+    int (*init)(const char* args, void** state);
+
+    //Writes the text to show into buf: markup as in a txt line, at most size
+    //bytes. Returns the length written, or <0 on failure (the last good
+    //output is shown instead). Never called from two threads at once.
+    int (*fill)(void* state, char* buf, size_t size);
+
+    //Optional. Called when bbusb exits.
+    void (*fini)(void* state);
+
+    //How often fill() is called: its output is reused for this many seconds.
+    //0: every update. A ttl=<secs> on the config line takes precedence.
+    int ttl_secs;
+};
+
+#endif
@@ -0,0 +1,541 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Library interface
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "bbusb.h"
+#include "config.h"
+#include "hardware.h"
+#include "infile.h"
+#include "labelmap.h"
+#include "sentstate.h"
+#include "stats.h"
+#include "timing.h"
+#include "update.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+//the public levels are passed straight through:
+typedef char check_log_error[(BB_LOG_ERROR == CONFIG_LEVEL_ERROR) ? 1 : -1];
+typedef char check_log_info[(BB_LOG_INFO == CONFIG_LEVEL_LOG) ? 1 : -1];
+typedef char check_log_debug[(BB_LOG_DEBUG == CONFIG_LEVEL_DEBUG) ? 1 : -1];
+typedef char check_retry[(BB_RETRY_DEFAULT_MS == HARDWARE_RETRY_MS) ? 1 : -1];
+typedef char check_node_len[(SENTSTATE_NODE_LEN == HARDWARE_NODE_LEN) ? 1 : -1];
+
+//A dynamic message: its STRING frames in the layout, and what goes in them.
+struct bb_slot {
+    struct bb_frame* strings;
+    char* text;//malloced, NULL until set
+};
+
+struct bb_handle {
+    struct hardware_sign sign;
+    int reopen;//the last send failed, start over with a fresh device
+
+    struct config_sink log;
+    int log_set;
+
+    //from bb_reconfigure(), frames and their (non-dynamic) data:
+    struct arena layout;
+    struct bb_frame* frames;
+    struct bb_slot* slots;
+    int slotcount;
+    int need_init;//the layout isn't on the sign yet
+
+    struct sentstate state;
+
+    //everything built for the last update, reset at the start of the next:
+    struct arena scratch;
+    struct stats stats;
+};
+
+//Output while running a call for a handle goes to the handle's log.
+static struct config_sink* handle_enter(bb_handle* handle) {
+    struct config_sink* prev = config_thread_sink;
+    if (handle->log_set) {
+        config_thread_sink = &handle->log;
+    }
+    return prev;
+}
+static void handle_leave(struct config_sink* prev) {
+    config_thread_sink = prev;
+}
+
+static void handle_start_update(bb_handle* handle) {
+    arena_reset(&handle->scratch);
+    stats_clear(&handle->stats);
+    if (handle->reopen) {
+        hardware_close(&handle->sign);
+        handle->reopen = 0;
+    }
+}
+static void handle_end_update(bb_handle* handle, int ret) {
+    if (ret == -1 && handle->sign.devh != NULL) {
+        //the sign may be in any state after a failed send, reopen it next time
+        handle->reopen = 1;
+    }
+}
+
+static void clear_layout(bb_handle* handle) {
+    int i;
+    for (i = 0; i < handle->slotcount; i++) {
+        free(handle->slots[i].text);
+    }
+    free(handle->slots);
+    handle->frames = NULL;
+    handle->slots = NULL;
+    handle->slotcount = 0;
+    arena_reset(&handle->layout);
+}
+
+bb_handle* bb_open(void) {
+    bb_handle* handle = calloc(1, sizeof(bb_handle));
+    if (handle == NULL) {
+        config_error("Memory allocation error!");
+        return NULL;
+    }
+    arena_init(&handle->layout);
+    arena_init(&handle->scratch);
+    sentstate_clear(&handle->state);
+    stats_clear(&handle->stats);
+    handle->sign.retry_ms = HARDWARE_RETRY_MS;
+    return handle;
+}
+
+void bb_close(bb_handle* handle) {
+    if (handle == NULL) {
+        return;
+    }
+    struct config_sink* prev = handle_enter(handle);
+    clear_layout(handle);
+    arena_free(&handle->layout);
+    arena_free(&handle->scratch);
+    hardware_close(&handle->sign);
+    handle_leave(prev);
+    free(handle->sign.device);
+    free(handle);
+}
+
+void bb_set_log(bb_handle* handle, int level, bb_log_func func, void* arg) {
+    handle->log.level = level;
+    handle->log.write = func;
+    handle->log.arg = arg;
+    handle->log_set = 1;
+}
+
+int bb_set_device(bb_handle* handle, const char* device) {
+    struct config_sink* prev = handle_enter(handle);
+    int ret = 0;
+    char* copy = NULL;
+    if (device != NULL && (copy = strdup(device)) == NULL) {
+        config_error("Memory allocation error!");
+        ret = -1;
+    } else {
+        hardware_close(&handle->sign);
+        free(handle->sign.device);
+        handle->sign.device = copy;
+    }
+    handle_leave(prev);
+    return ret;
+}
+
+void bb_set_retry(bb_handle* handle, int retry_ms) {
+    handle->sign.retry_ms = (retry_ms > 0) ? retry_ms : 0;
+}
+
+int bb_wait(bb_handle* handle, int fd, int timeout_ms) {
+    struct config_sink* prev = handle_enter(handle);
+    int ret = hardware_wait(&handle->sign, fd, timeout_ms);
+    handle_leave(prev);
+    return ret;
+}
+
+int bb_connect(bb_handle* handle) {
+    struct config_sink* prev = handle_enter(handle);
+    int ret = 0;
+    if (handle->sign.devh == NULL && hardware_init(&handle->sign) < 0) {
+        config_error("USB init failed. ");
+        ret = -1;
+    }
+    handle_leave(prev);
+    return ret;
+}
+
+int bb_reconfigure(bb_handle* handle, const struct bb_message* messages, int count) {
+    struct config_sink* prev = handle_enter(handle);
+    int ret = -2, i, slotcount = 0;
+    clear_layout(handle);
+    handle->need_init = 1;
+    if (count <= 0) {
+        config_error("No messages given, nothing to do. ");
+        goto end;
+    }
+    for (i = 0; i < count; i++) {
+        if (checkmode(messages[i].mode, (messages[i].dynamic) ? "" : messages[i].text, i+1) < 0) {
+            goto end;
+        }
+        if (messages[i].dynamic) {
+            ++slotcount;
+        }
+    }
+
+    //the layout's markup is only parsed once, here:
+    struct stats stats;
+    stats_clear(&stats);
+    struct infile_frames frames;
+    infile_frames_init(&frames);
+    struct bb_slot* slots = calloc(slotcount + 1, sizeof(struct bb_slot));
+    if (slots == NULL) {
+        config_error("Memory allocation error!");
+        ret = -1;
+        goto end;
+    }
+    handle->slots = slots;
+    for (i = 0; i < count; i++) {
+        if (messages[i].dynamic) {
+            //a dynamic message is known by its slot, whatever's in it:
+            char slotname[16];
+            snprintf(slotname, sizeof(slotname), "%d", handle->slotcount);
+            frames.key = labelmap_key('d', slotname);
+            struct bb_slot* slot = &slots[handle->slotcount++];
+            if ((slot->strings = infile_add_strings(&handle->layout, &frames,
+                            messages[i].mode, NULL, i+1, &stats)) == NULL) {
+                goto end;
+            }
+            if (messages[i].text != NULL && (slot->text = strdup(messages[i].text)) == NULL) {
+                config_error("Memory allocation error!");
+                ret = -1;
+                goto end;
+            }
+        } else {
+            frames.key = labelmap_key('t', messages[i].text);
+            if (infile_add_text(&handle->layout, &frames,
+                                messages[i].mode, messages[i].text, i+1, &stats) < 0) {
+                goto end;
+            }
+        }
+    }
+    handle->frames = frames.head;
+    ret = 0;
+ end:
+    if (ret < 0) {
+        clear_layout(handle);
+    }
+    handle_leave(prev);
+    return ret;
+}
+
+int bb_set_string(bb_handle* handle, int slot, const char* text) {
+    struct config_sink* prev = handle_enter(handle);
+    int ret = -1;
+    char* copy;
+    if (slot < 0 || slot >= handle->slotcount) {
+        config_error("No dynamic message %d, there are %d.", slot, handle->slotcount);
+    } else if ((copy = strdup((text != NULL) ? text : "")) == NULL) {
+        config_error("Memory allocation error!");
+    } else {
+        free(handle->slots[slot].text);
+        handle->slots[slot].text = copy;
+        ret = 0;
+    }
+    handle_leave(prev);
+    return ret;
+}
+
+int bb_commit(bb_handle* handle) {
+    struct config_sink* prev = handle_enter(handle);
+    int ret = -2, i;
+    handle_start_update(handle);
+    if (handle->frames == NULL) {
+        config_error("No messages to send, see bb_reconfigure(). ");
+        goto end;
+    }
+
+    //STRINGs are rebuilt from scratch, sentstate then skips any which are unchanged:
+    long long time_start = timing_now_us();
+    for (i = 0; i < handle->slotcount; i++) {
+        struct bb_slot* slot = &handle->slots[i];
+        if (infile_fill_strings(&handle->scratch, slot->strings,
+                                (slot->text != NULL) ? slot->text : "", i+1,
+                                &handle->stats) < 0) {
+            ret = -1;
+            goto end;
+        }
+    }
+    handle->stats.parse_us = timing_now_us() - time_start;
+
+    ret = update_send(&handle->scratch, &handle->sign, handle->frames, handle->need_init,
+                      &handle->state, &handle->stats);
+    if (ret == 0) {
+        handle->need_init = 0;
+    }
+    handle_end_update(handle, ret);
+ end:
+    handle_leave(prev);
+    return ret;
+}
+
+int bb_run_config(bb_handle* handle, FILE* config, const char* name, int init) {
+    struct config_sink* prev = handle_enter(handle);
+    handle_start_update(handle);
+    int ret = update_run(&handle->scratch, &handle->sign, config, name, init,
+                         &handle->state, &handle->stats);
+    if (init && ret != -2 && handle->frames != NULL) {
+        handle->need_init = 1;//the sign's memory now holds the config's layout instead
+    }
+    handle_end_update(handle, ret);
+    handle_leave(prev);
+    return ret;
+}
+
+//One sign's part of bb_run_config_all(), run on its own thread.
+struct fanout_job {
+    bb_handle* handle;
+    struct config_sink* sink;//the caller's
+    struct bb_frame* frames;
+    const struct stats* parsed;
+    int init;
+    int ret;
+};
+
+static void* fanout_send(void* arg) {
+    struct fanout_job* job = arg;
+    bb_handle* handle = job->handle;
+    config_thread_sink = job->sink;
+    struct config_sink* prev = handle_enter(handle);
+    handle_start_update(handle);
+    //each sign plans its own labels (see labelmap.h), so gets its own frames:
+    struct bb_frame* frames = infile_copy_frames(&handle->scratch, job->frames);
+    if (frames == NULL ||
+        stats_copy_parse(&handle->scratch, &handle->stats, job->parsed) < 0) {
+        config_error("Memory allocation error!");
+        job->ret = -1;
+    } else {
+        job->ret = update_send(&handle->scratch, &handle->sign, frames, job->init,
+                               &handle->state, &handle->stats);
+    }
+    if (job->init && handle->frames != NULL) {
+        handle->need_init = 1;
+    }
+    handle_end_update(handle, job->ret);
+    handle_leave(prev);
+    return NULL;
+}
+
+int bb_run_config_all(bb_handle** handles, int count, FILE* config, const char* name,
+                      int init, int* results) {
+    if (count <= 0) {
+        return -2;
+    }
+    struct config_sink* prev = handle_enter(handles[0]);
+    int i;
+    struct arena arena;
+    arena_init(&arena);
+    struct stats parsed;
+    struct bb_frame* frames;
+    int ret = update_parse(&arena, &frames, config, name, &parsed);
+    struct fanout_job* jobs = NULL;
+    pthread_t* threads = NULL;
+    if (ret == 0 &&
+        ((jobs = calloc(count, sizeof(struct fanout_job))) == NULL ||
+         (threads = calloc(count, sizeof(pthread_t))) == NULL)) {
+        config_error("Memory allocation error!");
+        ret = -1;
+    }
+    handle_leave(prev);
+    if (ret < 0) {
+        goto end;
+    }
+
+    //the update takes as long as the slowest sign, not all of them in turn:
+    for (i = 0; i < count; i++) {
+        jobs[i].handle = handles[i];
+        jobs[i].sink = config_thread_sink;
+        jobs[i].frames = frames;
+        jobs[i].parsed = &parsed;
+        jobs[i].init = init;
+        if (pthread_create(&threads[i], NULL, fanout_send, &jobs[i]) != 0) {
+            fanout_send(&jobs[i]);//no thread to spare, send from here instead
+            jobs[i].handle = NULL;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (jobs[i].handle != NULL) {
+            pthread_join(threads[i], NULL);
+        }
+        if (jobs[i].ret < 0) {
+            ret = -1;
+        }
+    }
+ end:
+    for (i = 0; results != NULL && i < count; i++) {
+        results[i] = (jobs != NULL) ? jobs[i].ret : ret;
+    }
+    free(threads);
+    free(jobs);
+    arena_free(&arena);
+    return ret;
+}
+
+int bb_set_clock(bb_handle* handle, int use_24h) {
+    time_t minute;
+    long long send_at_us;
+    update_clock_next(&minute, &send_at_us);
+    struct config_sink* prev = handle_enter(handle);
+    handle_start_update(handle);
+    int ret = update_clock(&handle->scratch, &handle->sign, use_24h, minute, send_at_us,
+                           &handle->stats);
+    handle_end_update(handle, ret);
+    handle_leave(prev);
+    return ret;
+}
+
+int bb_clock_wait_ms(void) {
+    time_t minute;
+    long long send_at_us;
+    update_clock_next(&minute, &send_at_us);
+    long long wait_us = send_at_us - timing_now_us();
+    return (wait_us > 0) ? (int)((wait_us + 999)/1000) : 0;
+}
+
+//One sign's part of bb_set_clock_all(), run on its own thread.
+struct clock_job {
+    bb_handle* handle;
+    struct config_sink* sink;//the caller's
+    int use_24h;
+    time_t minute;
+    long long send_at_us;
+    int ret;
+};
+
+static void* clock_send(void* arg) {
+    struct clock_job* job = arg;
+    bb_handle* handle = job->handle;
+    config_thread_sink = job->sink;
+    struct config_sink* prev = handle_enter(handle);
+    handle_start_update(handle);
+    job->ret = update_clock(&handle->scratch, &handle->sign, job->use_24h,
+                            job->minute, job->send_at_us, &handle->stats);
+    handle_end_update(handle, job->ret);
+    handle_leave(prev);
+    return NULL;
+}
+
+int bb_set_clock_all(bb_handle** handles, int count, int use_24h, int* results) {
+    if (count <= 0) {
+        return 0;
+    }
+    int ret = 0, i;
+    struct clock_job* jobs = calloc(count, sizeof(struct clock_job));
+    pthread_t* threads = calloc(count, sizeof(pthread_t));
+    if (jobs == NULL || threads == NULL) {
+        struct config_sink* prev = handle_enter(handles[0]);
+        config_error("Memory allocation error!");
+        handle_leave(prev);
+        ret = -1;
+        goto end;
+    }
+
+    //every sign gets the same minute, and they all wait for it together:
+    time_t minute;
+    long long send_at_us;
+    update_clock_next(&minute, &send_at_us);
+    for (i = 0; i < count; i++) {
+        jobs[i].handle = handles[i];
+        jobs[i].sink = config_thread_sink;
+        jobs[i].use_24h = use_24h;
+        jobs[i].minute = minute;
+        jobs[i].send_at_us = send_at_us;
+        if (pthread_create(&threads[i], NULL, clock_send, &jobs[i]) != 0) {
+            clock_send(&jobs[i]);//no thread to spare, send from here instead
+            jobs[i].handle = NULL;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (jobs[i].handle != NULL) {
+            pthread_join(threads[i], NULL);
+        }
+        if (jobs[i].ret < 0) {
+            ret = -1;
+        }
+    }
+ end:
+    for (i = 0; results != NULL && i < count; i++) {
+        results[i] = (jobs != NULL) ? jobs[i].ret : ret;
+    }
+    free(threads);
+    free(jobs);
+    return ret;
+}
+
+int bb_alert(bb_handle* handle, const char* mode, const char* text) {
+    struct config_sink* prev = handle_enter(handle);
+    handle_start_update(handle);
+    int ret = update_alert(&handle->scratch, &handle->sign, mode, text, &handle->stats);
+    handle_end_update(handle, ret);
+    handle_leave(prev);
+    return ret;
+}
+
+int bb_clear_alert(bb_handle* handle) {
+    return bb_alert(handle, NULL, NULL);
+}
+
+int bb_is_open(bb_handle* handle) {
+    return handle->sign.devh != NULL;
+}
+
+int bb_load_state(bb_handle* handle, const char* path) {
+    struct config_sink* prev = handle_enter(handle);
+    int ret = sentstate_load(&handle->state, path);
+    if (handle->sign.devh == NULL) {
+        //where it was last time, for a quicker open:
+        strcpy(handle->sign.node, handle->state.node);
+    }
+    handle_leave(prev);
+    return ret;
+}
+
+int bb_save_state(bb_handle* handle, const char* path) {
+    struct config_sink* prev = handle_enter(handle);
+    strcpy(handle->state.node, handle->sign.node);
+    int ret = sentstate_save(&handle->state, path);
+    handle_leave(prev);
+    return ret;
+}
+
+void bb_log_stats(bb_handle* handle, int status, enum bb_stats_format format) {
+    struct config_sink* prev = handle_enter(handle);
+    switch (format) {
+    case BB_STATS_TEXT:
+        stats_print(&handle->stats, status, STATS_TEXT);
+        break;
+    case BB_STATS_JSON:
+        stats_print(&handle->stats, status, STATS_JSON);
+        break;
+    case BB_STATS_TIMING:
+        stats_log_timing(&handle->stats);
+        break;
+    case BB_STATS_NONE:
+        break;
+    }
+    handle_leave(prev);
+}
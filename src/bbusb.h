@@ -0,0 +1,141 @@
+#ifndef __BBUSB_H__
+#define __BBUSB_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+//libbbusb: keeps a sign open and updates it from within another program.
+//
+//A handle holds the sign's device, the layout last given to bb_reconfigure()
+//(which file on the sign holds what) and what was last sent, so that only
+//changed STRINGs go out on each bb_commit(). A handle may only be used by one
+//thread at a time, but separate handles may be used from separate threads.
+
+#include <stdio.h>
+
+typedef struct bb_handle bb_handle;
+
+//Log levels, as passed to a bb_log_func:
+#define BB_LOG_ERROR 0
+#define BB_LOG_INFO 1
+#define BB_LOG_DEBUG 2
+
+//text is a whole line (ending with '\n') or the start of one.
+typedef void (*bb_log_func)(void* arg, int level, const char* text);
+
+//The sign isn't opened until it's first needed, see bb_connect().
+bb_handle* bb_open(void);
+void bb_close(bb_handle* handle);
+
+//Sends the handle's output at or below level to func instead of stdout/stderr
+//(or to stdout/stderr at that level, if func is NULL). Until this is called,
+//a handle logs like the rest of the program does.
+void bb_set_log(bb_handle* handle, int level, bb_log_func func, void* arg);
+
+//Picks which sign the handle talks to, for hosts with several: NULL for the
+//first one found (the default), a USB port path like "1-1.4" (bus-port.port...,
+//as in /sys/bus/usb/devices), "serial=<serial number>", or "fd=<n>" for the
+//sign's usbfs node already opened on fd n. Takes effect from the next update,
+//closing the current sign if it's open.
+int bb_set_device(bb_handle* handle, const char* device);
+
+//How long an update keeps at it after the sign stops responding or is unplugged,
+//reopening it (as soon as it's back, where hotplug events are supported) and
+//sending again with a growing backoff. 0 to just reset and retry once.
+#define BB_RETRY_DEFAULT_MS 15000
+void bb_set_retry(bb_handle* handle, int retry_ms);
+//Waits up to timeout_ms for the sign to be plugged back in, or for fd (if >= 0)
+//to be readable, eg to resend an update which failed for want of the sign.
+//Returns 1 if fd is readable, 0 otherwise.
+int bb_wait(bb_handle* handle, int fd, int timeout_ms);
+
+//Opens the sign now rather than on the first update. Returns <0 on failure.
+int bb_connect(bb_handle* handle);
+
+//One message in the sign's display sequence, the same as a config file line.
+struct bb_message {
+    const char* mode;//eg "a", "b", "nb": as in the config file
+    const char* text;//markup, or NULL for a 2-char special mode
+    int dynamic;//1: a STRING slot like a "cmd" line, with text as its initial contents
+};
+
+//Replaces the sign's display sequence. The dynamic messages become slots
+//0,1,2... for bb_set_string(). Nothing is sent until bb_commit(), which will
+//then send everything which has changed, only reallocating the sign's memory
+//(which blanks it) if the messages don't fit in what's already allocated.
+//Returns -2 if the messages are invalid or don't fit on the sign.
+int bb_reconfigure(bb_handle* handle, const struct bb_message* messages, int count);
+//Sets the contents (markup) of a dynamic message, sent on the next bb_commit().
+int bb_set_string(bb_handle* handle, int slot, const char* text);
+//Sends whatever has changed since the last commit.
+int bb_commit(bb_handle* handle);
+
+//Parses a config file (running its cmds) and sends it, as "bbusb -i/-u" does.
+//init may reallocate the sign's memory, replacing any bb_reconfigure() layout
+//on the sign until it's next committed. Returns -2 for a bad/empty config.
+int bb_run_config(bb_handle* handle, FILE* config, const char* name, int init);
+//bb_run_config() for several handles (signs, see bb_set_device()) at once: the
+//config is parsed and its cmds run just once, then it's sent to every sign
+//from a thread of its own, each skipping whatever its sign already has.
+//The handles mustn't be used elsewhere until this returns. Output goes to
+//each handle's log, and parse errors to the first's. Each sign's result goes
+//in results (if non-NULL). Returns -2 for a bad/empty config, -1 if any sign
+//failed, 0 if all of them were updated.
+int bb_run_config_all(bb_handle** handles, int count, FILE* config, const char* name,
+                      int init, int* results);
+
+//Sets the sign's clock to this host's local time, for <time>/<date>/<weekday>
+//markup to show without any further updates. Takes until the start of the
+//next minute. use_24h: show <time> as 13:00 rather than 1:00PM.
+int bb_set_clock(bb_handle* handle, int use_24h);
+//bb_set_clock() for several handles at once, each from a thread of its own,
+//so that every sign is set to the same minute after a single wait. Handles and
+//results are as in bb_run_config_all(). Returns -1 if any sign failed.
+int bb_set_clock_all(bb_handle** handles, int count, int use_24h, int* results);
+//How long bb_set_clock() would wait before sending, in ms: until the start of
+//the next minute, or 0 in a minute's first second, which it sends right away.
+//Lets a caller with other things to do call bb_set_clock() only once it's due.
+int bb_clock_wait_ms(void);
+
+//Shows text (with markup) ahead of everything else on the sign, without
+//touching its memory layout, until bb_clear_alert(). mode is a txt line's mode,
+//eg "b" or "nt". A NULL text clears it. Returns -2 for a bad mode.
+int bb_alert(bb_handle* handle, const char* mode, const char* text);
+int bb_clear_alert(bb_handle* handle);
+
+//Whether the sign is open, eg to tell a bad config from a missing sign.
+int bb_is_open(bb_handle* handle);
+
+//Last-sent state, to carry it over between processes. This includes where the
+//sign was opened, to open it without looking through the bus next time.
+//A missing file is treated as nothing having been sent.
+int bb_load_state(bb_handle* handle, const char* path);
+int bb_save_state(bb_handle* handle, const char* path);
+
+//Logs the stats of the last update on this handle.
+enum bb_stats_format {
+    BB_STATS_NONE = 0,
+    BB_STATS_TEXT,//"stats <key> <value>" lines
+    BB_STATS_JSON,//a one-line JSON object
+    BB_STATS_TIMING//a one line summary of where the time went
+};
+void bb_log_stats(bb_handle* handle, int status, enum bb_stats_format format);
+
+#endif
@@ -0,0 +1,347 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Parser and packet builder microbenchmarks
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "arena.h"
+#include "config.h"
+#include "infile.h"
+#include "packet.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//Times the config parser and packet builders on synthetic input, after
+//checking that what they produce still hashes to the golden values below.
+//Update those only for changes which are meant to change the sign's input.
+#define GOLDEN_MARKUP 0x3470a546c6e2529eULL
+#define GOLDEN_PACKETS 0x6c6ba768de4cea53ULL
+#define GOLDEN_PARSEFILE 0x1428357f5c4c56bdULL
+
+#define BENCH_MIN_NS 200000000LL//run each case for at least this long
+
+#ifdef BENCH_COUNT_ALLOCS
+//linked with -Wl,--wrap: counts allocations made by libbbusb and ourselves
+static long allocs = 0;
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+char* __real_strdup(const char* s);
+void* __wrap_malloc(size_t size) {
+    ++allocs;
+    return __real_malloc(size);
+}
+void* __wrap_calloc(size_t nmemb, size_t size) {
+    ++allocs;
+    return __real_calloc(nmemb, size);
+}
+void* __wrap_realloc(void* ptr, size_t size) {
+    ++allocs;
+    return __real_realloc(ptr, size);
+}
+char* __wrap_strdup(const char* s) {
+    ++allocs;
+    return __real_strdup(s);
+}
+#define ALLOCS allocs
+#else
+#define ALLOCS 0L
+#endif
+
+static long long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec*1000000000LL + now.tv_nsec;
+}
+
+static uint64_t hash_add(uint64_t hash, const char* data, size_t len) {
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+#define HASH_INIT 0xcbf29ce484222325ULL
+
+//deterministic text with a mix of plain words, markup and bad markup
+static void make_text(char* out, size_t len, unsigned int seed) {
+    static const char* pieces[] = {
+        "hello ", "world ", "12:34 ", "<color303>", "<scolor120>", "&rightarrow;",
+        "&euro;", "<br>", "<blink>", "</blink>", "<speed3>", "<wide>", "</wide>",
+        "<shadow>", "&heart;", "<bogus>", "&nope;", "<", "&", "x", "Price: $5 "
+    };
+    size_t count = sizeof(pieces)/sizeof(pieces[0]), pos = 0;
+    while (pos < len) {
+        seed = seed*1103515245 + 12345;
+        const char* piece = pieces[(seed >> 16) % count];
+        size_t piecelen = strlen(piece);
+        if (pos + piecelen > len) {
+            piecelen = len - pos;
+        }
+        memcpy(&out[pos], piece, piecelen);
+        pos += piecelen;
+    }
+    out[len] = '\0';
+}
+
+//a config with 'txts' txt lines and 'cmds' cmd lines
+static char* make_config(int txts, int cmds, size_t textlen) {
+    size_t buflen = (txts + cmds) * (textlen + 64) + 1, pos = 0;
+    char* config = malloc(buflen);
+    char* text = malloc(textlen + 1);
+    int i;
+    for (i = 0; i < txts; i++) {
+        make_text(text, textlen, i);
+        pos += snprintf(&config[pos], buflen - pos, "txt %c %s\n", "abcm"[i % 4], text);
+    }
+    for (i = 0; i < cmds; i++) {
+        pos += snprintf(&config[pos], buflen - pos,
+                "cmd b echo 'line %d <color030>&rightarrow; value %d'\n", i, i*7);
+    }
+    free(text);
+    return config;
+}
+
+static void report(const char* name, size_t size, size_t bytes,
+                   long iters, long long ns, long allocs_used) {
+    printf("%-24s %6lu %6lu %9ld %12.1f %9.2f %11.2f\n", name,
+            (unsigned long)size, (unsigned long)bytes, iters,
+            (double)ns/iters, (bytes > 0) ? (double)ns/iters/bytes : 0.0,
+            (double)allocs_used/iters);
+}
+
+//Each case builds one output from 'in' into the arena, and returns its length.
+typedef int (*bench_fn)(struct arena* arena, char** out, char* in, size_t size);
+
+static int do_markup(struct arena* arena, char** out, char* in, size_t size) {
+    int trimmed = 0;
+    if (parse_inline_cmds(arena, out, &trimmed, in, (unsigned int)size) < 0) {
+        return -1;
+    }
+    return strlen(*out);
+}
+static int do_text(struct arena* arena, char** out, char* in, size_t size) {
+    (void)size;
+    return packet_buildtext(arena, out, 0x20, 'a', NO_SPECIAL, in);
+}
+static int do_string(struct arena* arena, char** out, char* in, size_t size) {
+    (void)size;
+    return packet_buildstring(arena, out, 0x21, in);
+}
+
+//frame lists for memconf/runseq, alternating TEXTs and STRINGs.
+//Only rebuilt when the case changes, so that it isn't part of the timing.
+static struct bb_frame frames[46];
+static struct bb_frame* make_frames(int count, char* text) {
+    static int last_count = 0;
+    static char* last_text = NULL;
+    if (count == last_count && text == last_text) {
+        return frames;
+    }
+    last_count = count;
+    last_text = text;
+    int i;
+    char filename = 0;
+    for (i = 0; i < count; i++) {
+        filename = packet_next_filename(filename);
+        frames[i].filename = filename;
+        frames[i].frame_type = (i % 2 == 0) ? TEXT_FRAME_TYPE : STRING_FRAME_TYPE;
+        frames[i].mode = 'a';
+        frames[i].mode_special = NO_SPECIAL;
+        frames[i].data = text;
+        frames[i].next = (i + 1 < count) ? &frames[i+1] : NULL;
+    }
+    return frames;
+}
+static int do_memconf(struct arena* arena, char** out, char* in, size_t size) {
+    return packet_buildmemconf(arena, out, make_frames((int)size, in));
+}
+static int do_runseq(struct arena* arena, char** out, char* in, size_t size) {
+    return packet_buildrunseq(arena, out, make_frames((int)size, in));
+}
+
+static int do_parsefile(struct arena* arena, char** out, char* in, size_t size) {
+    FILE* file = fmemopen(in, strlen(in), "r");
+    struct bb_frame* head = NULL;
+    int ret = parsefile(arena, &head, file, NULL);
+    fclose(file);
+    if (ret < 0) {
+        return -1;
+    }
+    //flatten the frames into one buffer, for hashing:
+    size_t len = 0;
+    struct bb_frame* frame;
+    for (frame = head; frame != NULL; frame = frame->next) {
+        len += 4 + ((frame->data == NULL) ? 0 : strlen(frame->data));
+    }
+    char* flat = arena_alloc(arena, len + 1);
+    size_t pos = 0;
+    for (frame = head; frame != NULL; frame = frame->next) {
+        flat[pos++] = frame->filename;
+        flat[pos++] = (char)frame->frame_type;
+        flat[pos++] = frame->mode;
+        flat[pos++] = frame->mode_special;
+        if (frame->data != NULL) {
+            memcpy(&flat[pos], frame->data, strlen(frame->data));
+            pos += strlen(frame->data);
+        }
+    }
+    (void)size;
+    *out = flat;
+    return (int)pos;
+}
+
+struct bench_case {
+    const char* name;
+    bench_fn fn;
+    size_t size;//passed to fn: output cap, frame count, ...
+    size_t inlen;//generated input text length
+    int golden;//which golden hash it's part of, also says what ns/byte is per:
+};
+#define GOLDEN_PACKET_SET 1//ns per byte of output packet, otherwise per byte of input
+
+#define GOLDEN_SETS 3
+static const char* golden_names[GOLDEN_SETS] = { "markup", "packets", "parsefile" };
+static const uint64_t golden_hashes[GOLDEN_SETS] = {
+    GOLDEN_MARKUP, GOLDEN_PACKETS, GOLDEN_PARSEFILE
+};
+
+static const struct bench_case cases[] = {
+    {"parse_inline_cmds", do_markup, 16, 16, 0},
+    {"parse_inline_cmds", do_markup, 125, 125, 0},
+    {"parse_inline_cmds", do_markup, 512, 512, 0},
+    {"parse_inline_cmds", do_markup, 4096, 4096, 0},
+    {"parse_inline_cmds", do_markup, 4096, 16384, 0},//truncated
+    {"packet_buildtext", do_text, 16, 16, 1},
+    {"packet_buildtext", do_text, 512, 512, 1},
+    {"packet_buildtext", do_text, 4096, 4096, 1},
+    {"packet_buildstring", do_string, 16, 16, 1},
+    {"packet_buildstring", do_string, 125, 125, 1},
+    {"packet_buildmemconf", do_memconf, 1, 128, 1},
+    {"packet_buildmemconf", do_memconf, 46, 128, 1},
+    {"packet_buildrunseq", do_runseq, 1, 128, 1},
+    {"packet_buildrunseq", do_runseq, 46, 128, 1},
+    {NULL, NULL, 0, 0, 0}
+};
+
+//parsefile() inputs: txt count, cmd count, txt length
+static const int configs[][3] = {
+    {1, 0, 64}, {40, 0, 64}, {40, 0, 1024}, {6, 8, 64}, {0, 0, 0}
+};
+
+//runs fn until BENCH_MIN_NS has passed, resetting the arena after each call
+static void bench(const char* name, bench_fn fn, char* in, size_t size, int per_output) {
+    struct arena arena;
+    arena_init(&arena);
+    char* out;
+    int outlen = fn(&arena, &out, in, size);//warm up the arena and any lazy init
+    arena_reset(&arena);
+    size_t bytes = per_output ? (size_t)outlen : strlen(in);
+
+    long iters = 0, batch = 1;
+    long allocs_start = ALLOCS;
+    long long start = now_ns(), elapsed;
+    do {
+        long i;
+        for (i = 0; i < batch; i++) {
+            fn(&arena, &out, in, size);
+            arena_reset(&arena);
+        }
+        iters += batch;
+        batch *= 2;
+    } while ((elapsed = now_ns() - start) < BENCH_MIN_NS);
+    report(name, size, bytes, iters, elapsed, ALLOCS - allocs_start);
+    arena_free(&arena);
+}
+
+int main(int argc, char* argv[]) {
+    config_fout = stdout;
+    config_ferr = stderr;
+    int check_only = (argc > 1 && strcmp(argv[1], "--check") == 0);
+    if (argc > 1 && !check_only) {
+        printf("Usage: %s [--check]\n", argv[0]);
+        printf("  --check: only compare outputs against the golden hashes\n");
+        return -1;
+    }
+
+    //golden check: every case once, hashing what it produced
+    uint64_t hashes[GOLDEN_SETS] = { HASH_INIT, HASH_INIT, HASH_INIT };
+    struct arena arena;
+    arena_init(&arena);
+    int i, failed = 0;
+    for (i = 0; cases[i].name != NULL; i++) {
+        char* in = malloc(cases[i].inlen + 1);
+        char* out;
+        make_text(in, cases[i].inlen, i);
+        int len = cases[i].fn(&arena, &out, in, cases[i].size);
+        if (len >= 0) {
+            hashes[cases[i].golden] = hash_add(hashes[cases[i].golden], out, len);
+        }
+        arena_reset(&arena);
+        free(in);
+    }
+    for (i = 0; configs[i][0] != 0 || configs[i][1] != 0; i++) {
+        char* config = make_config(configs[i][0], configs[i][1], configs[i][2]);
+        char* out;
+        int len = do_parsefile(&arena, &out, config, 0);
+        if (len >= 0) {
+            hashes[2] = hash_add(hashes[2], out, len);
+        }
+        arena_reset(&arena);
+        free(config);
+    }
+    arena_free(&arena);
+    for (i = 0; i < GOLDEN_SETS; i++) {
+        if (hashes[i] == golden_hashes[i]) {
+            printf("golden %-10s ok\n", golden_names[i]);
+        } else {
+            printf("golden %-10s MISMATCH: got %016llx, expected %016llx\n", golden_names[i],
+                    (unsigned long long)hashes[i], (unsigned long long)golden_hashes[i]);
+            failed = 1;
+        }
+    }
+    if (failed || check_only) {
+        return failed ? 1 : 0;
+    }
+
+    //size: output cap (markup), text length (text/string) or frame count (memconf/runseq)
+    //bytes: input length, or output packet length for the packet builders
+    printf("\n%-24s %6s %6s %9s %12s %9s %11s\n",
+            "function", "size", "bytes", "iters", "ns/call", "ns/byte", "allocs/call");
+    for (i = 0; cases[i].name != NULL; i++) {
+        char* in = malloc(cases[i].inlen + 1);
+        make_text(in, cases[i].inlen, i);
+        bench(cases[i].name, cases[i].fn, in, cases[i].size,
+                cases[i].golden == GOLDEN_PACKET_SET);
+        free(in);
+    }
+    for (i = 0; configs[i][0] != 0 || configs[i][1] != 0; i++) {
+        char* config = make_config(configs[i][0], configs[i][1], configs[i][2]);
+        char name[32];
+        snprintf(name, sizeof(name), "parsefile %dtxt/%dcmd", configs[i][0], configs[i][1]);
+        bench(name, do_parsefile, config, configs[i][2], 0);
+        free(config);
+    }
+    return 0;
+}
@@ -0,0 +1,177 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Command output cache
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#define _GNU_SOURCE //mkostemp()
+
+#include "cmdcache.h"
+#include "config.h"
+#include "sentstate.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+//shared by every handle, which may be updating from threads of their own:
+static char* cache_dir = NULL;
+static int cache_hits = 0, cache_misses = 0;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int mkdir_p(char* path) {
+    char* slash = path;
+    while ((slash = strchr(slash+1, '/')) != NULL) {
+        *slash = '\0';
+        int ret = mkdir(path, 0700);
+        *slash = '/';
+        if (ret < 0 && errno != EEXIST) {
+            return -1;
+        }
+    }
+    return (mkdir(path, 0700) < 0 && errno != EEXIST) ? -1 : 0;
+}
+
+//with cache_lock held
+static int init_locked(const char* dir) {
+    char path[1024];
+    if (dir != NULL) {
+        snprintf(path, sizeof(path), "%s", dir);
+    } else if (getenv("XDG_CACHE_HOME") != NULL) {
+        snprintf(path, sizeof(path), "%s/bbusb", getenv("XDG_CACHE_HOME"));
+    } else if (getenv("HOME") != NULL) {
+        snprintf(path, sizeof(path), "%s/.cache/bbusb", getenv("HOME"));
+    } else {
+        config_error("Unable to find a directory for the command cache, set $HOME or --cache-dir.");
+        return -1;
+    }
+    if (mkdir_p(path) < 0) {
+        config_error("Unable to create cache directory %s: %s", path, strerror(errno));
+        return -1;
+    }
+    free(cache_dir);
+    cache_dir = strdup(path);
+    return (cache_dir == NULL) ? -1 : 0;
+}
+
+int cmdcache_init(const char* dir) {
+    pthread_mutex_lock(&cache_lock);
+    int ret = init_locked(dir);
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+//Finds the command's entry, setting up the default cache dir on first use.
+static int entry_path(char* path, size_t pathlen, const char* command) {
+    //the same hash used for sign state (64-bit FNV-1a) makes for short filenames:
+    uint64_t hash = sentstate_hash(command, strlen(command));
+    pthread_mutex_lock(&cache_lock);
+    int ret = (cache_dir == NULL) ? init_locked(NULL) : 0;
+    if (ret == 0) {
+        snprintf(path, pathlen, "%s/%016" PRIx64, cache_dir, hash);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return ret;
+}
+
+static char* count_result(char* data) {
+    pthread_mutex_lock(&cache_lock);
+    if (data != NULL) {
+        ++cache_hits;
+    } else {
+        ++cache_misses;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return data;
+}
+
+char* cmdcache_get(const char* command, int ttl_secs) {
+    char path[1100];
+    if (entry_path(path, sizeof(path), command) < 0) {
+        return NULL;
+    }
+
+    FILE* file = fopen(path, "re");
+    if (file == NULL) {
+        return count_result(NULL);
+    }
+    struct stat st;
+    if (fstat(fileno(file), &st) < 0 || st.st_size <= 0 ||
+        (ttl_secs >= 0 && time(NULL) - st.st_mtime > ttl_secs)) {
+        fclose(file);
+        return count_result(NULL);
+    }
+
+    //entry is the command on the first line (to catch hash collisions), then output
+    size_t size = st.st_size;
+    char* data = malloc(size+1);
+    if (data == NULL || fread(data, 1, size, file) != size) {
+        free(data);
+        fclose(file);
+        return count_result(NULL);
+    }
+    fclose(file);
+    data[size] = '\0';
+
+    size_t cmdlen = strlen(command);
+    if (size <= cmdlen || strncmp(data, command, cmdlen) != 0 || data[cmdlen] != '\n') {
+        free(data);
+        return count_result(NULL);
+    }
+    memmove(data, &data[cmdlen+1], size-cmdlen);//includes the \0
+    return count_result(data);
+}
+
+void cmdcache_put(const char* command, const char* output) {
+    char path[1100], tmppath[1200];
+    if (entry_path(path, sizeof(path), command) < 0) {
+        return;
+    }
+    snprintf(tmppath, sizeof(tmppath), "%s.XXXXXX", path);
+
+    //write then rename, so that a concurrent reader never sees half an entry,
+    //from a file of our own, as other threads/processes may be writing it too:
+    int fd = mkostemp(tmppath, O_CLOEXEC);
+    FILE* file = (fd < 0) ? NULL : fdopen(fd, "w");
+    if (file == NULL) {
+        config_error("Unable to write cache entry %s: %s", tmppath, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmppath);
+        }
+        return;
+    }
+    fprintf(file, "%s\n%s", command, output);
+    if (fclose(file) != 0 || rename(tmppath, path) < 0) {
+        config_error("Unable to write cache entry %s: %s", path, strerror(errno));
+        unlink(tmppath);
+    }
+}
+
+void cmdcache_counts(int* hits, int* misses) {
+    pthread_mutex_lock(&cache_lock);
+    *hits = cache_hits;
+    *misses = cache_misses;
+    pthread_mutex_unlock(&cache_lock);
+}
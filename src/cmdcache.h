@@ -0,0 +1,37 @@
+#ifndef __CMDCACHE_H__
+#define __CMDCACHE_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+//On-disk cache of cmd output, for cmd lines with a "ttl=<secs>" option.
+//Entries are keyed by the command string.
+
+//Uses $XDG_CACHE_HOME/bbusb (or ~/.cache/bbusb) if dir is NULL.
+int cmdcache_init(const char* dir);
+
+//Returns a malloc()ed copy of the command's cached output if it's at most
+//ttl_secs old (any age if ttl_secs < 0), or NULL if there isn't one.
+char* cmdcache_get(const char* command, int ttl_secs);
+void cmdcache_put(const char* command, const char* output);
+
+void cmdcache_counts(int* hits, int* misses);
+
+#endif
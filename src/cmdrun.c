@@ -0,0 +1,318 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Concurrent command execution
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#define _GNU_SOURCE //pipe2()
+
+#include "cmdrun.h"
+#include "config.h"
+#include "timing.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+extern char** environ;
+
+//Builtins which the shell runs in place of any program of the same name on
+//$PATH: POSIX's special and regular builtins, plus the ones that sh
+//implementations commonly build in (eg dash's echo, which doesn't take the
+//same options as the one in /bin). Commands starting with these always go
+//through the shell.
+static const char* const shell_builtins[] = {
+    ".", "break", "continue", "eval", "exec", "exit", "export", "readonly",
+    "return", "set", "shift", "times", "trap", "unset",
+    "alias", "bg", "cd", "command", "false", "fc", "fg", "getopts", "hash",
+    "jobs", "kill", "newgrp", "pwd", "read", "true", "type", "ulimit", "umask",
+    "unalias", "wait",
+    "echo", "printf", "test", "[", "local", "time",
+    NULL
+};
+
+static int is_shell_builtin(const char* word) {
+    int i;
+    for (i = 0; shell_builtins[i] != NULL; i++) {
+        if (strcmp(word, shell_builtins[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//A command made of nothing but plain words (no quotes, expansions, redirects,
+//globs, variable assignments...) is run directly, without a shell in between,
+//unless its first word is a shell builtin.
+//Returns its words, NULL-terminated, in a single malloc()ed block, or NULL if
+//it needs the shell.
+static char** split_command(const char* command) {
+    int words = 0, inword = 0;
+    const char* c;
+    for (c = command; *c != '\0'; c++) {
+        if (*c == ' ' || *c == '\t') {
+            inword = 0;
+            continue;
+        }
+        if (!isalnum((unsigned char)*c) && strchr("-_./,:+@%^=", *c) == NULL) {
+            return NULL;
+        }
+        if (!inword) {
+            inword = 1;
+            ++words;
+        }
+        if (*c == '=' && words == 1) {
+            return NULL;//"VAR=value cmd"
+        }
+    }
+    if (words == 0) {
+        return NULL;
+    }
+
+    size_t len = strlen(command) + 1;
+    char** argv = malloc((words + 1)*sizeof(char*) + len);
+    if (argv == NULL) {
+        return NULL;
+    }
+    char* copy = (char*)&argv[words + 1];
+    memcpy(copy, command, len);
+    int i = 0;
+    char *word, *save;
+    for (word = strtok_r(copy, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save)) {
+        argv[i++] = word;
+    }
+    argv[i] = NULL;
+    if (is_shell_builtin(argv[0])) {
+        free(argv);
+        return NULL;
+    }
+    return argv;
+}
+
+//Starts the command with posix_spawn(), which doesn't copy our memory the way
+//fork() would, directly if split_command() allows it or through /bin/sh if not.
+//Anything which can't be run directly (eg a shell builtin like "cd") is left
+//to the shell, where the C library reports failed execs (glibc, musl).
+static int job_spawn(struct cmdrun_job* job, int outfd, pid_t* pid, int* direct) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, outfd, STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, outfd);
+    posix_spawnattr_init(&attr);
+    //own process group, so that a timeout kills the whole pipeline:
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    int ret = -1;
+    char** argv = (job->shell) ? NULL : split_command(job->command);
+    if (argv != NULL) {
+        ret = posix_spawnp(pid, argv[0], &actions, &attr, argv, environ);
+        free(argv);
+    }
+    *direct = (ret == 0);
+    if (ret != 0) {
+        char* shargv[] = { "sh", "-c", (char*)job->command, NULL };
+        ret = posix_spawn(pid, "/bin/sh", &actions, &attr, shargv, environ);
+    }
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return ret;
+}
+
+static int job_start(struct cmdrun_job* job) {
+    job->start_us = timing_now_us();
+    int fds[2];
+    //neither end may leak into other commands, including ones started by
+    //other handles' threads meanwhile: a stray write end would keep ours from
+    //seeing EOF. The child's stdout is dup2()ed from fds[1], clearing it there.
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        config_error("Unable to create pipe for command \"%s\": %s",
+                job->command, strerror(errno));
+        return -1;
+    }
+
+    pid_t pid;
+    int direct;
+    int ret = job_spawn(job, fds[1], &pid, &direct);
+    close(fds[1]);
+    if (ret != 0) {
+        config_error("Unable to start command \"%s\": %s",
+                job->command, strerror(ret));
+        close(fds[0]);
+        return -1;
+    }
+    config_debug("Started \"%s\" %s in %lldus", job->command,
+            (direct) ? "directly" : "through /bin/sh", timing_now_us() - job->start_us);
+
+    job->pid = pid;
+    job->fd = fds[0];
+    reader_init_fd(&job->reader, fds[0], job->max_output);
+    job->output = NULL;
+    job->outputlen = 0;
+    job->deadline_us = job->start_us + (long long)job->timeout_ms*1000;
+    return 0;
+}
+
+//collects the child's exit status, returning 0 if it exited successfully
+static int job_wait(struct cmdrun_job* job, int options) {
+    int status;
+    pid_t ret;
+    while ((ret = waitpid(job->pid, &status, options)) < 0 && errno == EINTR) {
+    }
+    if (ret == 0) {
+        return 1;//still running
+    }
+    job->pid = 0;
+    if (ret < 0) {
+        return -1;
+    }
+    return (WIFEXITED(status) && WEXITSTATUS(status) == 0) ? 0 : -1;
+}
+
+static void job_finish(struct cmdrun_job* job, enum cmdrun_status_t status) {
+    if (job->fd >= 0) {
+        close(job->fd);
+        job->fd = -1;
+    }
+    if (job->pid > 0) {
+        //timed out or failed: take down anything it started too
+        kill(-job->pid, SIGKILL);
+        kill(job->pid, SIGKILL);
+        job_wait(job, 0);
+    }
+    job->status = status;
+    job->elapsed_us = timing_now_us() - job->start_us;
+    int truncated = job->reader.truncated;
+    if (status == CMDRUN_OK) {
+        job->output = reader_take(&job->reader, &job->outputlen);
+    }
+    reader_close(&job->reader);
+    if (status != CMDRUN_OK) {
+        if (status == CMDRUN_TIMEDOUT) {
+            config_error("Error: Command \"%s\" timed out after %dms.",
+                    job->command, job->timeout_ms);
+        } else {
+            config_error("Error: Command \"%s\" returned an error.", job->command);
+        }
+        return;
+    }
+    if (job->output == NULL) {
+        job->status = CMDRUN_FAILED;
+        return;
+    }
+    if (truncated) {
+        config_debug("Output of \"%s\" was cut off at %d bytes.",
+                job->command, (int)job->max_output);
+    }
+}
+
+int cmdrun_all(struct cmdrun_job* jobs, int count) {
+    struct pollfd pollfds[CMDRUN_MAX_PARALLEL];
+    int running[CMDRUN_MAX_PARALLEL];
+    int runcount = 0, next = 0, i;
+
+    for (i = 0; i < count; i++) {
+        memset(&jobs[i].reader, 0, sizeof(struct reader));
+        jobs[i].fd = -1;
+        jobs[i].pid = 0;
+        jobs[i].output = NULL;
+        jobs[i].outputlen = 0;
+        jobs[i].status = CMDRUN_FAILED;
+    }
+
+    while (next < count || runcount > 0) {
+        //top up the pool:
+        while (next < count && runcount < CMDRUN_MAX_PARALLEL) {
+            struct cmdrun_job* job = &jobs[next++];
+            if (job_start(job) < 0) {
+                job_finish(job, CMDRUN_FAILED);
+                continue;
+            }
+            running[runcount++] = next-1;
+        }
+        if (runcount == 0) {
+            break;
+        }
+
+        //wait for output from any of them, up to the nearest deadline:
+        long long now = timing_now_us(), wait_us = -1;
+        for (i = 0; i < runcount; i++) {
+            struct cmdrun_job* job = &jobs[running[i]];
+            long long remaining = job->deadline_us - now;
+            if (remaining < 0) {
+                remaining = 0;
+            }
+            if (job->fd < 0 && remaining > 10000) {
+                remaining = 10000;//output closed, poll for exit
+            }
+            if (wait_us < 0 || remaining < wait_us) {
+                wait_us = remaining;
+            }
+            pollfds[i].fd = job->fd;//ignored by poll() when <0
+            pollfds[i].events = POLLIN;
+            pollfds[i].revents = 0;
+        }
+        if (poll(pollfds, runcount, (int)((wait_us+999)/1000)) < 0 && errno != EINTR) {
+            config_error("Error waiting for commands: %s", strerror(errno));
+            return -1;
+        }
+
+        now = timing_now_us();
+        for (i = 0; i < runcount; i++) {
+            struct cmdrun_job* job = &jobs[running[i]];
+            int done = 0;
+            if (job->fd >= 0 && pollfds[i].revents != 0) {
+                int ret = reader_fill(&job->reader);
+                if (ret < 0) {
+                    job_finish(job, CMDRUN_FAILED);
+                    done = 1;
+                } else if (ret == 0) {
+                    close(job->fd);
+                    job->fd = -1;
+                }
+            }
+            if (!done && job->fd < 0) {
+                int ret = job_wait(job, WNOHANG);
+                if (ret <= 0) {
+                    job_finish(job, (ret == 0) ? CMDRUN_OK : CMDRUN_FAILED);
+                    done = 1;
+                }
+            }
+            if (!done && now >= job->deadline_us) {
+                job_finish(job, CMDRUN_TIMEDOUT);
+                done = 1;
+            }
+            if (done) {
+                //swap out of the running set, revisit whatever took its place:
+                --runcount;
+                running[i] = running[runcount];
+                pollfds[i] = pollfds[runcount];
+                --i;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,59 @@
+#ifndef __CMDRUN_H__
+#define __CMDRUN_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "reader.h"
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define CMDRUN_DEFAULT_TIMEOUT_MS 30000
+#define CMDRUN_MAX_PARALLEL 8 //commands allowed to run at once
+
+enum cmdrun_status_t { CMDRUN_OK = 0, CMDRUN_FAILED, CMDRUN_TIMEDOUT };
+
+struct cmdrun_job {
+    const char* command;
+    int timeout_ms;
+    size_t max_output;//output past this many bytes is discarded
+    int shell;//always run through /bin/sh, even if it's just plain words
+
+    //results, filled in by cmdrun_all():
+    enum cmdrun_status_t status;
+    char* output;//\0-terminated, owned by the job (free() it)
+    size_t outputlen;
+    long long elapsed_us;
+
+    //internal state:
+    pid_t pid;
+    int fd;
+    struct reader reader;
+    long long start_us, deadline_us;
+};
+
+//Runs all of the jobs' commands (through the shell, unless they're just plain
+//words which don't start with a shell builtin), up to CMDRUN_MAX_PARALLEL at a
+//time, and collects their output. Commands which don't finish before their
+//timeout are killed. Returns <0 only if commands couldn't be started at all.
+int cmdrun_all(struct cmdrun_job* jobs, int count);
+
+#endif
@@ -0,0 +1,98 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Checks that cmd lines give the same output with or without the shell
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "cmdrun.h"
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+//Each command is run as cmdrun_all() picks (directly if it's plain words) and
+//then forced through /bin/sh, which is how every cmd line used to be run. The
+//sign's contents depend on their output, so it has to match byte for byte.
+static const char* commands[] = {
+    //builtins, which have to keep going through the shell:
+    "echo -e plain words",
+    "echo -n -e no newline",
+    "printf %s:%s:%d a b 3",
+    "test -d /",
+    "[ -f / ]",
+    "pwd",
+    "true",
+    "false",
+    "type sh",
+    //programs, run directly:
+    "uname -s",
+    "expr 6 + 7",
+    "ls -d /",
+    "cat /dev/null",
+    "date +%Y",
+    //not found, left to the shell to report:
+    "bbusb-no-such-command arg",
+    NULL
+};
+
+int main() {
+    config_fout = stdout;
+    config_ferr = stderr;
+    int count, failed = 0;
+    for (count = 0; commands[count] != NULL; count++) {
+    }
+
+    struct cmdrun_job* jobs = calloc(2*count, sizeof(struct cmdrun_job));
+    if (jobs == NULL) {
+        printf("Memory allocation error!\n");
+        return 1;
+    }
+    int i;
+    for (i = 0; i < 2*count; i++) {
+        jobs[i].command = commands[i/2];
+        jobs[i].timeout_ms = CMDRUN_DEFAULT_TIMEOUT_MS;
+        jobs[i].max_output = 4096;
+        jobs[i].shell = i % 2;
+    }
+    if (cmdrun_all(jobs, 2*count) < 0) {
+        printf("Unable to run commands\n");
+        return 1;
+    }
+
+    for (i = 0; i < count; i++) {
+        struct cmdrun_job* plain = &jobs[2*i], * shell = &jobs[2*i + 1];
+        //failed commands' output is discarded, leaving just their status:
+        const char* plainout = (plain->output != NULL) ? plain->output : "";
+        const char* shellout = (shell->output != NULL) ? shell->output : "";
+        if (plain->status != shell->status ||
+                plain->outputlen != shell->outputlen ||
+                memcmp(plainout, shellout, plain->outputlen) != 0) {
+            printf("MISMATCH \"%s\": status %d \"%s\", through /bin/sh status %d \"%s\"\n",
+                    commands[i], plain->status, plainout, shell->status, shellout);
+            ++failed;
+        } else {
+            printf("ok \"%s\"\n", commands[i]);
+        }
+    }
+    for (i = 0; i < 2*count; i++) {
+        free(jobs[i].output);
+    }
+    free(jobs);
+    return (failed > 0) ? 1 : 0;
+}
@@ -19,54 +19,106 @@
 \************************************************************************/
 
 #include "config.h"
+#include "logwriter.h"
 
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdlib.h>
 
 FILE *config_fout, *config_ferr;
+int config_level = CONFIG_LEVEL_LOG;
+#ifdef __GNUC__
+__thread struct config_sink* config_thread_sink = NULL;
+#else
+_Thread_local struct config_sink* config_thread_sink = NULL;
+#endif
 
-int config_debug_enabled = 0;
-void config_debug(const char* format, ...) {
-    if (config_debug_enabled) {
-        va_list args;
-        va_start(args, format);
-        vfprintf(config_fout, format, args);
-        va_end(args);
-        fprintf(config_fout, "\n");
-    }
-}
-void config_debugnn(const char* format, ...) {
-    if (config_debug_enabled) {
-        va_list args;
-        va_start(args, format);
-        vfprintf(config_fout, format, args);
-        va_end(args);
+//where output goes when config_fout/config_ferr are NULL, if --log was given
+static struct logwriter* config_logwriter = NULL;
+
+static void close_log(void) {
+    if (config_logwriter != NULL) {
+        logwriter_close(config_logwriter);
+        config_logwriter = NULL;
     }
 }
 
-void config_log(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(config_fout, format, args);
-    va_end(args);
-    fprintf(config_fout, "\n");
+//whichever log is open at exit gets flushed, however many were opened before:
+static pthread_once_t close_log_once = PTHREAD_ONCE_INIT;
+static void close_log_atexit(void) {
+    atexit(close_log);
 }
-void config_lognn(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(config_fout, format, args);
-    va_end(args);
+
+int config_open_log(const char* path) {
+    FILE* file = fopen(path, "a");
+    if (file == NULL) {
+        return -1;
+    }
+    struct logwriter* writer = logwriter_open(file);
+    if (writer == NULL) {
+        fclose(file);
+        return -1;
+    }
+    close_log();
+    config_logwriter = writer;
+    config_fout = NULL;
+    config_ferr = NULL;
+    pthread_once(&close_log_once, close_log_atexit);//flushes whatever's still buffered
+    return 0;
 }
 
-void config_error(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(config_ferr, format, args);
-    va_end(args);
-    fprintf(config_ferr, "\n");
+#define FORMAT_BUFSIZE 512
+
+//formats a message for the log writer or a sink, which take whole strings
+static void write_formatted(int level, int newline, struct config_sink* sink,
+                            const char* format, va_list args) {
+    char stackbuf[FORMAT_BUFSIZE];
+    char* buf = stackbuf;
+    va_list copy;
+    va_copy(copy, args);
+    int len = vsnprintf(stackbuf, sizeof(stackbuf) - 1, format, copy);
+    va_end(copy);
+    if (len < 0) {
+        return;
+    }
+    if ((size_t)len >= sizeof(stackbuf) - 1) {
+        //too long for the stack buffer, format it again into one which fits
+        if ((buf = malloc(len + 2)) == NULL) {
+            return;
+        }
+        vsnprintf(buf, len + 1, format, args);
+    }
+    if (newline) {
+        buf[len++] = '\n';
+    }
+    buf[len] = '\0';
+    if (sink != NULL) {
+        sink->write(sink->arg, level, buf);
+    } else {
+        logwriter_write(config_logwriter, buf, len);
+    }
+    if (buf != stackbuf) {
+        free(buf);
+    }
 }
-void config_errornn(const char* format, ...) {
+
+void config_write(int level, int newline, const char* format, ...) {
+    FILE* out = (level == CONFIG_LEVEL_ERROR) ? config_ferr : config_fout;
+    struct config_sink* sink = config_thread_sink;
     va_list args;
     va_start(args, format);
-    vfprintf(config_ferr, format, args);
+    if (sink != NULL && sink->write != NULL) {
+        write_formatted(level, newline, sink, format, args);
+    } else if (out == NULL && config_logwriter != NULL) {
+        write_formatted(level, newline, NULL, format, args);
+    } else {
+        if (out == NULL) {
+            out = (level == CONFIG_LEVEL_ERROR) ? stderr : stdout;
+        }
+        vfprintf(out, format, args);
+        if (newline) {
+            fputc('\n', out);
+        }
+    }
     va_end(args);
 }
@@ -26,6 +26,7 @@
 #cmakedefine USE_LIBUSB_10
 #cmakedefine USE_LIBUSB_01
 #cmakedefine USE_NOUSB
+#cmakedefine USE_SIMUSB
 
 #cmakedefine DEBUG
 
@@ -38,18 +39,60 @@
 #ifdef USE_NOUSB
 #define USB_TYPE "nousb"
 #endif
+#ifdef USE_SIMUSB
+#define USB_TYPE "simusb"
+#endif
 
 #include <stdio.h>
 
-extern int config_debug_enabled;
-extern FILE *config_fout;
-extern FILE *config_ferr;
+//Log levels, messages at a level above CONFIG_MAX_LEVEL are compiled out.
+#define CONFIG_LEVEL_ERROR 0
+#define CONFIG_LEVEL_LOG 1
+#define CONFIG_LEVEL_DEBUG 2
+#define CONFIG_MAX_LEVEL @BBUSB_LOG_LEVEL@
+
+extern int config_level;//runtime level, CONFIG_LEVEL_DEBUG with -v
+extern FILE *config_fout;//log/debug output, stdout if NULL
+extern FILE *config_ferr;//error output, stderr if NULL
+
+//Sends further output to a background thread which appends it to path.
+int config_open_log(const char* path);
+
+//Where one thread's output goes instead of the globals above, while libbbusb
+//runs a call for one of its handles. A NULL write keeps the global outputs,
+//with just the level overridden. text is a whole line (ending with '\n')
+//or the start of one.
+struct config_sink {
+    int level;
+    void (*write)(void* arg, int level, const char* text);
+    void* arg;
+};
+#ifdef __GNUC__
+extern __thread struct config_sink* config_thread_sink;
+#else
+extern _Thread_local struct config_sink* config_thread_sink;
+#endif
+
+#ifdef __GNUC__
+__attribute__((format(printf, 3, 4)))
+#endif
+void config_write(int level, int newline, const char* format, ...);
+
+//The level is checked before any of the arguments are evaluated:
+#define config_current_level() \
+    ((config_thread_sink != NULL) ? config_thread_sink->level : config_level)
+#define config_enabled(level) ((level) <= CONFIG_MAX_LEVEL && (level) <= config_current_level())
+#define config_print(level, newline, ...) \
+    do { if (config_enabled(level)) config_write(level, newline, __VA_ARGS__); } while (0)
 
-void config_debug(const char* format, ...);//TODO a macro which is disabled in release builds
-void config_debugnn(const char* format, ...);
-void config_log(const char* format, ...);
-void config_lognn(const char* format, ...);
-void config_error(const char* format, ...);
-void config_errornn(const char* format, ...);
+#define config_debug(...) config_print(CONFIG_LEVEL_DEBUG, 1, __VA_ARGS__)
+#define config_debugnn(...) config_print(CONFIG_LEVEL_DEBUG, 0, __VA_ARGS__)
+#define config_log(...) config_print(CONFIG_LEVEL_LOG, 1, __VA_ARGS__)
+#define config_lognn(...) config_print(CONFIG_LEVEL_LOG, 0, __VA_ARGS__)
+#define config_error(...) config_print(CONFIG_LEVEL_ERROR, 1, __VA_ARGS__)
+#define config_errornn(...) config_print(CONFIG_LEVEL_ERROR, 0, __VA_ARGS__)
+//just a newline, without an empty format string for -Wformat-zero-length:
+#define config_debugnl() config_debug("%s", "")
+#define config_errornl() config_error("%s", "")
 
 #endif
@@ -0,0 +1,641 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Long-running update server and its client
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#define _GNU_SOURCE //struct ucred
+
+#include "daemon.h"
+#include "config.h"
+#include "timing.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+//Request format (client->daemon), one header line then an optional body:
+//  "<init|update> path <configpath>\n"
+//  "<init|update> inline\n" followed by config lines until EOF
+//  "clock <12|24>\n"
+//  "alert <mode>\n" followed by the alert text until EOF
+//  "alert clear\n"
+//The daemon sends back any output produced while handling the request,
+//ending with a status line:
+#define STATUS_PREFIX "bbusb-status: "
+
+//Between attempts to resend requests which failed for want of the sign. The
+//wait ends early if the sign is plugged back in, where hotplug is supported.
+#define PENDING_BACKOFF_MIN_MS 500
+#define PENDING_BACKOFF_MAX_MS 10000
+
+//Requests are served one at a time, so a client gets this long to send all of
+//its request (and shut down its side) before it's given up on:
+#define REQUEST_TIMEOUT_MS 5000
+
+//Clock requests wait for the start of the next minute without holding up other
+//requests, with up to this many clients waiting to hear how it went:
+#define CLOCK_MAX_WAITING 8
+
+static volatile sig_atomic_t daemon_stop = 0;
+
+static void daemon_sighandler(int sig) {
+    (void)sig;
+    daemon_stop = 1;
+}
+
+static int socket_addr(struct sockaddr_un* addr, const char* sockpath) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if (strlen(sockpath) >= sizeof(addr->sun_path)) {
+        config_error("Socket path too long: %s", sockpath);
+        return -1;
+    }
+    strcpy(addr->sun_path, sockpath);
+    return 0;
+}
+
+//Requests can carry cmd and plugin lines, which run as whatever user we run as
+//(often root, for USB access): the socket is only accessible by its owner, and
+//where the OS says who's connecting, they have to be us or root too.
+static int peer_allowed(int fd) {
+#ifdef SO_PEERCRED
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        config_error("Unable to check who sent a request: %s", strerror(errno));
+        return 0;
+    }
+    if (cred.uid != geteuid() && cred.uid != 0) {
+        config_error("Refusing a request from uid %d (pid %d)", (int)cred.uid, (int)cred.pid);
+        return 0;
+    }
+#else
+    (void)fd;
+#endif
+    return 1;
+}
+
+//sends output back to the client, see handle_request()
+static void reply_write(void* arg, int level, const char* text) {
+    (void)level;
+    fputs(text, (FILE*)arg);
+}
+
+//A request which failed for want of the sign, sent again once it's back.
+//Only the latest of each kind is kept, a newer one replaces it.
+enum pending_kind { PENDING_CONFIG = 0, PENDING_ALERT, PENDING_CLOCK, PENDING_KINDS };
+struct pending {
+    char* request;//as received, NULL if there's none
+    size_t size;
+    int init;//a config which replaced a pending init still needs one
+};
+
+//A pending clock request is sent at the start of the next minute, whether it's
+//new or it failed before. These clients get its output once it has been.
+struct clock_waiting {
+    FILE* clients[CLOCK_MAX_WAITING];
+    int count;
+};
+
+//Runs a request (header line and body), with its output going to out, or to
+//the daemon's own log if out is NULL. kind is set to its pending_kind, or -1
+//if it's malformed, and init to whether it reallocated the sign's memory.
+static int run_request(bb_handle* handle, char* request, size_t size, int force_init,
+                       FILE* out, enum bb_stats_format stats_format, int* kind, int* init) {
+    //everything logged while handling this request goes back to the client:
+    struct config_sink reply = { config_level, reply_write, out };
+    struct config_sink* prev_sink = config_thread_sink;
+    if (out != NULL) {
+        config_thread_sink = &reply;
+    }
+
+    int ret = -1;
+    *kind = -1;
+    *init = 0;
+    FILE* in = (size > 0) ? fmemopen(request, size, "r") : NULL;
+    char header[512];
+    char mode[16], kind_arg[16];
+    if (in == NULL || fgets(header, sizeof(header), in) == NULL ||
+        sscanf(header, "%15s %15s", mode, kind_arg) != 2) {
+        config_error("Malformed request");
+        goto end;
+    }
+    if (strcmp(mode, "clock") == 0) {
+        *kind = PENDING_CLOCK;
+        ret = bb_set_clock(handle, strcmp(kind_arg, "24") == 0);
+        bb_log_stats(handle, ret, stats_format);
+        goto end;
+    } else if (strcmp(mode, "alert") == 0) {
+        *kind = PENDING_ALERT;
+        if (strcmp(kind_arg, "clear") == 0) {
+            ret = bb_clear_alert(handle);
+        } else {
+            char text[1024];
+            size_t len = fread(text, 1, sizeof(text) - 1, in);
+            text[len] = '\0';
+            text[strcspn(text, "\n")] = '\0';
+            ret = bb_alert(handle, kind_arg, text);
+        }
+        bb_log_stats(handle, ret, stats_format);
+        goto end;
+    } else if (strcmp(mode, "init") == 0) {
+        *init = 1;
+    } else if (strcmp(mode, "update") == 0) {
+        *init = force_init;
+    } else {
+        config_error("Unknown request mode \"%s\"", mode);
+        goto end;
+    }
+
+    if (strcmp(kind_arg, "path") == 0) {
+        *kind = PENDING_CONFIG;
+        char* path = &header[strlen(mode) + strlen(kind_arg) + 2];
+        path[strcspn(path, "\n")] = '\0';
+        FILE* config = fopen(path, "r");
+        if (config == NULL) {
+            config_error("Unable to open config file %s: %s", path, strerror(errno));
+            ret = -2;//no use sending it again
+            goto end;
+        }
+        ret = bb_run_config(handle, config, path, *init);
+        fclose(config);
+    } else if (strcmp(kind_arg, "inline") == 0) {
+        *kind = PENDING_CONFIG;
+        ret = bb_run_config(handle, in, "<request>", *init);
+    } else {
+        config_error("Unknown request kind \"%s\"", kind_arg);
+        goto end;
+    }
+    //after a failed send, the handle reopens the device on the next request
+    bb_log_stats(handle, ret, stats_format);
+
+ end:
+    if (in != NULL) {
+        fclose(in);
+    }
+    config_thread_sink = prev_sink;
+    return ret;
+}
+
+//Keeps request as kind's pending request if it failed for want of the sign,
+//otherwise it's done with, along with any older request of its kind.
+static void pending_update(struct pending* pending, int kind, char* request, size_t size,
+                           int init, int ret) {
+    if (kind < 0 || ret == -2) {
+        //malformed or bad: whatever was pending before still is
+        free(request);
+        return;
+    }
+    struct pending* slot = &pending[kind];
+    free(slot->request);
+    slot->request = NULL;
+    if (ret == -1) {
+        slot->request = request;
+        slot->size = size;
+        slot->init = init;
+    } else {
+        free(request);
+    }
+}
+
+//Reads a request until the client shuts down its side, or until the deadline.
+//Returns it in a malloc()ed buffer, or NULL if it couldn't be read in time.
+static char* request_read(int fd, size_t* size) {
+    char* request = NULL;
+    FILE* buf = open_memstream(&request, size);
+    if (buf == NULL) {
+        return NULL;
+    }
+    long long deadline_us = timing_now_us() + REQUEST_TIMEOUT_MS*1000LL;
+    char chunk[4096];
+    for (;;) {
+        long long left_us = deadline_us - timing_now_us();
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        int ready = (left_us > 0) ? poll(&pfd, 1, (int)((left_us + 999)/1000)) : 0;
+        if (ready < 0 && errno == EINTR && !daemon_stop) {
+            continue;
+        }
+        if (ready <= 0) {
+            config_error("Gave up waiting for the rest of a request after %dms",
+                    REQUEST_TIMEOUT_MS);
+            break;
+        }
+        ssize_t len = read(fd, chunk, sizeof(chunk));
+        if (len < 0 && errno == EINTR) {
+            continue;
+        }
+        if (len == 0) {
+            fclose(buf);
+            return request;
+        }
+        if (len < 0) {
+            config_error("Unable to read request: %s", strerror(errno));
+            break;
+        }
+        fwrite(chunk, 1, len, buf);
+    }
+    fclose(buf);
+    free(request);
+    return NULL;
+}
+
+//Returns 1 if it's a clock request, which is left in pending (and the client
+//in waiting) to run once the next minute starts, otherwise the request's result.
+static int handle_request(int fd, bb_handle* handle, struct pending* pending,
+                          struct clock_waiting* waiting, enum bb_stats_format stats_format) {
+    FILE* out = fdopen(fd, "w");
+    if (out == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    //read it all in first, to be able to send it again later:
+    size_t size = 0;
+    char* request = request_read(fd, &size);
+    if (request == NULL) {
+        fprintf(out, "Timed out reading request\n" STATUS_PREFIX "%d\n", -2);
+        fclose(out);
+        return -2;
+    }
+
+    if (strncmp(request, "clock ", strlen("clock ")) == 0) {
+        if (waiting->count == CLOCK_MAX_WAITING) {
+            fprintf(out, "Too many clients already waiting for the clock\n"
+                    STATUS_PREFIX "%d\n", -2);
+            fclose(out);
+            free(request);
+            return -2;
+        }
+        //replaces any older one, whose clients hear how this one went
+        struct pending* slot = &pending[PENDING_CLOCK];
+        free(slot->request);
+        slot->request = request;
+        slot->size = size;
+        slot->init = 0;
+        waiting->clients[waiting->count++] = out;
+        return 1;
+    }
+
+    int kind, init;
+    int force_init = pending[PENDING_CONFIG].request != NULL && pending[PENDING_CONFIG].init;
+    int ret = run_request(handle, request, size, force_init, out, stats_format, &kind, &init);
+    if (ret == -1 && kind >= 0) {
+        fprintf(out, "Will send it again once the sign is back.\n");
+    }
+    pending_update(pending, kind, request, size, init, ret);
+
+    fprintf(out, STATUS_PREFIX "%d\n", ret);
+    fclose(out);
+    return ret;
+}
+
+//Runs the pending clock request now that its minute has started, and passes
+//its output on to every client waiting for it. Returns its result.
+static int run_clock(bb_handle* handle, struct pending* pending, struct clock_waiting* waiting,
+                     int retry_ms, enum bb_stats_format stats_format) {
+    struct pending* slot = &pending[PENDING_CLOCK];
+    char* request = slot->request;
+    slot->request = NULL;
+    char* output = NULL;
+    size_t outsize = 0;
+    FILE* out = (waiting->count > 0) ? open_memstream(&output, &outsize) : NULL;
+
+    //just the one try: by the time a retry is done, the minute is out of date
+    bb_set_retry(handle, 0);
+    int kind, init;
+    int ret = run_request(handle, request, slot->size, 0, out, stats_format, &kind, &init);
+    bb_set_retry(handle, retry_ms);
+    pending_update(pending, kind, request, slot->size, init, ret);
+
+    if (out != NULL) {
+        if (ret == -1) {
+            fprintf(out, "Will send it again once the sign is back.\n");
+        }
+        fclose(out);
+    }
+    int i;
+    for (i = 0; i < waiting->count; i++) {
+        if (output != NULL) {
+            fwrite(output, 1, outsize, waiting->clients[i]);
+        }
+        fprintf(waiting->clients[i], STATUS_PREFIX "%d\n", ret);
+        fclose(waiting->clients[i]);
+    }
+    waiting->count = 0;
+    free(output);
+    return ret;
+}
+
+//Sends any pending requests again, returning how many are still pending.
+static int resend_pending(bb_handle* handle, struct pending* pending, int retry_ms,
+                          enum bb_stats_format stats_format) {
+    //just the one try each: waiting for the sign is done between calls,
+    //where a request coming in can still be served
+    bb_set_retry(handle, 0);
+    int left = 0, i;
+    for (i = 0; i < PENDING_KINDS; i++) {
+        struct pending* slot = &pending[i];
+        if (slot->request == NULL || i == PENDING_CLOCK) {
+            continue;//the clock is sent again by run_clock(), on the minute
+        }
+        config_log("Resending a request which failed earlier");
+        char* request = slot->request;
+        slot->request = NULL;
+        int kind, init;
+        int ret = run_request(handle, request, slot->size, slot->init, NULL,
+                              stats_format, &kind, &init);
+        pending_update(pending, kind, request, slot->size, init, ret);
+        if (slot->request != NULL) {
+            ++left;
+        }
+    }
+    bb_set_retry(handle, retry_ms);
+    return left;
+}
+
+int daemon_run(const char* sockpath, const char* device, const char* statepath,
+               int retry_ms, enum bb_stats_format stats_format) {
+    struct sockaddr_un addr;
+    if (socket_addr(&addr, sockpath) < 0) {
+        return -1;
+    }
+
+    //kept open between requests, along with what was last sent
+    bb_handle* handle = bb_open();
+    if (handle == NULL) {
+        return -1;
+    }
+    bb_set_retry(handle, retry_ms);
+    if (bb_set_device(handle, device) < 0 ||
+        (statepath != NULL && bb_load_state(handle, statepath) < 0)) {
+        bb_close(handle);
+        return -1;
+    }
+
+    int listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listenfd < 0) {
+        config_error("Unable to create socket: %s", strerror(errno));
+        bb_close(handle);
+        return -1;
+    }
+    //clean up after a previous instance, but only if it's a socket: it'd be a
+    //shame to delete a config (say) because its path was given by mistake
+    struct stat st;
+    if (lstat(sockpath, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            config_error("Not replacing %s, which isn't a socket", sockpath);
+            close(listenfd);
+            bb_close(handle);
+            return -1;
+        }
+        unlink(sockpath);
+    }
+    mode_t prev_umask = umask(077);//just for us, see peer_allowed()
+    int bound = bind(listenfd, (struct sockaddr*)&addr, sizeof(addr));
+    umask(prev_umask);
+    if (bound < 0 || listen(listenfd, 8) < 0) {
+        config_error("Unable to listen on %s: %s", sockpath, strerror(errno));
+        close(listenfd);
+        bb_close(handle);
+        return -1;
+    }
+
+    //no SA_RESTART: a signal should interrupt accept() so that we can exit
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = daemon_sighandler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);//clients may hang up before reading our reply
+
+    if (bb_connect(handle) < 0) {
+        config_error("Will retry on first request.");
+    }
+    config_log("Listening on %s", sockpath);
+
+    struct pending pending[PENDING_KINDS];
+    memset(pending, 0, sizeof(pending));
+    struct clock_waiting waiting;
+    waiting.count = 0;
+    int pendingcount = 0, backoff_ms = PENDING_BACKOFF_MIN_MS;
+    long long resend_at_us = 0;
+    time_t clock_tried = 0;//minute of the last try, not to try again within it
+    while (!daemon_stop) {
+        //until a request comes in, or it's time to resend or to set the clock:
+        int timeout_ms = -1, clock_due = 0;
+        if (pendingcount > 0) {
+            long long left_us = resend_at_us - timing_now_us();
+            timeout_ms = (left_us > 0) ? (int)((left_us + 999)/1000) : 0;
+        }
+        if (pending[PENDING_CLOCK].request != NULL) {
+            int clock_ms = bb_clock_wait_ms();
+            if (clock_ms == 0 && time(NULL)/60 == clock_tried) {
+                clock_ms = 1000;//already tried in this first second, wait for the next minute
+            }
+            if (timeout_ms < 0 || clock_ms <= timeout_ms) {
+                timeout_ms = clock_ms;
+                clock_due = 1;
+            }
+        }
+        int ready;
+        if (pendingcount > 0) {
+            //...or the sign is back
+            ready = bb_wait(handle, listenfd, timeout_ms);
+        } else {
+            struct pollfd pfd = { listenfd, POLLIN, 0 };
+            ready = poll(&pfd, 1, timeout_ms);
+            if (ready < 0) {
+                continue;//signal: check daemon_stop
+            }
+        }
+        if (daemon_stop) {
+            break;
+        }
+
+        if (ready == 0) {
+            if (clock_due && bb_clock_wait_ms() == 0 && time(NULL)/60 != clock_tried) {
+                clock_tried = time(NULL)/60;
+                int ret = run_clock(handle, pending, &waiting, retry_ms, stats_format);
+                config_log("Set the sign's clock: %s", (ret == 0) ? "ok" : "failed");
+                if (ret == 0 && statepath != NULL) {
+                    bb_save_state(handle, statepath);
+                }
+            }
+            if (pendingcount > 0 && (!clock_due || timing_now_us() >= resend_at_us)) {
+                pendingcount = resend_pending(handle, pending, retry_ms, stats_format);
+                backoff_ms = (backoff_ms*2 < PENDING_BACKOFF_MAX_MS) ? backoff_ms*2 : PENDING_BACKOFF_MAX_MS;
+                resend_at_us = timing_now_us() + backoff_ms*1000LL;
+                if (pendingcount == 0) {
+                    config_log("Caught up with the failed requests");
+                    if (statepath != NULL) {
+                        bb_save_state(handle, statepath);
+                    }
+                }
+            }
+            continue;
+        }
+        int fd = accept(listenfd, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR) {
+                config_error("Unable to accept connection: %s", strerror(errno));
+            }
+            continue;
+        }
+        if (!peer_allowed(fd)) {
+            close(fd);
+            continue;
+        }
+        int ret = handle_request(fd, handle, pending, &waiting, stats_format);
+        if (ret == 1) {
+            config_log("Setting the sign's clock at the start of the minute");
+        } else {
+            config_log("Handled request: %s", (ret == 0) ? "ok" : "failed");
+        }
+        if (ret == 0 && statepath != NULL) {
+            bb_save_state(handle, statepath);
+        }
+        int i, count = 0;
+        for (i = 0; i < PENDING_KINDS; i++) {
+            count += (pending[i].request != NULL && i != PENDING_CLOCK) ? 1 : 0;
+        }
+        if (count > pendingcount) {
+            //something new failed: start over
+            backoff_ms = PENDING_BACKOFF_MIN_MS;
+            resend_at_us = timing_now_us() + backoff_ms*1000LL;
+        }
+        pendingcount = count;
+        if (config_fout != NULL) {
+            fflush(config_fout);
+        }
+    }
+
+    config_log("Shutting down");
+    int i;
+    for (i = 0; i < waiting.count; i++) {
+        fprintf(waiting.clients[i], "Shut down before setting the clock\n"
+                STATUS_PREFIX "%d\n", -1);
+        fclose(waiting.clients[i]);
+    }
+    for (i = 0; i < PENDING_KINDS; i++) {
+        free(pending[i].request);
+    }
+    bb_close(handle);
+    close(listenfd);
+    unlink(sockpath);
+    return 0;
+}
+
+//Connects to the daemon, returning a stream for the request and its reply.
+static FILE* request_open(const char* sockpath) {
+    struct sockaddr_un addr;
+    if (socket_addr(&addr, sockpath) < 0) {
+        return NULL;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        config_error("Unable to create socket: %s", strerror(errno));
+        return NULL;
+    }
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        config_error("Unable to connect to bbusb daemon at %s: %s", sockpath, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    FILE* sock = fdopen(fd, "r+");
+    if (sock == NULL) {
+        close(fd);
+    }
+    return sock;
+}
+
+//Ends the request and passes along the daemon's output, returning its status.
+static int request_finish(FILE* sock) {
+    fflush(sock);
+    shutdown(fileno(sock), SHUT_WR);//tells the daemon the request is complete
+
+    int ret = -1;
+    char line[1024];
+    while (fgets(line, sizeof(line), sock) != NULL) {
+        if (strncmp(line, STATUS_PREFIX, strlen(STATUS_PREFIX)) == 0) {
+            ret = atoi(&line[strlen(STATUS_PREFIX)]);
+            break;
+        }
+        config_lognn("%s", line);
+    }
+    fclose(sock);
+    return ret;
+}
+
+int daemon_request(const char* sockpath, int do_init,
+                   const char* configpath, FILE* config) {
+    FILE* sock = request_open(sockpath);
+    if (sock == NULL) {
+        return -1;
+    }
+
+    const char* mode = (do_init) ? "init" : "update";
+    if (configpath != NULL) {
+        //the daemon has its own working directory: send an absolute path
+        char* fullpath = realpath(configpath, NULL);
+        if (fullpath == NULL) {
+            config_error("Unable to resolve config path %s: %s", configpath, strerror(errno));
+            fclose(sock);
+            return -1;
+        }
+        fprintf(sock, "%s path %s\n", mode, fullpath);
+        free(fullpath);
+    } else {
+        fprintf(sock, "%s inline\n", mode);
+        char buf[4096];
+        size_t len;
+        while ((len = fread(buf, 1, sizeof(buf), config)) > 0) {
+            fwrite(buf, 1, len, sock);
+        }
+    }
+    return request_finish(sock);
+}
+
+int daemon_request_clock(const char* sockpath, int use_24h) {
+    FILE* sock = request_open(sockpath);
+    if (sock == NULL) {
+        return -1;
+    }
+    fprintf(sock, "clock %s\n", (use_24h) ? "24" : "12");
+    return request_finish(sock);
+}
+
+int daemon_request_alert(const char* sockpath, const char* mode, const char* text) {
+    FILE* sock = request_open(sockpath);
+    if (sock == NULL) {
+        return -1;
+    }
+    if (text == NULL) {
+        fprintf(sock, "alert clear\n");
+    } else {
+        fprintf(sock, "alert %s\n%s\n", mode, text);
+    }
+    return request_finish(sock);
+}
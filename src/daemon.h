@@ -0,0 +1,46 @@
+#ifndef __DAEMON_H__
+#define __DAEMON_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "bbusb.h"
+
+#include <stdio.h>
+
+//Serve update requests on a unix socket, keeping the sign open between them.
+//device picks the sign, see bb_set_device(). What was last sent to the sign is
+//kept in memory, and also saved to statepath if that's non-NULL. Each reply
+//ends with the request's stats in the given format, if any. A request which
+//fails for want of the sign, even after retrying for retry_ms (see
+//bb_set_retry()), is sent again in the background once the sign is back.
+int daemon_run(const char* sockpath, const char* device, const char* statepath,
+               int retry_ms, enum bb_stats_format stats_format);
+
+//Hand an update off to a running daemon: configpath is forwarded as-is when
+//given, otherwise the contents of config are sent inline.
+int daemon_request(const char* sockpath, int do_init,
+                   const char* configpath, FILE* config);
+//Have a running daemon set the sign's clock, see bb_set_clock().
+int daemon_request_clock(const char* sockpath, int use_24h);
+//Have a running daemon show an alert, or clear it if text is NULL. See bb_alert().
+int daemon_request_alert(const char* sockpath, const char* mode, const char* text);
+
+#endif
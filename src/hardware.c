@@ -20,9 +20,12 @@
 \************************************************************************/
 
 #include "hardware.h"
+#include "packet.h"
+#include "timing.h"
 
+#include <poll.h>
+#include <stdlib.h>
 #include <string.h>
-#include <time.h>
 
 //Found via lsusb while my Prism sign was plugged in:
 #define SIGN_VENDOR_ID 0x8765
@@ -30,101 +33,290 @@
 #define SIGN_INTERFACE_NUM 0
 #define SIGN_ENDPOINT_NUM 2
 
-int hardware_init(usbsign_handle** devhp) {
-    if (devhp == NULL) {
+int hardware_init(struct hardware_sign* sign) {
+    if (sign == NULL) {
         config_error("Internal error: Bad pointer to init");
         return -1;
-    } else if (*devhp != NULL) {
+    } else if (sign->devh != NULL) {
         config_error("Internal error: Can't init twice");
         return -1;
     }
 
-    return usbsign_open(SIGN_VENDOR_ID, SIGN_PRODUCT_ID,
-                        SIGN_INTERFACE_NUM, devhp);
+    //straight to where it was last time, if it's still there:
+    int ret = -1;
+    sign->enum_us = 0;
+    if (sign->node[0] != '\0' && (sign->device == NULL ||
+            strncmp(sign->device, USBSIGN_FD_PREFIX, strlen(USBSIGN_FD_PREFIX)) != 0)) {
+        ret = usbsign_open_node(SIGN_VENDOR_ID, SIGN_PRODUCT_ID,
+                                SIGN_INTERFACE_NUM, sign->device, sign->node, &sign->devh);
+        if (ret < 0) {
+            config_debug("Sign isn't at %s anymore, looking for it", sign->node);
+        }
+    }
+    if (ret < 0) {
+        long long start = timing_now_us();
+        ret = usbsign_open(SIGN_VENDOR_ID, SIGN_PRODUCT_ID,
+                           SIGN_INTERFACE_NUM, sign->device, &sign->devh);
+        sign->enum_us = timing_now_us() - start;
+    }
+    if (ret < 0) {
+        sign->devh = NULL;
+        sign->node[0] = '\0';
+    } else if (usbsign_node(sign->devh, sign->node, sizeof(sign->node)) < 0) {
+        sign->node[0] = '\0';
+    }
+    return ret;
 }
 
-int hardware_reset(usbsign_handle** devhp) {
-    if (devhp == NULL) {
+int hardware_reset(struct hardware_sign* sign) {
+    if (sign == NULL) {
         config_error("Internal error: Bad pointer to init");
         return -1;
-    } else if (*devhp == NULL) {
+    } else if (sign->devh == NULL) {
         config_error("Internal error: Can't reset null device");
         return -1;
     }
 
     return usbsign_reset(SIGN_VENDOR_ID, SIGN_PRODUCT_ID,
-                         SIGN_INTERFACE_NUM, devhp);
+                         SIGN_INTERFACE_NUM, sign->device, &sign->devh);
 }
 
-int hardware_close(usbsign_handle* devh) {
-    if (devh != NULL) {
-        usbsign_close(devh, SIGN_INTERFACE_NUM);
+int hardware_close(struct hardware_sign* sign) {
+    if (sign->devh != NULL) {
+        usbsign_close(sign->devh, SIGN_INTERFACE_NUM);
+        sign->devh = NULL;
     }
     return 0;
 }
 
-static void sleep_ms(int ms) {
-    struct timespec hundredms;
-    hundredms.tv_sec = 0;
-    hundredms.tv_nsec = ms*1000000;
-    nanosleep(&hundredms, NULL);
+int hardware_wait(struct hardware_sign* sign, int wakefd, int timeout_ms) {
+    int ret = usbsign_wait(SIGN_VENDOR_ID, SIGN_PRODUCT_ID,
+                           sign->device, wakefd, timeout_ms);
+    if (ret < 0) {
+        //no hotplug events to wait for, so wait out the timeout
+        struct pollfd pfd = { wakefd, POLLIN, 0 };
+        ret = (poll(&pfd, (wakefd >= 0) ? 1 : 0, timeout_ms) > 0) ? 1 : 0;
+    }
+    return ret;
 }
 
 //A sequence is a series of packets, and this is what begins and ends them (pg13)
 const char sequence_header[] = {0,0,0,0,0,1,'Z','0','0'},
     sequence_footer[] = {4},
     packet_header[] = {2}, packet_footer[] = {3};
+//...all of which is written into the room that packet_build*() leaves:
+typedef char packet_headroom_check[(PACKET_HEADROOM >= sizeof(sequence_header)+sizeof(packet_header)) ? 1 : -1];
+typedef char packet_tailroom_check[(PACKET_TAILROOM >= sizeof(packet_footer)+sizeof(packet_header)) ? 1 : -1];
 
-static int hardware_sendraw(usbsign_handle* devh, char* data, unsigned int size) {
-    int sent;
-    int ret = usbsign_send(devh, SIGN_ENDPOINT_NUM, data, size, &sent);
+//"100 millisecond delay after the [pkt header]" (pg14)
+//Needed after every packet's STX, whatever the command code:
+#define STX_DELAY_MS 100
 
-    if (ret < 0) {
-        config_error("Got USB error %d when sending %d bytes", ret, size);
-        return -1;
-    } else {
-        ret = sent;
+//start of the current (not yet cut) segment within seq->iov
+static int seg_start(struct hardware_seq* seq) {
+    if (seq->segcount == 0) {
+        return 0;
     }
+    struct hardware_seg* prev = &seq->segs[seq->segcount-1];
+    return prev->iov + prev->iovcnt;
+}
 
-    if (ret > 0) {
-#ifdef DEBUG
-        //print packet contents:
-        unsigned int i;
-        config_debugnn("%u: ",size);
-        for (i = 0; i < size; i++) {
-            config_debugnn("%X(%c) ", data[i], data[i]);
+//adds data to the current segment, without copying it
+static int seq_append(struct hardware_seq* seq, const char* data, size_t size) {
+    seq->size += size;
+    if (seq->iovcount > seg_start(seq)) {
+        struct iovec* last = &seq->iov[seq->iovcount-1];
+        if ((char*)last->iov_base + last->iov_len == data) {
+            //continues right where the last piece ends
+            last->iov_len += size;
+            return 0;
         }
-        config_debug("");//final newline
-#endif
-    } else {
-        config_error("Bad packet size %d or device %p",ret,(void*)devh);
-        return -1;
     }
+    if (seq->iovcount == seq->iovlen) {
+        int iovlen = (seq->iovlen == 0) ? 32 : seq->iovlen*2;
+        struct iovec* newiov = arena_grow(seq->arena, seq->iov,
+                seq->iovlen*sizeof(struct iovec), iovlen*sizeof(struct iovec));
+        if (newiov == NULL) {
+            return -1;
+        }
+        seq->iov = newiov;
+        seq->iovlen = iovlen;
+    }
+    struct iovec* iov = &seq->iov[seq->iovcount++];
+    iov->iov_base = (char*)data;//only ever read from
+    iov->iov_len = size;
+    return 0;
+}
 
-    return ret;
+//adds a framing byte, in the spare room after the last packet if there is any
+static int seq_append_byte(struct hardware_seq* seq, const char* byte) {
+    if (seq->spare != NULL) {
+        *seq->spare = *byte;
+        byte = seq->spare;
+        seq->spare = NULL;
+    }
+    return seq_append(seq, byte, 1);
 }
 
-int hardware_seqstart(usbsign_handle* devh) {
-    return (hardware_sendraw(devh,(char*)sequence_header,
-                             sizeof(sequence_header)) == sizeof(sequence_header));
+//end the current transfer at the current end of data, pausing afterwards
+static int seq_cut(struct hardware_seq* seq, int delay_ms) {
+    if (seq->segcount == seq->seglen) {
+        int seglen = (seq->seglen == 0) ? 16 : seq->seglen*2;
+        struct hardware_seg* newsegs = arena_grow(seq->arena, seq->segs,
+                seq->seglen*sizeof(struct hardware_seg), seglen*sizeof(struct hardware_seg));
+        if (newsegs == NULL) {
+            return -1;
+        }
+        seq->segs = newsegs;
+        seq->seglen = seglen;
+    }
+    int start = seg_start(seq);
+    struct hardware_seg* seg = &seq->segs[seq->segcount++];
+    seg->iov = start;
+    seg->iovcnt = seq->iovcount - start;
+    seg->size = 0;
+    int i;
+    for (i = start; i < seq->iovcount; i++) {
+        seg->size += seq->iov[i].iov_len;
+    }
+    seg->delay_ms = delay_ms;
+    return 0;
 }
 
-int hardware_seqend(usbsign_handle* devh) {
-    return (hardware_sendraw(devh,(char*)sequence_footer,
-                             sizeof(sequence_footer)) == sizeof(sequence_footer));
+int hardware_seq_init(struct hardware_seq* seq, struct arena* arena) {
+    memset(seq, 0, sizeof(struct hardware_seq));
+    seq->arena = arena;
+    return 0;//the header goes out with the first packet
+}
+
+int hardware_seq_addpkt(struct hardware_seq* seq, char* data, unsigned int size) {
+    if (size == 0) {
+        config_error("Internal error: Empty packet");
+        return -1;
+    }
+    if (seq->iovcount == 0) {
+        //first packet: the sequence header fits in its headroom too
+        char* start = data - sizeof(sequence_header) - sizeof(packet_header);
+        memcpy(start, sequence_header, sizeof(sequence_header));
+        memcpy(data - sizeof(packet_header), packet_header, sizeof(packet_header));
+        if (seq_append(seq, start, sizeof(sequence_header) + sizeof(packet_header)) < 0) {
+            return -1;
+        }
+    } else {
+        //otherwise the STX goes after the previous packet's ETX, or in our headroom
+        seq->spare = (seq->spare != NULL) ? seq->spare : data - sizeof(packet_header);
+        if (seq_append_byte(seq, packet_header) < 0) {
+            return -1;
+        }
+    }
+    if (seq_cut(seq, STX_DELAY_MS) < 0) {
+        return -1;
+    }
+    memcpy(&data[size], packet_footer, sizeof(packet_footer));
+    if (seq_append(seq, data, size + sizeof(packet_footer)) < 0) {
+        return -1;
+    }
+    seq->spare = &data[size + sizeof(packet_footer)];
+    ++seq->pktcount;
+    return 0;
 }
 
-int hardware_sendpkt(usbsign_handle* devh, char* data, unsigned int size) {
-    //create packet with header/footer chars added:
-    char packet[size+sizeof(packet_footer)];
-    memcpy(&packet[0],data,size);
-    memcpy(&packet[size],packet_footer,sizeof(packet_footer));
+int hardware_seq_finish(struct hardware_seq* seq) {
+    if (seq->iovcount == 0 &&
+        seq_append(seq, sequence_header, sizeof(sequence_header)) < 0) {
+        return -1;
+    }
+    if (seq_append_byte(seq, sequence_footer) < 0) {
+        return -1;
+    }
+    return seq_cut(seq, 0);
+}
 
-    if (hardware_sendraw(devh,(char*)packet_header,
-                   sizeof(packet_header)) != sizeof(packet_header)) {
+//submit the segments through to the next pause, then wait for them to go out
+static int seq_flush(usbsign_handle* devh, struct hardware_seq* seq, int lastseg) {
+    if (usbsign_flush(devh) < 0) {
+        config_error("USB error when sending to device %p",(void*)devh);
         return -1;
     }
-    sleep_ms(100);//"100 millisecond delay after the [pkt header]" (pg14)
-    return hardware_sendraw(devh,packet,
-                      size+sizeof(packet_footer))-sizeof(packet_footer);
+    long long now = timing_now_us();
+    int i;
+    for (i = seq->segs_sent; i <= lastseg; i++) {
+        seq->segs[i].us = now - seq->segs[i].us;//was the submit time
+    }
+#ifdef DEBUG
+    //print packet contents:
+    for (i = seq->segs_sent; i <= lastseg; i++) {
+        struct hardware_seg* seg = &seq->segs[i];
+        int v;
+        config_debugnn("%u: ",(unsigned int)seg->size);
+        for (v = seg->iov; v < seg->iov + seg->iovcnt; v++) {
+            char* data = seq->iov[v].iov_base;
+            size_t j;
+            for (j = 0; j < seq->iov[v].iov_len; j++) {
+                config_debugnn("%X(%c) ", data[j], data[j]);
+            }
+        }
+        config_debugnl();//final newline
+    }
+#endif
+    seq->segs_sent = lastseg+1;
+    return 0;
+}
+
+//Sends every segment from seq->segs_sent on. Past the start, the sign may be
+//partway into a packet which didn't get through: a fresh sequence header has
+//it start over, then the packet goes again from its STX.
+static int seq_send_from(usbsign_handle* devh, struct hardware_seq* seq) {
+    int i = seq->segs_sent;
+    if (i > 0) {
+        struct iovec restart[] = {
+            { (char*)sequence_header, sizeof(sequence_header) },
+            { (char*)packet_header, sizeof(packet_header) }
+        };
+        if (usbsign_submitv(devh, SIGN_ENDPOINT_NUM, restart, 2) < 0 ||
+            usbsign_flush(devh) < 0) {
+            config_error("Got USB error when restarting the sequence");
+            return -1;
+        }
+        seq->restart_bytes += sizeof(sequence_header) + sizeof(packet_header);
+        //the STX's pause, as when it was first sent:
+        long long slept = timing_now_us();
+        timing_sleep_ms(seq->segs[i-1].delay_ms);
+        seq->sleep_us += timing_now_us() - slept;
+        seq->delay_total_ms += seq->segs[i-1].delay_ms;
+    }
+    for (; i < seq->segcount; i++) {
+        struct hardware_seg* seg = &seq->segs[i];
+        seg->us = timing_now_us();
+        if (usbsign_submitv(devh, SIGN_ENDPOINT_NUM,
+                            &seq->iov[seg->iov], seg->iovcnt) < 0) {
+            config_error("Got USB error when sending %d bytes", (int)seg->size);
+            return -1;
+        }
+        //transfers with no pause between them stay queued together:
+        if (seg->delay_ms > 0 || i+1 == seq->segcount) {
+            if (seq_flush(devh, seq, i) < 0) {
+                return -1;
+            }
+        }
+        if (seg->delay_ms > 0) {
+            long long slept = timing_now_us();
+            timing_sleep_ms(seg->delay_ms);
+            seq->sleep_us += timing_now_us() - slept;
+            seq->delay_total_ms += seg->delay_ms;
+        }
+    }
+    return seq->size;
+}
+
+int hardware_seq_send(usbsign_handle* devh, struct hardware_seq* seq) {
+    seq->segs_sent = 0;
+    seq->delay_total_ms = 0;
+    seq->sleep_us = 0;
+    seq->restart_bytes = 0;
+    return seq_send_from(devh, seq);
+}
+
+int hardware_seq_resume(usbsign_handle* devh, struct hardware_seq* seq) {
+    return seq_send_from(devh, seq);
 }
@@ -21,13 +21,77 @@
 
 \************************************************************************/
 
+#include "arena.h"
 #include "usbsign.h"
 
-int hardware_init(usbsign_handle** devh);
-int hardware_reset(usbsign_handle** devh);
-int hardware_close(usbsign_handle* devh);
-int hardware_sendpkt(usbsign_handle* devh, char* data, unsigned int size);
-int hardware_seqstart(usbsign_handle* devh);
-int hardware_seqend(usbsign_handle* devh);
+#include <stddef.h>
+#include <sys/uio.h>
+
+//One bulk transfer within a sequence, followed by a delay before the next one
+struct hardware_seg {
+    int iov, iovcnt;//range of hardware_seq.iov
+    size_t size;
+    int delay_ms;
+    long long us;//filled in by hardware_seq_send(): from submit until sent
+};
+
+//A complete sequence (header, packets, footer), built up front then sent at once.
+//Lives in the arena it was initialized with. The packets aren't copied, the
+//iovs point at them (and at the framing bytes written around them) in place.
+struct hardware_seq {
+    struct arena* arena;
+    struct iovec* iov;
+    int iovcount, iovlen;
+    char* spare;//unused byte right after the last iov, if any
+    size_t size;
+    struct hardware_seg* segs;
+    int segcount, seglen;
+    int pktcount;
+
+    //filled in by hardware_seq_send() and hardware_seq_resume():
+    int segs_sent;//the sign has taken these, everything before the failure if any
+    int delay_total_ms;
+    long long sleep_us;
+    size_t restart_bytes;//headers sent again by hardware_seq_resume()
+};
+
+//After a failed send, how long to keep reopening the sign (eg while its cable
+//is replugged), waiting twice as long between each attempt up to a limit:
+#define HARDWARE_RETRY_MS 15000
+#define HARDWARE_BACKOFF_MIN_MS 250
+#define HARDWARE_BACKOFF_MAX_MS 4000
+
+#define HARDWARE_NODE_LEN 64
+
+//One sign, and which one it is (see usbsign_open()) for whenever it's reopened.
+struct hardware_sign {
+    usbsign_handle* devh;//NULL until opened
+    char* device;//NULL for the first sign found
+    int retry_ms;//0: just reset and retry once
+
+    //where it was last opened, tried before looking through the bus ("" if unknown):
+    char node[HARDWARE_NODE_LEN];
+    long long enum_us;//how long the last open spent looking through the bus
+};
+
+int hardware_init(struct hardware_sign* sign);
+int hardware_reset(struct hardware_sign* sign);
+//Closes the sign if it's open, it's reopened by the next hardware_init().
+int hardware_close(struct hardware_sign* sign);
+//Waits up to timeout_ms for the sign to be plugged (back) in, or until wakefd
+//(if >= 0) is readable. Without hotplug support this just waits out the
+//timeout, leaving the caller to poll by trying hardware_init() again.
+//Returns 1 if wakefd is readable, 0 otherwise.
+int hardware_wait(struct hardware_sign* sign, int wakefd, int timeout_ms);
+
+int hardware_seq_init(struct hardware_seq* seq, struct arena* arena);
+//data must come from packet_build*(), which leaves room to frame it in place
+int hardware_seq_addpkt(struct hardware_seq* seq, char* data, unsigned int size);
+int hardware_seq_finish(struct hardware_seq* seq);
+int hardware_seq_send(usbsign_handle* devh, struct hardware_seq* seq);
+//After a failed send, sends the rest of seq from the first transfer which
+//didn't get through, eg once the sign has been reset or reopened. Each packet
+//the sign already took is only sent the once.
+int hardware_seq_resume(usbsign_handle* devh, struct hardware_seq* seq);
 
 #endif
@@ -20,61 +20,27 @@
 \************************************************************************/
 
 #include "infile.h"
+#include "cmdcache.h"
+#include "config.h"
+#include "cmdrun.h"
+#include "labelmap.h"
+#include "plugin.h"
+#include "reader.h"
+#include "sentstate.h"
+#include "timing.h"
 
 #include <ctype.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <sys/types.h>
 
 //fixes warnings when being -pedantic:
-extern FILE* popen(const char* command, const char* modes);
-extern int pclose(FILE *stream);
 extern char *strtok_r(char *str, const char *delim, char **saveptr);
 
-static int readline(char** lineptr, FILE* config) {
-    size_t buflen = 128;
-    char* line = malloc(buflen);
-    if (line == NULL) {
-        return -1;
-    }
-
-    char c;
-    size_t i = 0;
-    while ((c = fgetc(config)) != EOF) {
-        if (feof(config)) {
-            break;//raspbian has a bogus libc?
-        }
-        if (c == '\r') {
-            continue;
-        }
-        if (c == '\n') {
-            if (i == 0) {
-                continue;//its an empty line, keep going to next line
-            } else {
-                break;//end of line
-            }
-        }
-        if (i == buflen) {
-            buflen *= 2;
-            line = realloc(line,buflen);
-            if (line == NULL) {
-                return -1;
-            }
-        }
-        line[i++] = c;
-    }
-    //append \0 to line, shrink buffer to match length of line:
-    if (i > 0) {
-        line = realloc(line,i+1);
-        line[i] = '\0';
-    }
-    *lineptr = line;
-    return i;
-}
-
-static int checkmode(char* mode, char* opt, int linenum) {
+int checkmode(const char* mode, const char* opt, int linenum) {
     if (mode == NULL || strlen(mode) == 0) {
         config_error("Syntax error, line %d: Mode field isn't specified.",linenum);
         return -1;
@@ -97,45 +63,6 @@ static int checkmode(char* mode, char* opt, int linenum) {
     return 0;
 }
 
-static int runcmd(char** output, char* command) {
-    FILE* result_stream = (FILE*)popen(command,"r");
-    if (result_stream == NULL) {
-        config_error("Unable to open stream to command \"%s\".",command);
-        return -1;
-    }
-    size_t buflen = 128, i = 0;
-    char* result = malloc(buflen);
-
-    char c;
-    while ((c = fgetc(result_stream)) != EOF) {
-        if (feof(result_stream)) {
-            break;//raspbian has a bogus libc?
-        }
-        if (i == buflen) {
-            buflen *= 2;
-            result = realloc(result,buflen);
-            if (result == NULL) {
-                config_error("Memory allocation error!");
-                return -1;
-            }
-        }
-        result[i++] = c;
-    }
-
-    if (pclose(result_stream) != 0) {
-        config_error("Error: Command \"%s\" returned an error. Aborting.",command);
-        return -1;
-    }
-
-    //append \0 to result, shrink buffer to match length of result:
-    result = realloc(result,i+1);
-    result[i] = '\0';
-
-    *output = result;
-
-    return 0;
-}
-
 //Replacement table for most stuff (excludes color,scolor,speed)
 static char* replacesrc[] = {
     "<left>","<br>","<blink>","</blink>",
@@ -148,7 +75,8 @@ static char* replacesrc[] = {
     "&heart;","&car;","&handicap;","&rhino;",
     "&mug;","&satdish;","&copy;","&female;",
     "&male;","&bottle;","&disk;","&printer;",
-    "&note;","&infinity;","&deg;",0
+    "&note;","&infinity;","&deg;",
+    "<time>","<date>","<weekday>",0
 };
 static char* replacedst[] = {
     "\x1e" "1","\x0c","\x07" "1","\x07" "0",
@@ -161,7 +89,8 @@ static char* replacedst[] = {
     "\xcc","\xcd","\xce","\xcf",
     "\xd0","\xd1","\xd2","\xd3",
     "\xd4","\xd5","\xd6","\xd7",
-    "\xd8","\xd9","\xa9",0
+    "\xd8","\xd9","\xa9",
+    "\x13","\x0b" "0","\x0b" "9",0
 };
 
 #define COLOR_LEN 6 //number of chars in a color
@@ -193,11 +122,121 @@ static int parse_color_code(char* out, char* in) {
     return 0;
 }
 
-static int parse_inline_cmds(char** outptr, int* output_is_trimmed, char* in, unsigned int maxout) {
+//Lookup structures for parse_inline_cmds(), built from the tables above on first use:
+//- a class for every input byte, so that runs of plain text can be copied at once
+//- a hash of every replacesrc tag/entity, for a single probe per '<' or '&'
+enum char_class_t { PLAIN_CHAR = 0, SPACE_CHAR, SKIP_CHAR, MARKUP_CHAR };
+static unsigned char char_class[256];
+
+#define MARKUP_HASH_SIZE 128 //power of 2, comfortably more than the table size
+#define SPECIAL_TAG_MAXLEN 11 //"<scolorRGB>"
+struct markup_entry {
+    const char* src;
+    const char* dst;
+    size_t srclen, dstlen;
+};
+static struct markup_entry markup_hash[MARKUP_HASH_SIZE];
+static size_t markup_maxlen = SPECIAL_TAG_MAXLEN;
+static pthread_once_t markup_once = PTHREAD_ONCE_INIT;//libbbusb handles may parse from several threads
+
+static unsigned int markup_hashof(const char* tag, size_t len) {
+    unsigned int hash = 2166136261U;//32-bit FNV-1a
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)tag[i];
+        hash *= 16777619U;
+    }
+    return hash & (MARKUP_HASH_SIZE-1);
+}
+
+static void markup_init(void) {
+    int i;
+    for (i = 0; i < 256; i++) {
+        char c = (char)i;//matches the signedness of the input
+        if (c == '\n' || c == '\t') {
+            //replace newlines and tabs with spaces:
+            char_class[i] = SPACE_CHAR;
+        } else if (c < 0x20) {
+            //ignore all other special chars <0x20:
+            char_class[i] = SKIP_CHAR;
+        } else if (c == '<' || c == '&') {
+            char_class[i] = MARKUP_CHAR;
+        } else {
+            char_class[i] = PLAIN_CHAR;
+        }
+    }
+    for (i = 0; replacesrc[i] != 0; i++) {
+        size_t srclen = strlen(replacesrc[i]);
+        unsigned int slot = markup_hashof(replacesrc[i], srclen);
+        while (markup_hash[slot].src != NULL) {
+            slot = (slot + 1) & (MARKUP_HASH_SIZE-1);
+        }
+        markup_hash[slot].src = replacesrc[i];
+        markup_hash[slot].srclen = srclen;
+        markup_hash[slot].dst = replacedst[i];
+        markup_hash[slot].dstlen = strlen(replacedst[i]);
+        if (srclen > markup_maxlen) {
+            markup_maxlen = srclen;
+        }
+    }
+}
+
+static const struct markup_entry* markup_find(const char* tag, size_t len) {
+    unsigned int slot = markup_hashof(tag, len);
+    while (markup_hash[slot].src != NULL) {
+        if (markup_hash[slot].srclen == len &&
+            memcmp(markup_hash[slot].src, tag, len) == 0) {
+            return &markup_hash[slot];
+        }
+        slot = (slot + 1) & (MARKUP_HASH_SIZE-1);
+    }
+    return NULL;
+}
+
+//special tags: colorRGB/scolorRGB(0-3) speedN(1-6)
+//'tag' runs from '<' through '>'. Returns the size written to addme, or 0.
+static int parse_special_tag(char* addme, const char* tag, size_t len) {
+    if (len == 10 && strncmp("<color",tag,6) == 0) {//<colorRGB>
+        if (parse_color_code(&addme[2],(char*)&tag[6]) >= 0) {
+            addme[0] = 0x1c;
+            addme[1] = 'Z';
+            return COLOR_LEN+2;
+        }
+    } else if (len == 11 && strncmp("<scolor",tag,7) == 0) {//<scolorRGB>
+        if (parse_color_code(&addme[2],(char*)&tag[7]) >= 0) {
+            addme[0] = 0x1c;
+            addme[1] = 'Y';
+            return COLOR_LEN+2;
+        }
+    } else if (len == 8 && strncmp("<speed",tag,6) == 0) {//<speedN>
+        char speedin = tag[6];
+        if (speedin >= '1' && speedin <= '5') {
+            //speeds 1(0x31)-5(0x35) -> char 0x15-0x19
+            addme[0] = speedin-'0'+0x14;
+            return 1;
+        } else if (speedin == '6') {
+            //speed 6 -> char 0x9 (nohold)
+            addme[0] = 0x9;
+            return 1;
+        } else {
+            config_error("Found invalid speed \"%c\" in <speedN> (N=1-6).",
+                    speedin);
+        }
+    }
+    return 0;
+}
+
+int parse_inline_cmds(struct arena* arena, char** outptr, int* output_is_trimmed,
+        const char* in, unsigned int maxout) {
     config_debug("orig: %s",in);
-    size_t iin = 0, iout = 0;
-    char* out = malloc(maxout);
-    while (iin < strlen(in)) {
+    pthread_once(&markup_once, markup_init);
+    size_t iin = 0, iout = 0, inlen = strlen(in);
+    char* out = arena_alloc(arena, maxout+1);
+    if (out == NULL) {
+        config_error("Memory allocation error!");
+        return -1;
+    }
+    while (iin < inlen) {
 
         if (iout == maxout) {
             //stop!: reached max output size
@@ -205,108 +244,232 @@ static int parse_inline_cmds(char** outptr, int* output_is_trimmed, char* in, un
             break;
         }
 
-        if (in[iin] == '\n' || in[iin] == '\t') {
-            //replace newlines and tabs with spaces:
+        //copy any run of plain text in one go:
+        size_t runend = iin;
+        while (runend < inlen && char_class[(unsigned char)in[runend]] == PLAIN_CHAR) {
+            ++runend;
+        }
+        if (runend != iin) {
+            size_t runlen = runend - iin;
+            if (runlen > maxout - iout) {
+                runlen = maxout - iout;
+            }
+            memcpy(&out[iout],&in[iin],runlen);
+            iout += runlen;
+            iin += runlen;
+            continue;
+        }
+
+        switch (char_class[(unsigned char)in[iin]]) {
+        case SPACE_CHAR:
             out[iout++] = ' ';
             ++iin;
-        } else if (in[iin] < 0x20) {
-            //ignore all other special chars <0x20:
+            break;
+        case SKIP_CHAR:
             ++iin;
-        } else if (in[iin] == '<' || in[iin] == '&') {
-            int i = 0, parsedlen = 0;
-            char addme[32];
-            while (replacesrc[i] != 0) {
-                //search replacement table:
-                if (strncmp(replacesrc[i],&in[iin],
-                                strlen(replacesrc[i])) == 0) {
-                    strncpy(addme,replacedst[i],strlen(replacedst[i])+1);
-                    parsedlen = strlen(replacesrc[i]);
-                    break;
-                }
-                ++i;
+            break;
+        default: {//MARKUP_CHAR
+            //tags run through the next '>', entities through the next ';':
+            size_t window = inlen - iin;
+            if (window > markup_maxlen) {
+                window = markup_maxlen;
             }
-
-            if (parsedlen == 0) {
-                //special tags: colorRGB/scolorRGB(0-3) speedN(1-6)
-                if (strncmp("<color",&in[iin],6) == 0 &&
-                        index(&in[iin+6],'>') == &in[iin+9]) {//<colorRGB>
-                    if (parse_color_code(&addme[2],&in[iin+6]) >= 0) {
-                        addme[0] = 0x1c;
-                        addme[1] = 'Z';
-                        addme[COLOR_LEN+2] = 0;
-
-                        parsedlen = 10;
-                    }
-                } else if (strncmp("<scolor",&in[iin],7) == 0 &&
-                        index(&in[iin+7],'>') == &in[iin+10]) {//<colorRGB>
-                    if (parse_color_code(&addme[2],&in[iin+7]) >= 0) {
-                        addme[0] = 0x1c;
-                        addme[1] = 'Y';
-                        addme[COLOR_LEN+2] = 0;
-
-                        parsedlen = 11;
-                    }
-                } else if (strncmp("<speed",&in[iin],6) == 0 &&
-                        index(&in[iin+6],'>') == &in[iin+7]) {//<speedN>
-                    char speedin = in[iin+6];
-                    if (speedin >= '1' && speedin <= '5') {
-                        //speeds 1(0x31)-5(0x35) -> char 0x15-0x19
-                        addme[0] = speedin-'0'+0x14;
-                        addme[1] = 0;
-
-                        parsedlen = 8;
-                    } else if (speedin == '6') {
-                        //speed 6 -> char 0x9 (nohold)
-                        addme[0] = 0x9;
-                        addme[1] = 0;
-
-                        parsedlen = 8;
-                    } else {
-                        config_error("Found invalid speed \"%c\" in <speedN> (N=1-6).",
-                                speedin);
-                    }
+            const char* end = memchr(&in[iin], (in[iin] == '<') ? '>' : ';', window);
+            const char* addme = NULL;
+            size_t addme_size = 0, parsedlen = 0;
+            char special[COLOR_LEN+2];
+            if (end != NULL) {
+                parsedlen = end - &in[iin] + 1;
+                const struct markup_entry* entry = markup_find(&in[iin], parsedlen);
+                if (entry != NULL) {
+                    addme = entry->dst;
+                    addme_size = entry->dstlen;
+                } else if (in[iin] == '<' &&
+                           (addme_size = parse_special_tag(special, &in[iin], parsedlen)) > 0) {
+                    addme = special;
                 }
             }
 
-            if (parsedlen != 0) {
-                int addme_size = strlen(addme);
+            if (addme != NULL) {
                 if (addme_size + iout > maxout) {
                     //stop!: too big to fit in buffer
                     *output_is_trimmed = 1;
-                    break;
-                } else {
-                    memcpy(&out[iout],addme,addme_size);
-                    iout += addme_size;
-                    iin += parsedlen;
+                    goto done;
                 }
+                memcpy(&out[iout],addme,addme_size);
+                iout += addme_size;
+                iin += parsedlen;
             } else {
                 out[iout++] = in[iin++];//nothing found, pass thru the '<'
             }
-        } else {
-            out[iout++] = in[iin++];
+            break;
+        }
         }
     }
+ done:
 
-    //append \0 to result, shrink buffer to match length of result:
-    out = realloc(out,iout+1);
+    //append \0 to result, give back the space we didn't use:
+    out = arena_grow(arena,out,maxout+1,iout+1);
+    if (out == NULL) {
+        config_error("Memory allocation error!");
+        return -1;
+    }
     out[iout] = '\0';
 
     *outptr = out;
-    config_debug("new (%d): %s",(int)strlen(out),out);
+    config_debug("new (%d): %s",(int)iout,out);
     return iin;//tell caller how far we got through their data
 }
 
-int parsefile(struct bb_frame** output, FILE* file) {
-    int error = 0, linenum = 0;
-    char filename = 0;
-    char* line = NULL;
-    ssize_t line_len;
+//The most cmd output which could make it into a cmd's STRINGs, if all of it
+//were the longest markup (which shrinks the most once translated):
+#define MAX_MARKUP_SIZE 12 //"&rightarrow;"
+#define MAX_CMD_OUTPUT_SIZE (MAX_STRINGFILE_GROUP_COUNT*MAX_STRINGFILE_DATA_SIZE*MAX_MARKUP_SIZE)
+
+enum line_type_t { TXT_LINE_TYPE=1, CMD_LINE_TYPE, PLUGIN_LINE_TYPE };
+struct configline {
+    enum line_type_t line_type;
+    int linenum;
+    char* line;//the buffer the other fields point into
+    char* mode;
+    char* content;//txt: text (may be NULL), cmd: command, plugin: "<lib.so> [args]"
+    int timeout_ms;//cmd only
+    int ttl_secs;//cmd: 0 to not cache, plugin: <0 for the plugin's own ttl
+    struct plugin* plugin;//plugin only
+    char* output;//plugin only, filled in by runplugins()
+};
 
-    struct bb_frame* head = NULL;
-    struct bb_frame* curframe = NULL;
-    struct bb_frame** nextframeptr = &curframe;
+//Last successful output of each command, used when a later run of it fails.
+//Only useful when we stay running across several parses (ie --daemon), where
+//each request may bring new commands: the least recently used are dropped to
+//keep it to LASTGOOD_MAX, a good few more than a config can have cmds.
+#define LASTGOOD_MAX 64
+struct lastgood {
+    char* command;
+    char* output;
+    struct lastgood* next;
+};
+static struct lastgood* lastgood_head = NULL;
+static pthread_mutex_t lastgood_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Moves the command's entry (if any) to the front, as the most recently used.
+static struct lastgood* lastgood_find(const char* command) {
+    struct lastgood** prev = &lastgood_head;
+    struct lastgood* cur = lastgood_head;
+    while (cur != NULL && strcmp(cur->command, command) != 0) {
+        prev = &cur->next;
+        cur = cur->next;
+    }
+    if (cur != NULL && cur != lastgood_head) {
+        *prev = cur->next;
+        cur->next = lastgood_head;
+        lastgood_head = cur;
+    }
+    return cur;
+}
+
+static void lastgood_set(const char* command, const char* output) {
+    pthread_mutex_lock(&lastgood_lock);
+    struct lastgood* entry = lastgood_find(command);
+    if (entry == NULL) {
+        entry = malloc(sizeof(struct lastgood));
+        if (entry == NULL) {
+            pthread_mutex_unlock(&lastgood_lock);
+            return;
+        }
+        if ((entry->command = strdup(command)) == NULL) {
+            free(entry);
+            pthread_mutex_unlock(&lastgood_lock);
+            return;
+        }
+        entry->output = NULL;
+        entry->next = lastgood_head;
+        lastgood_head = entry;
+
+        //past the limit, drop whatever's at the back:
+        int count = 1;
+        struct lastgood* cur = lastgood_head;
+        while (cur->next != NULL && count < LASTGOOD_MAX) {
+            cur = cur->next;
+            ++count;
+        }
+        struct lastgood* drop = cur->next;
+        cur->next = NULL;
+        while (drop != NULL) {
+            struct lastgood* next = drop->next;
+            free(drop->command);
+            free(drop->output);
+            free(drop);
+            drop = next;
+        }
+    }
+    free(entry->output);
+    entry->output = strdup(output);
+    pthread_mutex_unlock(&lastgood_lock);
+}
+
+//Returns a copy of the command's last good output, or NULL if there's none.
+static char* lastgood_get(const char* command) {
+    pthread_mutex_lock(&lastgood_lock);
+    struct lastgood* entry = lastgood_find(command);
+    char* output = (entry != NULL && entry->output != NULL) ? strdup(entry->output) : NULL;
+    pthread_mutex_unlock(&lastgood_lock);
+    return output;
+}
+
+static int parse_secs(char** contentp, const char* key, int* secs, int linenum) {
+    char* value = &(*contentp)[strlen(key)];
+    char* end;
+    long val = strtol(value, &end, 10);
+    if (end == value || (*end != ' ' && *end != '\0') || val <= 0) {
+        config_error("Syntax error, line %d: %s must be a positive number of seconds.",
+                linenum, key);
+        return -1;
+    }
+    *secs = (int)val;
+    *contentp = end;
+    return 0;
+}
 
-    while ((line_len = readline(&line,file)) > 0) {
+//Consumes any leading "key=value" cmd options from *contentp.
+//Only known keys are consumed, so that eg "LANG=C date" is still a command.
+static int parse_cmdopts(char** contentp, struct configline* cline) {
+    char* content = *contentp;
+    while (content != NULL) {
+        int secs;
+        if (strncmp(content, "timeout=", 8) == 0) {
+            if (parse_secs(&content, "timeout=", &secs, cline->linenum) < 0) {
+                return -1;
+            }
+            cline->timeout_ms = secs*1000;
+        } else if (strncmp(content, "ttl=", 4) == 0) {
+            if (parse_secs(&content, "ttl=", &cline->ttl_secs, cline->linenum) < 0) {
+                return -1;
+            }
+        } else {
+            break;
+        }
+        while (*content == ' ') {
+            ++content;
+        }
+        if (*content == '\0') {
+            content = NULL;
+        }
+    }
+    *contentp = content;
+    return 0;
+}
+
+//First pass over the config: syntax checks only, nothing is run yet.
+static int readlines(struct arena* arena, struct configline** linesp, int* countp, FILE* file) {
+    struct configline* lines = NULL;
+    int count = 0, buflen = 0, linenum = 0;
+    char* line = NULL;
+    int line_len;
+
+    struct reader reader;
+    reader_init_file(&reader, file);
+    while ((line_len = reader_line(&reader,arena,&line)) > 0) {
         ++linenum;
 
         config_debug("%s",line);
@@ -316,172 +479,520 @@ int parsefile(struct bb_frame** output, FILE* file) {
         char* tmp;
         char* cmd = strtok_r(line,delim,&tmp);
 
-        if (strcmp(cmd,"txt") == 0) {
+        enum line_type_t line_type;
+        if (cmd == NULL) {
+            //only spaces, treat like an empty line
+            continue;
+        } else if (strcmp(cmd,"txt") == 0) {
+            line_type = TXT_LINE_TYPE;
+        } else if (strcmp(cmd,"cmd") == 0) {
+            line_type = CMD_LINE_TYPE;
+        } else if (strcmp(cmd,"plugin") == 0) {
+            line_type = PLUGIN_LINE_TYPE;
+        } else if ((strlen(cmd) >= 2 && cmd[0] == '/' && cmd[1] == '/') ||
+                (strlen(cmd) >= 1 && cmd[0] == '#')) {
+            //comment in input file, do nothing
+            continue;
+        } else {
+            config_error("Syntax error, line %d: Unknown command.",linenum);
+            goto error;
+        }
 
-            char* mode = strtok_r(NULL,delim,&tmp);
-            char* text = strtok_r(NULL,delim_endline,&tmp);
-            if (checkmode(mode,text,linenum) < 0) {
-                error = 1;
-                break;
+        if (count == buflen) {
+            int newlen = (buflen == 0) ? 16 : buflen*2;
+            struct configline* newlines = arena_grow(arena, lines,
+                    buflen*sizeof(struct configline), newlen*sizeof(struct configline));
+            if (newlines == NULL) {
+                goto error;
             }
-
-            *nextframeptr = malloc(sizeof(struct bb_frame));
-            curframe = *nextframeptr;
-            curframe->next = NULL;
-
-            curframe->mode = tolower(mode[0]);
-            if (strlen(mode) > 1) {
-                curframe->mode_special = toupper(mode[1]);
-            } else {
-                curframe->mode_special = NO_SPECIAL;
+            buflen = newlen;
+            lines = newlines;
+        }
+        struct configline* cline = &lines[count];
+        cline->line_type = line_type;
+        cline->linenum = linenum;
+        cline->line = line;
+        cline->timeout_ms = CMDRUN_DEFAULT_TIMEOUT_MS;
+        cline->ttl_secs = (line_type == PLUGIN_LINE_TYPE) ? -1 : 0;
+        cline->plugin = NULL;
+        cline->output = NULL;
+        cline->mode = strtok_r(NULL,delim,&tmp);
+        cline->content = strtok_r(NULL,delim_endline,&tmp);
+        ++count;
+
+        if (line_type == CMD_LINE_TYPE) {
+            if (parse_cmdopts(&cline->content, cline) < 0) {
+                goto error;
+            }
+            if (cline->content == NULL) {
+                config_error("Syntax error, line %d: cmd is missing its command.",linenum);
+                goto error;
+            }
+        } else if (line_type == PLUGIN_LINE_TYPE) {
+            if (parse_cmdopts(&cline->content, cline) < 0) {
+                goto error;
+            }
+            if (cline->timeout_ms != CMDRUN_DEFAULT_TIMEOUT_MS) {
+                config_error("Syntax error, line %d: plugins run in-process, timeout= can't apply to them.",linenum);
+                goto error;
+            }
+            if (cline->content == NULL) {
+                config_error("Syntax error, line %d: plugin is missing its library.",linenum);
+                goto error;
             }
+            //loaded now, so that a missing library fails the parse like a syntax error:
+            if ((cline->plugin = plugin_load(cline->content, linenum)) == NULL) {
+                goto error;
+            }
+        }
+        if (checkmode(cline->mode,cline->content,linenum) < 0) {
+            goto error;
+        }
+    }
 
-            if (text == NULL) {
-                curframe->data = NULL;
-            } else {
-                int is_trimmed = 0;
+    reader_close(&reader);
+    *linesp = lines;
+    *countp = count;
+    return (line_len < 0) ? -1 : 0;
 
-                int charsparsed = parse_inline_cmds(&curframe->data,&is_trimmed,
-                        text,MAX_TEXTFILE_DATA_SIZE);
+ error:
+    reader_close(&reader);
+    *linesp = lines;
+    *countp = count;
+    return -1;
+}
 
-                if (is_trimmed) {
-                    config_error("Warning, line %d: Data has been truncated at input index %d to fit %d available output bytes.",
-                            linenum,charsparsed,MAX_TEXTFILE_DATA_SIZE);
-                    config_error("Input vs output bytecount can vary if you used inline commands in your input.");
-                }
-            }
+//Runs all cmds at once, filling in a fallback for any that fail.
+//Cmds with a ttl reuse their cached output instead, until it expires.
+static int runcmds(struct arena* arena, struct cmdrun_job** jobsp,
+                   struct configline* lines, int count, struct stats* stats) {
+    int i, jobcount = 0;
+    for (i = 0; i < count; i++) {
+        if (lines[i].line_type == CMD_LINE_TYPE) {
+            ++jobcount;
+        }
+    }
+    struct cmdrun_job* jobs = arena_alloc(arena, (jobcount+1)*sizeof(struct cmdrun_job));
+    if (jobs == NULL) {
+        return -1;
+    }
+    memset(jobs, 0, (jobcount+1)*sizeof(struct cmdrun_job));
+    *jobsp = jobs;
+    struct cmdrun_job* torun = arena_alloc(arena, (jobcount+1)*sizeof(struct cmdrun_job));
+    int* torun_job = arena_alloc(arena, (jobcount+1)*sizeof(int));
+    int* ttls = arena_alloc(arena, (jobcount+1)*sizeof(int));
+    stats->cmds = arena_alloc(arena, (jobcount+1)*sizeof(struct stats_cmd));
+    if (torun == NULL || torun_job == NULL || ttls == NULL || stats->cmds == NULL) {
+        return -1;
+    }
+    memset(stats->cmds, 0, (jobcount+1)*sizeof(struct stats_cmd));
+    stats->cmdcount = jobcount;
+    int j = 0, runcount = 0, ttlcount = 0;
+    for (i = 0; i < count; i++) {
+        if (lines[i].line_type != CMD_LINE_TYPE) {
+            continue;
+        }
+        jobs[j].command = lines[i].content;
+        jobs[j].timeout_ms = lines[i].timeout_ms;
+        jobs[j].max_output = MAX_CMD_OUTPUT_SIZE;
+        jobs[j].status = CMDRUN_OK;
+        ttls[j] = lines[i].ttl_secs;
+        if (ttls[j] > 0) {
+            jobs[j].output = cmdcache_get(jobs[j].command, lines[i].ttl_secs);
+            ++ttlcount;
+        }
+        stats->cmds[j].command = jobs[j].command;
+        if (jobs[j].output == NULL) {
+            torun[runcount] = jobs[j];
+            torun_job[runcount++] = j;
+        } else {
+            config_debug("cached: %s",jobs[j].command);
+            stats->cmds[j].cached = 1;
+            stats->cmds[j].bytes = strlen(jobs[j].output);
+        }
+        ++j;
+    }
+    if (ttlcount > 0) {
+        int hits, misses;
+        cmdcache_counts(&hits, &misses);
+        config_debug("Command cache: %d hits, %d misses",hits,misses);
+    }
 
-            curframe->frame_type = TEXT_FRAME_TYPE;
+    int ret = cmdrun_all(torun, runcount);
+    for (j = 0; j < runcount; j++) {
+        jobs[torun_job[j]] = torun[j];
+        stats->cmds[torun_job[j]].us = torun[j].elapsed_us;
+        stats->cmds[torun_job[j]].status = torun[j].status;
+        stats->cmds[torun_job[j]].bytes = torun[j].outputlen;
+        if (ret == 0 && torun[j].status == CMDRUN_OK && ttls[torun_job[j]] > 0) {
+            cmdcache_put(torun[j].command, torun[j].output);
+        }
+    }
+    if (ret < 0) {
+        return -1;
+    }
 
-            filename = packet_next_filename(filename);
-            if (filename <= 0) {
-                error = 1;
-                break;
-            }
-            curframe->filename = filename;
+    for (j = 0; j < jobcount; j++) {
+        struct cmdrun_job* job = &jobs[j];
+        if (job->status == CMDRUN_OK) {
+            lastgood_set(job->command, job->output);
+            continue;
+        }
+        if ((job->output = lastgood_get(job->command)) != NULL) {
+            config_error("Using last good output of \"%s\" instead.", job->command);
+        } else if (ttls[j] > 0 &&
+                   (job->output = cmdcache_get(job->command, -1)) != NULL) {
+            config_error("Using expired cached output of \"%s\" instead.", job->command);
+        } else {
+            config_error("Leaving output of \"%s\" blank instead.", job->command);
+            job->output = strdup("");
+        }
+        if (job->output == NULL) {
+            config_error("Memory allocation error!");
+            return -1;
+        }
+    }
+    return 0;
+}
 
-            nextframeptr = &curframe->next;
+//Fills in the output of every plugin line, one after another.
+static int runplugins(struct arena* arena, struct configline* lines, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        if (lines[i].line_type != PLUGIN_LINE_TYPE) {
+            continue;
+        }
+        //the same limit as a cmd's output, as it ends up in the same place:
+        char* output = arena_alloc(arena, MAX_CMD_OUTPUT_SIZE+1);
+        int len;
+        if (output == NULL ||
+            (len = plugin_run(lines[i].plugin, output, MAX_CMD_OUTPUT_SIZE+1,
+                              lines[i].ttl_secs)) < 0) {
+            return -1;
+        }
+        lines[i].output = arena_grow(arena, output, MAX_CMD_OUTPUT_SIZE+1, len+1);
+        if (lines[i].output == NULL) {
+            config_error("Memory allocation error!");
+            return -1;
+        }
+    }
+    return 0;
+}
 
-        } else if (strcmp(cmd,"cmd") == 0) {
+void infile_frames_init(struct infile_frames* frames) {
+    frames->head = NULL;
+    frames->tail = &frames->head;
+    frames->filename = 0;
+    frames->key = 0;
+}
 
-            char* mode = strtok_r(NULL,delim,&tmp);
-            char* command = strtok_r(NULL,delim_endline,&tmp);
-            if (checkmode(mode,command,linenum) < 0) {
-                error = 1;
-                break;
-            }
+//Appends an empty frame, with the next filename in line.
+static struct bb_frame* append_frame(struct arena* arena, struct infile_frames* frames,
+                                     enum frame_type_t frame_type) {
+    struct bb_frame* frame = arena_alloc(arena, sizeof(struct bb_frame));
+    if (frame == NULL) {
+        return NULL;
+    }
+    frame->filename = packet_next_filename(frames->filename);
+    if (frame->filename <= 0) {
+        return NULL;
+    }
+    frames->filename = frame->filename;
+    frame->frame_type = frame_type;
+    frame->mode = 0;
+    frame->mode_special = NO_SPECIAL;
+    frame->data = NULL;
+    frame->key = frames->key;
+    frame->next = NULL;
+    *frames->tail = frame;
+    frames->tail = &frame->next;
+    return frame;
+}
 
-            char* raw_result;
-            if (runcmd(&raw_result,command) < 0) {
-                error = 1;
-                break;
+struct bb_frame* infile_copy_frames(struct arena* arena, struct bb_frame* frames) {
+    struct bb_frame* head = NULL;
+    struct bb_frame** tail = &head;
+    for (; frames != NULL; frames = frames->next) {
+        struct bb_frame* frame = arena_alloc(arena, sizeof(struct bb_frame));
+        if (frame == NULL) {
+            return NULL;
+        }
+        *frame = *frames;
+        if (frames->data != NULL) {
+            size_t len = strlen(frames->data) + 1;
+            if ((frame->data = arena_alloc(arena, len)) == NULL) {
+                return NULL;
             }
+            memcpy(frame->data, frames->data, len);
+        }
+        frame->next = NULL;
+        *tail = frame;
+        tail = &frame->next;
+    }
+    return head;
+}
 
-            //data for the TEXT frame which will reference these STRING frames:
-            char refchar = 0x10;//format for each reference is 2 bytes: "0x10, filename" (pg55)
-            char* textrefs = (char*)calloc(2*MAX_STRINGFILE_GROUP_COUNT+1,sizeof(char));//include \0 in size
-            textrefs[2*MAX_STRINGFILE_GROUP_COUNT] = 0;//set \0
-
-            //Create and append STRING frames:
-            int i, cumulative_parsed = 0;
-            for (i = 0; i < MAX_STRINGFILE_GROUP_COUNT; i++) {
-                *nextframeptr = malloc(sizeof(struct bb_frame));
-                curframe = *nextframeptr;
-                curframe->next = NULL;
-                if (head == NULL) {
-                    head = curframe;
-                }
+int infile_add_text(struct arena* arena, struct infile_frames* frames,
+                    const char* mode, const char* text, int linenum, struct stats* stats) {
+    struct bb_frame* curframe = append_frame(arena, frames, TEXT_FRAME_TYPE);
+    if (curframe == NULL) {
+        return -1;
+    }
 
-                int is_trimmed = 0;
-                char* parsed_result;
-                int charsparsed = parse_inline_cmds((char**)&parsed_result,&is_trimmed,
-                        &raw_result[cumulative_parsed],
-                        MAX_STRINGFILE_DATA_SIZE);
-                cumulative_parsed += charsparsed;
-                if (is_trimmed && i+1 == MAX_STRINGFILE_GROUP_COUNT) {
-                    config_error("Warning, line %d: Data has been truncated at input index %d to fit %d available output bytes.",
-                            linenum,cumulative_parsed,MAX_STRINGFILE_GROUP_COUNT*MAX_STRINGFILE_DATA_SIZE);
-                    config_error("Input vs output bytecount can vary if you used inline commands in your input.");
-                }
+    curframe->mode = tolower(mode[0]);
+    if (strlen(mode) > 1) {
+        curframe->mode_special = toupper(mode[1]);
+    }
 
-                curframe->data = malloc(MAX_STRINGFILE_DATA_SIZE+1);
-                strncpy(curframe->data,parsed_result,
-                        MAX_STRINGFILE_DATA_SIZE);
-                curframe->data[MAX_STRINGFILE_DATA_SIZE] = 0;
-                free(parsed_result);
-                config_debug(">%d %s",i,curframe->data);
-
-                filename = packet_next_filename(filename);
-                if (filename <= 0) {
-                    error = 1;
-                    break;
-                }
-                curframe->filename = filename;
-                //add a reference for ourselves to the TEXT frame:
-                textrefs[2*i] = refchar;
-                textrefs[2*i+1] = filename;
+    if (text != NULL) {
+        int is_trimmed = 0;
 
-                curframe->frame_type = STRING_FRAME_TYPE;
+        long long time_markup = timing_now_us();
+        int charsparsed = parse_inline_cmds(arena,&curframe->data,&is_trimmed,
+                text,MAX_TEXTFILE_DATA_SIZE);
+        stats->markup_us += timing_now_us() - time_markup;
+        if (charsparsed < 0) {
+            return -1;
+        }
 
-                nextframeptr = &curframe->next;
+        if (is_trimmed) {
+            config_error("Warning, line %d: Data has been truncated at input index %d to fit %d available output bytes.",
+                    linenum,charsparsed,MAX_TEXTFILE_DATA_SIZE);
+            config_error("Input vs output bytecount can vary if you used inline commands in your input.");
+        }
+    }
+    return 0;
+}
+
+//STRINGs are split where the content says to rather than at fixed offsets, so
+//that a small edit only changes the STRING it's in, with the others (and their
+//packets) staying as they were. A chunk ends after a <br> or after a word whose
+//hash comes up 1 in 'odds', once it's at least STRING_CHUNK_MIN bytes. That
+//leaves most chunks well short of MAX_STRINGFILE_DATA_SIZE, with room to grow
+//before an edit forces a break somewhere else. Longer text gets longer odds,
+//whose breaks are a subset of the shorter odds' breaks.
+#define STRING_CHUNK_MIN 32
+#define STRING_BREAK_ODDS_MIN 4
+#define STRING_BREAK_ODDS_MAX 64
+#define STRING_TOTAL_SIZE (MAX_STRINGFILE_GROUP_COUNT*MAX_STRINGFILE_DATA_SIZE)
+
+//Finds where each chunk of (translated) out ends. Returns the chunk count, or
+//-1 if there's a word which doesn't fit in a STRING.
+static int chunk_ends(const char* out, size_t len, size_t* ends, unsigned int odds) {
+    int count = 0;
+    size_t start = 0, last = 0, word = 0, p;
+    for (p = 1; p <= len; p++) {
+        //candidates are after a <br>, or after a word and its trailing spaces
+        if (p < len && out[p-1] != 0x0c && (out[p-1] != ' ' || out[p] == ' ')) {
+            continue;
+        }
+        if (p - start > MAX_STRINGFILE_DATA_SIZE) {
+            if (last == start) {
+                return -1;
             }
-            free(raw_result);
-            if (error == 1) {
-                break;
+            ends[count++] = start = last;
+            if (p - start > MAX_STRINGFILE_DATA_SIZE) {
+                return -1;
             }
+        }
+        if (p == len) {
+            break;
+        }
+        if (p - start >= STRING_CHUNK_MIN &&
+            (out[p-1] == 0x0c || sentstate_hash(&out[word], p - word) % odds == 0)) {
+            ends[count++] = start = p;
+        }
+        last = word = p;
+    }
+    if (start < len) {
+        ends[count++] = len;
+    }
+    return count;
+}
 
-            //Append TEXT frame containing references to those STRINGs:
-            *nextframeptr = malloc(sizeof(struct bb_frame));
-            curframe = *nextframeptr;
-            curframe->next = NULL;
-
-            curframe->mode = mode[0];
-            if (strlen(mode) > 1) {
-                curframe->mode_special = mode[1];
-            } else {
-                curframe->mode_special = NO_SPECIAL;
+//Splits out into at most MAX_STRINGFILE_GROUP_COUNT chunks, see chunk_ends().
+//Returns the chunk count, or -1 if it doesn't fit.
+static int chunk_text(const char* out, size_t* ends) {
+    size_t len = strlen(out);
+    unsigned int odds;
+    int count = -1;
+    for (odds = STRING_BREAK_ODDS_MIN; odds <= STRING_BREAK_ODDS_MAX; odds *= 2) {
+        count = chunk_ends(out, len, ends, odds);
+        if (count <= MAX_STRINGFILE_GROUP_COUNT) {
+            return count;
+        }
+    }
+    //still too many (lots of <br>s?): merge the smallest neighbors which fit
+    while (count > MAX_STRINGFILE_GROUP_COUNT) {
+        int i, best = -1;
+        size_t bestsize = MAX_STRINGFILE_DATA_SIZE + 1;
+        for (i = 0; i + 1 < count; i++) {
+            size_t size = ends[i+1] - ((i == 0) ? 0 : ends[i-1]);
+            if (size < bestsize) {
+                bestsize = size;
+                best = i;
             }
+        }
+        if (best < 0) {
+            return -1;
+        }
+        memmove(&ends[best], &ends[best+1], (count - best - 1)*sizeof(size_t));
+        --count;
+    }
+    return count;
+}
 
-            curframe->data = textrefs;
-
-            curframe->frame_type = TEXT_FRAME_TYPE;
-
-            filename = packet_next_filename(filename);
-            if (filename <= 0) {
-                error = 1;
-                break;
+int infile_fill_strings(struct arena* arena, struct bb_frame* strings,
+                        const char* text, int linenum, struct stats* stats) {
+    int i, is_trimmed = 0;
+    struct bb_frame* curframe = strings;
+    char* out;
+    long long time_markup = timing_now_us();
+    int charsparsed = parse_inline_cmds(arena,&out,&is_trimmed,text,STRING_TOTAL_SIZE);
+    stats->markup_us += timing_now_us() - time_markup;
+    if (charsparsed < 0) {
+        return -1;
+    }
+    size_t ends[STRING_TOTAL_SIZE];
+    int count;
+    if (!is_trimmed && (count = chunk_text(out, ends)) >= 0) {
+        size_t start = 0;
+        for (i = 0; i < MAX_STRINGFILE_GROUP_COUNT; i++) {
+            size_t end = (i < count) ? ends[i] : start;
+            if ((curframe->data = arena_alloc(arena, end - start + 1)) == NULL) {
+                return -1;
             }
-            curframe->filename = filename;
-
-            nextframeptr = &curframe->next;
+            memcpy(curframe->data, &out[start], end - start);
+            curframe->data[end - start] = '\0';
+            start = end;
 
-        } else if ((strlen(cmd) >= 2 && cmd[0] == '/' && cmd[1] == '/') ||
-                (strlen(cmd) >= 1 && cmd[0] == '#')) {
+            config_debug(">%d %s",i,curframe->data);
+            curframe = curframe->next;
+        }
+        return 0;
+    }
 
-            //comment in input file, do nothing
+    //too long or too few spaces to chunk by content, so fill each STRING in turn:
+    int cumulative_parsed = 0;
+    for (i = 0; i < MAX_STRINGFILE_GROUP_COUNT; i++) {
+        is_trimmed = 0;
+        time_markup = timing_now_us();
+        charsparsed = parse_inline_cmds(arena,&curframe->data,&is_trimmed,
+                &text[cumulative_parsed],
+                MAX_STRINGFILE_DATA_SIZE);
+        stats->markup_us += timing_now_us() - time_markup;
+        if (charsparsed < 0) {
+            return -1;
+        }
+        cumulative_parsed += charsparsed;
+        if (is_trimmed && i+1 == MAX_STRINGFILE_GROUP_COUNT) {
+            config_error("Warning, line %d: Data has been truncated at input index %d to fit %d available output bytes.",
+                    linenum,cumulative_parsed,STRING_TOTAL_SIZE);
+            config_error("Input vs output bytecount can vary if you used inline commands in your input.");
+        }
 
-        } else {
+        config_debug(">%d %s",i,curframe->data);
+        curframe = curframe->next;
+    }
+    return 0;
+}
 
-            config_error("Syntax error, line %d: Unknown command.",linenum);
-            error = 1;
-            break;
+struct bb_frame* infile_add_strings(struct arena* arena, struct infile_frames* frames,
+                                    const char* mode, const char* text, int linenum,
+                                    struct stats* stats) {
+    //data for the TEXT frame which will reference these STRING frames:
+    char refchar = 0x10;//format for each reference is 2 bytes: "0x10, filename" (pg55)
+    char* textrefs = arena_alloc(arena, 2*MAX_STRINGFILE_GROUP_COUNT+1);//include \0 in size
+    if (textrefs == NULL) {
+        return NULL;
+    }
+    textrefs[2*MAX_STRINGFILE_GROUP_COUNT] = 0;//set \0
 
+    //Create and append STRING frames:
+    struct bb_frame* strings = NULL;
+    int i;
+    for (i = 0; i < MAX_STRINGFILE_GROUP_COUNT; i++) {
+        struct bb_frame* curframe = append_frame(arena, frames, STRING_FRAME_TYPE);
+        if (curframe == NULL) {
+            return NULL;
         }
-
-        if (head == NULL) {
-            head = curframe;
+        if (strings == NULL) {
+            strings = curframe;
         }
+        //add a reference for ourselves to the TEXT frame:
+        textrefs[2*i] = refchar;
+        textrefs[2*i+1] = curframe->filename;
+    }
+    if (text != NULL && infile_fill_strings(arena, strings, text, linenum, stats) < 0) {
+        return NULL;
+    }
 
-        free(line);
-        line = NULL;
+    //Append TEXT frame containing references to those STRINGs:
+    struct bb_frame* curframe = append_frame(arena, frames, TEXT_FRAME_TYPE);
+    if (curframe == NULL) {
+        return NULL;
+    }
+    curframe->mode = mode[0];
+    if (strlen(mode) > 1) {
+        curframe->mode_special = mode[1];
     }
+    curframe->data = textrefs;
+    return strings;
+}
 
-    if (line != NULL) {
-        free(line);
-        line = NULL;
+int parsefile(struct arena* arena, struct bb_frame** output, FILE* file,
+              struct stats* stats) {
+    int error = 0;
+
+    struct infile_frames frames;
+    infile_frames_init(&frames);
+
+    struct configline* lines = NULL;
+    int linecount = 0, l;
+    struct cmdrun_job* jobs = NULL;
+    int nextjob = 0;
+    struct stats nostats;
+    if (stats == NULL) {
+        stats_clear(&nostats);
+        stats = &nostats;
+    }
+    long long time_start = timing_now_us();
+    if (readlines(arena, &lines, &linecount, file) < 0) {
+        error = 1;
+    }
+    long long time_read = timing_now_us();
+    stats->read_us = time_read - time_start;
+    if (error == 0 && (runcmds(arena, &jobs, lines, linecount, stats) < 0 ||
+                       runplugins(arena, lines, linecount) < 0)) {
+        error = 1;
+    }
+    stats->cmds_us = timing_now_us() - time_read;
+
+    for (l = 0; error == 0 && l < linecount; l++) {
+        //a txt is known by its text, a cmd/plugin by what it runs:
+        static const char kinds[] = { 0, 't', 'c', 'p' };
+        frames.key = labelmap_key(kinds[lines[l].line_type], lines[l].content);
+        if (lines[l].line_type == TXT_LINE_TYPE) {
+            if (infile_add_text(arena, &frames, lines[l].mode, lines[l].content,
+                                lines[l].linenum, stats) < 0) {
+                error = 1;
+            }
+        } else {
+            char* raw_result = (lines[l].line_type == CMD_LINE_TYPE) ?
+                    jobs[nextjob++].output : lines[l].output;
+            if (infile_add_strings(arena, &frames, lines[l].mode, raw_result,
+                                   lines[l].linenum, stats) == NULL) {
+                error = 1;
+            }
+        }
     }
 
-    *output = head;
+    if (jobs != NULL) {
+        for (l = 0; jobs[l].command != NULL; l++) {
+            free(jobs[l].output);
+        }
+    }
+    *output = frames.head;
 
     return (error == 0) ? 0 : -1;
 }
@@ -22,8 +22,42 @@
 \************************************************************************/
 
 #include "packet.h"
+#include "stats.h"
 #include <stdio.h>
 
-int parsefile(struct bb_frame** output, FILE* file);
+//Translates markup in 'in' to sign codes, writing at most maxout bytes (plus \0)
+//into arena at *outptr. Returns how much of 'in' was consumed, or <0 on error.
+int parse_inline_cmds(struct arena* arena, char** outptr, int* output_is_trimmed,
+        const char* in, unsigned int maxout);
+
+//Checks a config line's mode field, opt being the rest of the line (if any).
+int checkmode(const char* mode, const char* opt, int linenum);
+
+//Frames and their data are allocated from arena. stats may be NULL.
+int parsefile(struct arena* arena, struct bb_frame** output, FILE* file,
+              struct stats* stats);
+
+//A frame list as parsefile() builds it, one config line at a time, with
+//filenames handed out in order. stats may not be NULL here.
+struct infile_frames {
+    struct bb_frame* head;
+    struct bb_frame** tail;
+    char filename;//last one handed out
+    uint64_t key;//given to the frames added from here on, see labelmap.h
+};
+void infile_frames_init(struct infile_frames* frames);
+//Like a txt line: a TEXT frame showing text (markup), which may be NULL.
+int infile_add_text(struct arena* arena, struct infile_frames* frames,
+                    const char* mode, const char* text, int linenum, struct stats* stats);
+//Like a cmd line: MAX_STRINGFILE_GROUP_COUNT STRING frames filled from text (if
+//non-NULL), then a TEXT frame showing them. Returns the first STRING frame.
+struct bb_frame* infile_add_strings(struct arena* arena, struct infile_frames* frames,
+                                    const char* mode, const char* text, int linenum,
+                                    struct stats* stats);
+//Copies a frame list and its data into arena.
+struct bb_frame* infile_copy_frames(struct arena* arena, struct bb_frame* frames);
+//Splits text (markup) across the STRING frames from infile_add_strings().
+int infile_fill_strings(struct arena* arena, struct bb_frame* strings,
+                        const char* text, int linenum, struct stats* stats);
 
 #endif
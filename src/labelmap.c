@@ -0,0 +1,121 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Label map between config lines and the sign's files
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "labelmap.h"
+#include "config.h"
+
+#include <string.h>
+
+//see infile_add_strings()
+#define STRING_REF_CHAR 0x10
+
+static char layout_type(struct bb_frame* frame) {
+    return (frame->frame_type == STRING_FRAME_TYPE) ? 'B' : 'A';
+}
+
+uint64_t labelmap_key(char kind, const char* source) {
+    uint64_t hash = sentstate_hash(source, (source == NULL) ? 0 : strlen(source));
+    return hash ^ ((uint64_t)(unsigned char)kind << 56);
+}
+
+//Takes the first unclaimed file for frame, optionally only one with its key.
+static int claim(struct bb_frame* frame, struct sentstate* state,
+                 char* claimed, int match_key) {
+    char type = layout_type(frame);
+    unsigned int size = packet_memsize(frame);
+    int label;
+    for (label = 0; label < SENTSTATE_LABEL_COUNT; label++) {
+        struct sentstate_file* file = &state->layout[label];
+        if (!claimed[label] && file->type == type && file->size >= size &&
+            (!match_key || file->key == frame->key)) {
+            claimed[label] = 1;
+            return label;
+        }
+    }
+    return -1;
+}
+
+int labelmap_plan(struct bb_frame* frames, struct sentstate* state) {
+    if (!state->has_layout) {
+        return 0;
+    }
+    int count = 0, i;
+    struct bb_frame* curframe;
+    for (curframe = frames; curframe != NULL; curframe = curframe->next) {
+        ++count;
+    }
+    if (count > SENTSTATE_LABEL_COUNT) {
+        return 0;
+    }
+
+    //frames whose lines were already on the sign keep their files, then the
+    //rest (new or grown lines) fill in whatever is left over:
+    char claimed[SENTSTATE_LABEL_COUNT];
+    int labels[SENTSTATE_LABEL_COUNT];
+    memset(claimed, 0, sizeof(claimed));
+    for (curframe = frames, i = 0; curframe != NULL; curframe = curframe->next, i++) {
+        labels[i] = claim(curframe, state, claimed, 1);
+    }
+    for (curframe = frames, i = 0; curframe != NULL; curframe = curframe->next, i++) {
+        if (labels[i] < 0 && (labels[i] = claim(curframe, state, claimed, 0)) < 0) {
+            config_debug("No room in the sign's layout for %c:%s",
+                    layout_type(curframe), curframe->data);
+            return 0;
+        }
+    }
+
+    //everything fits, move the frames over:
+    struct bb_frame* strings = NULL;
+    for (curframe = frames, i = 0; curframe != NULL; curframe = curframe->next, i++) {
+        curframe->filename = labels[i];
+        state->layout[labels[i]].key = curframe->key;
+        if (curframe->frame_type == STRING_FRAME_TYPE) {
+            if (strings == NULL) {
+                strings = curframe;
+            }
+            continue;
+        }
+        if (strings != NULL) {
+            //a cmd's TEXT frame, referencing the STRINGs just before it
+            char* ref = curframe->data;
+            for (; strings != curframe; strings = strings->next) {
+                *ref++ = STRING_REF_CHAR;
+                *ref++ = strings->filename;
+            }
+            strings = NULL;
+        }
+    }
+    return 1;
+}
+
+void labelmap_record(struct bb_frame* frames, struct sentstate* state) {
+    memset(state->layout, 0, sizeof(state->layout));
+    struct bb_frame* curframe;
+    for (curframe = frames; curframe != NULL; curframe = curframe->next) {
+        unsigned char label = (unsigned char)curframe->filename;
+        if (label < SENTSTATE_LABEL_COUNT) {
+            state->layout[label].type = layout_type(curframe);
+            state->layout[label].size = packet_memsize(curframe);
+            state->layout[label].key = curframe->key;
+        }
+    }
+    state->has_layout = 1;
+}
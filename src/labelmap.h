@@ -0,0 +1,49 @@
+#ifndef __LABELMAP_H__
+#define __LABELMAP_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "packet.h"
+#include "sentstate.h"
+
+//Labels used to be handed out by position, so any change to a config moved
+//everything after it and needed the sign's memory to be reallocated from
+//scratch, which blanks the sign. Instead each frame carries a key naming the
+//config line it came from, and the memory config last sent to the sign is
+//kept in the sentstate along with those keys. A later config can then be
+//moved onto the labels which are already allocated on the sign, leaving only
+//changed files (and maybe the run sequence) to send.
+
+//The key for frames from a config line: kind is the line type ('t' for txt,
+//'c' for cmd...), source what identifies it (the text, the command...).
+uint64_t labelmap_key(char kind, const char* source);
+
+//Moves frames onto the labels in state's layout, matching by key first and
+//then taking any leftover files which are big enough. Any STRING references
+//in TEXT frames follow their STRINGs. state's keys are updated to match.
+//Returns 1 if frames were moved, or 0 if they don't fit in the layout (or
+//there isn't one), in which case nothing is changed.
+int labelmap_plan(struct bb_frame* frames, struct sentstate* state);
+
+//Sets state's layout to that of a memory config built from frames.
+void labelmap_record(struct bb_frame* frames, struct sentstate* state);
+
+#endif
@@ -0,0 +1,131 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Asynchronous log file writer
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "logwriter.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOGWRITER_BUFSIZE 65536
+#define LOGWRITER_CHUNK 4096//most the thread copies out of the buffer at once
+
+struct logwriter {
+    FILE* file;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+
+    //ring buffer, guarded by lock:
+    char buf[LOGWRITER_BUFSIZE];
+    size_t head, len;
+    unsigned long dropped;
+    int stop;
+};
+
+static void* writer_main(void* arg) {
+    struct logwriter* writer = arg;
+    char chunk[LOGWRITER_CHUNK];
+    pthread_mutex_lock(&writer->lock);
+    while (1) {
+        while (writer->len == 0 && writer->dropped == 0 && !writer->stop) {
+            pthread_cond_wait(&writer->ready, &writer->lock);
+        }
+        if (writer->len == 0 && writer->dropped == 0) {
+            break;//stopped and drained
+        }
+        size_t len = writer->len;
+        if (len > LOGWRITER_CHUNK) {
+            len = LOGWRITER_CHUNK;
+        }
+        if (len > LOGWRITER_BUFSIZE - writer->head) {
+            len = LOGWRITER_BUFSIZE - writer->head;//up to the wraparound
+        }
+        memcpy(chunk, &writer->buf[writer->head], len);
+        writer->head = (writer->head + len) % LOGWRITER_BUFSIZE;
+        writer->len -= len;
+        unsigned long dropped = 0;
+        if (writer->len == 0) {
+            //caught up with everything from before the drop
+            dropped = writer->dropped;
+            writer->dropped = 0;
+        }
+
+        //the slow part happens without holding the lock:
+        pthread_mutex_unlock(&writer->lock);
+        fwrite(chunk, 1, len, writer->file);
+        if (dropped > 0) {
+            fprintf(writer->file, "[log buffer full, dropped %lu bytes]\n", dropped);
+        }
+        fflush(writer->file);
+        pthread_mutex_lock(&writer->lock);
+    }
+    pthread_mutex_unlock(&writer->lock);
+    return NULL;
+}
+
+struct logwriter* logwriter_open(FILE* file) {
+    struct logwriter* writer = calloc(1, sizeof(struct logwriter));
+    if (writer == NULL) {
+        return NULL;
+    }
+    writer->file = file;
+    pthread_mutex_init(&writer->lock, NULL);
+    pthread_cond_init(&writer->ready, NULL);
+    if (pthread_create(&writer->thread, NULL, writer_main, writer) != 0) {
+        pthread_cond_destroy(&writer->ready);
+        pthread_mutex_destroy(&writer->lock);
+        free(writer);
+        return NULL;
+    }
+    return writer;
+}
+
+void logwriter_write(struct logwriter* writer, const char* data, size_t len) {
+    pthread_mutex_lock(&writer->lock);
+    if (len > LOGWRITER_BUFSIZE - writer->len || writer->dropped > 0) {
+        //keep lines whole: once something's been dropped, drop until the thread catches up
+        writer->dropped += len;
+    } else {
+        size_t tail = (writer->head + writer->len) % LOGWRITER_BUFSIZE;
+        size_t first = LOGWRITER_BUFSIZE - tail;
+        if (first > len) {
+            first = len;
+        }
+        memcpy(&writer->buf[tail], data, first);
+        memcpy(writer->buf, &data[first], len - first);
+        writer->len += len;
+    }
+    pthread_cond_signal(&writer->ready);
+    pthread_mutex_unlock(&writer->lock);
+}
+
+void logwriter_close(struct logwriter* writer) {
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = 1;
+    pthread_cond_signal(&writer->ready);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    pthread_cond_destroy(&writer->ready);
+    pthread_mutex_destroy(&writer->lock);
+    fclose(writer->file);
+    free(writer);
+}
@@ -0,0 +1,38 @@
+#ifndef __LOGWRITER_H__
+#define __LOGWRITER_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include <stddef.h>
+#include <stdio.h>
+
+//Buffers log output in memory and writes it to a file from a background
+//thread, so that a slow disk never holds up the caller. If the buffer fills
+//up, output is dropped (and the drop noted in the file) instead of waiting.
+struct logwriter;
+
+//Takes ownership of file, which is closed by logwriter_close().
+struct logwriter* logwriter_open(FILE* file);
+void logwriter_write(struct logwriter* writer, const char* data, size_t len);
+//Writes out whatever is still buffered, then stops the thread.
+void logwriter_close(struct logwriter* writer);
+
+#endif
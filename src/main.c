@@ -24,10 +24,11 @@
 #include <stdlib.h>
 #include <errno.h>
 
+#include "bbusb.h"
+#include "cmdcache.h"
+#include "cmdrun.h"
 #include "config.h"
-#include "usbsign.h"
-#include "packet.h"
-#include "hardware.h"
+#include "daemon.h"
 
 static void version(void) {
     config_error("bbusb %s (%s)",VERSION_STRING,USB_TYPE);
@@ -38,26 +39,69 @@ static void version(void) {
 
 static void help(char* appname) {
     version();
-    config_error("");
+    config_errornl();
     config_error("Usage: %s <mode> [options] [configfile]", appname);
-    config_error("");
+    config_errornl();
     config_error("Modes:");
     config_error("  -i/--init:\tre-initialize the sign (required when configfile changes)");
     config_error("  -u/--update:\tupdate the sign contents without init (smoother than --init)");
-    config_error("");
+    config_error("  -d/--daemon <socket>:\tkeep the sign open and serve -i/-u requests");
+    config_error("                       \tsent by \"-c <socket>\" on a unix socket");
+    config_errornl();
     config_error("Options:");
     config_error("  configfile:\tPath to a Config File (see syntax below).");
     config_error("             \tIf configfile is unspecified, stdin will be used.");
     config_error("  -h/--help        This help text.");
     config_error("  -v/--verbose     Show verbose output.");
-    config_error("  --log <file>     Append any output to <file>.");
-    config_error("");
+    config_error("  --log <file>     Append any output to <file>, written from a background thread.");
+    config_error("  -t/--timing      Report how long the update took, from parse to last byte sent.");
+    config_error("  --stats[=json]   Report per-phase times, per-cmd and per-transfer times, and");
+    config_error("                   packet/byte counts, as \"stats <key> <value>\" lines or as");
+    config_error("                   a one-line JSON object. With --daemon, added to every reply.");
+    config_error("  -D/--device <dev>  Which sign to use, if there are several: a USB port path");
+    config_error("                   like 1-1.4 (as in /sys/bus/usb/devices), or serial=<serial>.");
+    config_error("                   Or fd=<n>: the sign's usbfs node, already opened on fd <n>");
+    config_error("                   by a supervising process (needs libusb 1.0.23 or newer).");
+    config_error("                   Repeat to update several signs at once, from one parse of");
+    config_error("                   the config. Each keeps its own --state, in <file>.<dev>.");
+    config_error("  --retry <secs>   How long to keep trying if the sign stops responding or is");
+    config_error("                   unplugged, sending again as soon as it's back. 0 only resets");
+    config_error("                   it and tries once more. Default: %d. A --daemon also sends",
+            BB_RETRY_DEFAULT_MS/1000);
+    config_error("                   the last request of each kind again when the sign is back.");
+    config_error("  -c/--connect <socket>  Send this -i/-u request to a running --daemon");
+    config_error("                   instead of opening the sign directly.");
+    config_error("  -s/--state <file>  Remember what was last sent to the sign in <file>,");
+    config_error("                   and only send messages whose content has changed.");
+    config_error("                   -i then only reallocates the sign's memory (blanking it)");
+    config_error("                   if the config no longer fits. Delete <file> to force it.");
+    config_error("                   Also where the sign was found, to open it without looking");
+    config_error("                   through the bus next time (see enum_us in --stats).");
+    config_error("                   (--daemon always remembers this in memory)");
+    config_error("  --cache-dir <dir>  Where to cache the output of cmds with a ttl.");
+    config_error("                   Default: $XDG_CACHE_HOME/bbusb or ~/.cache/bbusb");
+    config_error("  --set-clock[=12|24]  Set the sign's clock to local time, shown 1:00PM (12)");
+    config_error("                   or 13:00 (24), for <time>/<date>/<weekday>. Waits for the");
+    config_error("                   minute to turn. May be used alone, or before an -i/-u.");
+    config_error("  --alert <text>   Show <text> (with markup) ahead of everything else, until");
+    config_error("                   --clear-alert. Sent as a single packet, without touching");
+    config_error("                   the sign's memory. May be used alone, or before an -i/-u.");
+    config_error("  --alert-mode <mode>  The txt mode to show the --alert with. Default: b");
+    config_error("  --clear-alert    Remove a --alert, resuming the normal messages.");
+    config_errornl();
     config_error("Config File Syntax:");
     config_error("  #comment");
     config_error("  //comment");
     config_error("  txt <mode> [text (optional if mode=nX)]");
-    config_error("  cmd <mode> <shell command>");
-    config_error("");
+    config_error("  cmd <mode> [timeout=<secs>] [ttl=<secs>] <shell command>");
+    config_error("  All cmds run at once. A cmd which fails or runs past its timeout (default %ds)",
+            CMDRUN_DEFAULT_TIMEOUT_MS/1000);
+    config_error("  is shown with its last good output if there is one, or left blank otherwise.");
+    config_error("  A cmd with a ttl reuses its cached output until it's ttl seconds old.");
+    config_error("  plugin <mode> [ttl=<secs>] <lib.so> [args]");
+    config_error("  Like cmd, but shows what a shared library returns, without starting a");
+    config_error("  process. It stays loaded while bbusb runs, see bbusb-plugin.h.");
+    config_errornl();
     config_error("Available Mode Codes (spec pg89-90)");
     config_error("  Note: Some \"nX\" modes don't work for \"cmd\" commands.");
     config_error("        Get around this by prefixing with an empty \"txt\" (ex: txt nx\\ncmd ...)");
@@ -74,7 +118,7 @@ static void help(char* appname) {
     config_error("  l wiperight \tn5 cyclecolor \tny xmas");
     config_error("  m scroll \tn6 spray \tnz smile");
     config_error("  o automode \tn7 starburst");
-    config_error("");
+    config_errornl();
     config_error("Inline Text Format Syntax (spec pg81-82):");
     config_error("  <left> -- Left-align the text in this frame.");
     config_error("            Only works in some frame modes (eg \"hold\")");
@@ -92,7 +136,9 @@ static void help(char* appname) {
     config_error("                Examples: <color303> for bright purple, <color101> for dim purple.");
     config_error("  <scolorRGB> -- Change the text shadow color (for text with <shadow> applied).");
     config_error("                 Uses same RGB codes as <colorRGB>.");
-    config_error("");
+    config_error("  <time>,<date>,<weekday> -- The sign's clock (see --set-clock), kept current");
+    config_error("                 by the sign itself: use them in txt lines to avoid updates.");
+    config_errornl();
     config_error("Some Special Character Entities (pg84-87):");
     config_error("  &uparrow; &downarrow; &leftarrow; &rightarrow;");
     config_error("  &cent; &gbp; &yen; &euro;");
@@ -101,13 +147,34 @@ static void help(char* appname) {
     config_error("  &heart; &pacman; &ball; &note;");
     config_error("  &mug; &bottle; &handicap; &copy;");
     config_error("  &rhino; &infinity;");
-    config_error("");
+    config_errornl();
 }
 
 static void mini_help(char* appname) {
     config_error("Run \"%s -h\" for help.",appname);
 }
 
+#define MAX_DEVICES 16
+
+//With several signs, each one's output is prefixed by its device:
+struct sign_log {
+    const char* device;
+    int midline;
+};
+static void sign_log_write(void* arg, int level, const char* text) {
+    struct sign_log* log = arg;
+    struct config_sink* sink = config_thread_sink;
+    config_thread_sink = NULL;//on to the usual outputs
+    if (log->midline) {
+        config_write(level, 0, "%s", text);
+    } else {
+        config_write(level, 0, "%s: %s", log->device, text);
+    }
+    config_thread_sink = sink;
+    size_t len = strlen(text);
+    log->midline = len > 0 && text[len-1] != '\n';
+}
+
 int main(int argc, char* argv[]) {
     config_fout = stdout;
     config_ferr = stderr;
@@ -116,8 +183,18 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
-    int mode_specified = 0, do_init = 0;
+    int mode_specified = 0, do_init = 0, do_timing = 0, set_clock = 0;
+    enum bb_stats_format stats_format = BB_STATS_NONE;
     char* configpath = NULL;
+    char* daemonpath = NULL;
+    char* connectpath = NULL;
+    char* statepath = NULL;
+    char* devices[MAX_DEVICES];
+    int devcount = 0;
+    char* alert_text = NULL;
+    char* alert_mode = "b";
+    int clear_alert = 0;
+    int retry_ms = BB_RETRY_DEFAULT_MS;
     FILE* configfile;
 
     int c;
@@ -128,11 +205,23 @@ int main(int argc, char* argv[]) {
             {"log", required_argument, NULL, 'l'},
             {"init", 0, NULL, 'i'},
             {"update", 0, NULL, 'u'},
+            {"timing", 0, NULL, 't'},
+            {"daemon", required_argument, NULL, 'd'},
+            {"connect", required_argument, NULL, 'c'},
+            {"state", required_argument, NULL, 's'},
+            {"device", required_argument, NULL, 'D'},
+            {"cache-dir", required_argument, NULL, 'C'},
+            {"stats", optional_argument, NULL, 'S'},
+            {"set-clock", optional_argument, NULL, 'k'},
+            {"alert", required_argument, NULL, 'a'},
+            {"alert-mode", required_argument, NULL, 'A'},
+            {"clear-alert", 0, NULL, 'x'},
+            {"retry", required_argument, NULL, 'r'},
             {0,0,0,0}
         };
 
         int option_index = 0;
-        c = getopt_long(argc, argv, "hvl:iu",
+        c = getopt_long(argc, argv, "hvl:iutd:c:s:D:",
                 long_options, &option_index);
         if (c == -1) {//unknown arg (doesnt match -x/--x format)
             if (optind >= argc) {
@@ -159,17 +248,16 @@ int main(int argc, char* argv[]) {
             help(argv[0]);
             return -1;
         case 'v':
-            config_debug_enabled = 1;
+            config_level = CONFIG_LEVEL_DEBUG;
+#if CONFIG_MAX_LEVEL < CONFIG_LEVEL_DEBUG
+            config_error("Verbose output isn't built in (BBUSB_LOG_LEVEL=%d), ignoring -v.",
+                    CONFIG_MAX_LEVEL);
+#endif
             break;
         case 'l':
-            {
-                FILE* logfile = fopen(optarg, "a");
-                if (logfile == NULL) {
-                    config_error("Unable to open log file %s: %s", optarg, strerror(errno));
-                    return -1;
-                }
-                config_fout = logfile;
-                config_ferr = logfile;
+            if (config_open_log(optarg) < 0) {
+                config_error("Unable to open log file %s: %s", optarg, strerror(errno));
+                return -1;
             }
             break;
         case 'i':
@@ -180,132 +268,237 @@ int main(int argc, char* argv[]) {
             mode_specified = 1;
             do_init = 0;
             break;
+        case 't':
+            do_timing = 1;
+            break;
+        case 'd':
+            daemonpath = optarg;
+            break;
+        case 'c':
+            connectpath = optarg;
+            break;
+        case 's':
+            statepath = optarg;
+            break;
+        case 'D':
+            if (devcount == MAX_DEVICES) {
+                config_error("Too many signs, at most %d may be given.", MAX_DEVICES);
+                return -1;
+            }
+            devices[devcount++] = optarg;
+            break;
+        case 'C':
+            if (cmdcache_init(optarg) < 0) {
+                return -1;
+            }
+            break;
+        case 'S':
+            if (optarg == NULL) {
+                stats_format = BB_STATS_TEXT;
+            } else if (strcmp(optarg, "json") == 0) {
+                stats_format = BB_STATS_JSON;
+            } else {
+                config_error("Unknown stats format \"%s\"", optarg);
+                mini_help(argv[0]);
+                return -1;
+            }
+            break;
+        case 'k':
+            if (optarg == NULL || strcmp(optarg, "12") == 0) {
+                set_clock = 12;
+            } else if (strcmp(optarg, "24") == 0) {
+                set_clock = 24;
+            } else {
+                config_error("Unknown clock format \"%s\", expected 12 or 24", optarg);
+                mini_help(argv[0]);
+                return -1;
+            }
+            break;
+        case 'a':
+            alert_text = optarg;
+            break;
+        case 'A':
+            alert_mode = optarg;
+            break;
+        case 'x':
+            clear_alert = 1;
+            break;
+        case 'r':
+            if (optarg[0] == '\0' || strlen(optarg) > 4 ||
+                strspn(optarg, "0123456789") != strlen(optarg) || atoi(optarg) > 3600) {
+                config_error("Invalid retry time \"%s\", expected 0-3600 seconds", optarg);
+                mini_help(argv[0]);
+                return -1;
+            }
+            retry_ms = atoi(optarg)*1000;
+            break;
         default:
             mini_help(argv[0]);
             return -1;
         }
     }
-    if (!mode_specified) {
+    if (daemonpath != NULL) {
+        if (devcount > 1) {
+            config_error("A --daemon drives a single sign, run one for each.");
+            return -1;
+        }
+        return daemon_run(daemonpath, (devcount > 0) ? devices[0] : NULL,
+                          statepath, retry_ms, stats_format);
+    }
+    if (alert_text != NULL && clear_alert) {
+        config_error("--alert and --clear-alert can't be used together.");
+        mini_help(argv[0]);
+        return -1;
+    }
+    int do_alert = alert_text != NULL || clear_alert;
+    if (!mode_specified && set_clock == 0 && !do_alert) {
         config_error("-i/-u mode argument required.");
         mini_help(argv[0]);
+        //but carry on with an update, as always, for configs run without one
+        mode_specified = 1;
     }
 
-    int error = -1;
+    int error = 0;
     if (configpath == NULL) {
         configpath = "<stdin>";
         configfile = stdin;
     }
-    config_log("Parsing %s",configpath);
 
-    //Get and parse bb_frames (both STRINGs and TEXTs) from config:
-    struct bb_frame* startframe = NULL;
-    if (parsefile(&startframe,configfile) < 0) {
+    if (connectpath != NULL) {
+        if (stats_format != BB_STATS_NONE) {
+            config_error("--stats is set on the --daemon, not on the request.");
+        }
+        if (devcount > 0) {
+            config_error("--device is set on the --daemon, not on the request.");
+        }
+        if (do_alert) {
+            error = daemon_request_alert(connectpath, alert_mode, alert_text);
+        }
+        if (error == 0 && set_clock != 0) {
+            error = daemon_request_clock(connectpath, set_clock == 24);
+        }
+        if (error == 0 && mode_specified) {
+            error = daemon_request(connectpath, do_init,
+                    (configfile == stdin) ? NULL : configpath, configfile);
+        }
         fclose(configfile);
-        config_error("Error encountered when parsing config file. ");
-        mini_help(argv[0]);
-        goto end_noclose;
-    }
-    fclose(configfile);
-    if (startframe == NULL) {
-        config_error("Empty config file, nothing to do. ");
-        mini_help(argv[0]);
-        goto end_noclose;
+        return error;
     }
 
-
-    usbsign_handle* devh = NULL;
-    if (hardware_init(&devh) < 0) {
-        config_error("USB init failed: Exiting. ");
-        mini_help(argv[0]);
-        goto end_noclose;
+    //one handle per sign, or just the first sign found:
+    int signcount = (devcount > 0) ? devcount : 1, i;
+    bb_handle* handles[MAX_DEVICES];
+    struct sign_log logs[MAX_DEVICES];
+    char* statepaths[MAX_DEVICES];
+    int results[MAX_DEVICES];
+    memset(handles, 0, sizeof(handles));
+    memset(statepaths, 0, sizeof(statepaths));
+    for (i = 0; i < signcount; i++) {
+        results[i] = -1;
     }
-
-    char* packet = NULL;
-    int pktsize;
-
-    config_log("Writing to sign");
-
-    //send sequence header before we start sending packets
-    if (!hardware_seqstart(devh)) {
-        //try resetting device once
-        config_error("Initial write failed, attempting reset.");
-        if (!hardware_reset(&devh)) {
-            config_error("Reset failed: Exiting.");
+    for (i = 0; i < signcount; i++) {
+        if ((handles[i] = bb_open()) == NULL ||
+            bb_set_device(handles[i], (devcount > 0) ? devices[i] : NULL) < 0) {
             goto end;
         }
-        if (!hardware_seqstart(devh)) {
-            config_error("Initial write retry failed, giving up.");
-            goto end;
+        bb_set_retry(handles[i], retry_ms);
+        if (signcount > 1) {
+            logs[i].device = devices[i];
+            logs[i].midline = 0;
+            bb_set_log(handles[i], config_level, sign_log_write, &logs[i]);
+        }
+        if (statepath != NULL) {
+            //each sign has its own idea of what's on it:
+            size_t len = strlen(statepath) + ((signcount > 1) ? strlen(devices[i]) + 1 : 0) + 1;
+            if ((statepaths[i] = malloc(len)) == NULL) {
+                config_error("Memory allocation error!");
+                goto end;
+            }
+            if (signcount > 1) {
+                snprintf(statepaths[i], len, "%s.%s", statepath, devices[i]);
+            } else {
+                snprintf(statepaths[i], len, "%s", statepath);
+            }
+            if (bb_load_state(handles[i], statepaths[i]) < 0) {
+                goto end;
+            }
         }
-        config_log("Reset successful, continuing");
+        results[i] = 0;
     }
 
-    if (do_init) {
-        //this packet allocates sign memory for messages:
-        if ((pktsize = packet_buildmemconf(&packet,startframe)) < 0) {
-            goto end;
+    for (i = 0; do_alert && i < signcount; i++) {
+        results[i] = bb_alert(handles[i], alert_mode, alert_text);
+    }
+    if (set_clock != 0 && signcount == 1) {
+        if (results[0] == 0) {
+            results[0] = bb_set_clock(handles[0], set_clock == 24);
         }
-        if (hardware_sendpkt(devh,packet,pktsize) != pktsize) {
-            goto end;
+    } else if (set_clock != 0) {
+        //all set to the same minute, rather than each waiting for the next:
+        bb_handle* todo[MAX_DEVICES];
+        int todo_results[MAX_DEVICES], todocount = 0;
+        for (i = 0; i < signcount; i++) {
+            if (results[i] == 0) {
+                todo[todocount++] = handles[i];
+            }
+        }
+        bb_set_clock_all(todo, todocount, set_clock == 24, todo_results);
+        for (i = signcount - 1; i >= 0; i--) {
+            if (results[i] == 0) {
+                results[i] = todo_results[--todocount];
+            }
         }
-        free(packet);
-        packet = NULL;
     }
-
-    //now on to the real messages:
-    struct bb_frame* curframe = startframe;
-    while (curframe != NULL) {
-        config_debug("result: data=%s",curframe->data);
-        if (curframe->frame_type == STRING_FRAME_TYPE) {
-            //data will be updated often, store in a STRING file
-            pktsize = packet_buildstring(&packet,curframe->filename,
-                                           curframe->data);
-        } else if (curframe->frame_type == TEXT_FRAME_TYPE) {
-            if (!do_init) {
-                curframe = curframe->next;
-                config_debug(" ^-- SKIPPING: init-only packet");
-                continue;
+    if (mode_specified && signcount == 1) {
+        if (results[0] == 0) {
+            results[0] = bb_run_config(handles[0], configfile, configpath, do_init);
+        }
+    } else if (mode_specified) {
+        //the rest go out together, to whichever signs are still fine:
+        bb_handle* todo[MAX_DEVICES];
+        int todo_results[MAX_DEVICES], todocount = 0;
+        for (i = 0; i < signcount; i++) {
+            if (results[i] == 0) {
+                todo[todocount++] = handles[i];
             }
-            //data wont be updated often, use a TEXT file
-            pktsize = packet_buildtext(&packet,curframe->filename,
-                                         curframe->mode,curframe->mode_special,
-                                         curframe->data);
-        } else {
-            config_error("Internal error: Unknown frame type %d",curframe->frame_type);
-            goto end;
         }
-
-        if (hardware_sendpkt(devh,packet,pktsize) != pktsize) {
-            goto end;
+        if (todocount > 0) {
+            bb_run_config_all(todo, todocount, configfile, configpath, do_init, todo_results);
         }
-        free(packet);
-        packet = NULL;
-
-        curframe = curframe->next;
-    }
-
-    if (do_init) {
-        //set display order for the messages:
-        pktsize = packet_buildrunseq(&packet,startframe);
-        if (hardware_sendpkt(devh,packet,pktsize) != pktsize) {
-            goto end;
+        for (i = signcount - 1; i >= 0; i--) {
+            if (results[i] == 0) {
+                results[i] = todo_results[--todocount];
+            }
         }
-        free(packet);
-        packet = NULL;
     }
-
-    //finish it off with a sequence footer
-    if (!hardware_seqend(devh)) {
-        goto end;
+    for (i = 0; i < signcount; i++) {
+        if (results[i] == 0 && statepaths[i] != NULL) {
+            results[i] = bb_save_state(handles[i], statepaths[i]);
+        }
     }
 
-    error = 0;
  end:
-    hardware_close(devh);
- end_noclose:
-    if (startframe != NULL) {
-        packet_delete(startframe);
-        free(startframe);
+    fclose(configfile);
+    for (i = 0; i < signcount; i++) {
+        if (results[i] == -2 || error == 0) {
+            error = results[i];
+        }
+    }
+    for (i = 0; i < signcount && handles[i] != NULL; i++) {
+        if (error == -2 || (results[i] < 0 && !bb_is_open(handles[i]))) {
+            mini_help(argv[0]);
+            break;
+        }
+    }
+    for (i = 0; i < signcount && handles[i] != NULL; i++) {
+        if (results[i] == 0 && do_timing) {
+            bb_log_stats(handles[i], results[i], BB_STATS_TIMING);
+        }
+        bb_log_stats(handles[i], results[i], stats_format);
+    }
+    for (i = 0; i < signcount; i++) {
+        bb_close(handles[i]);
+        free(statepaths[i]);
     }
     return error;
 }
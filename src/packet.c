@@ -20,6 +20,7 @@
 \************************************************************************/
 
 #include "packet.h"
+#include "config.h"
 
 #include <sys/types.h>
 #include <string.h>
@@ -35,6 +36,11 @@
 static const char filenamepool_firsts[] = {0x20,0x36,0x40,0},
     filenamepool_lasts[] = {0x2f,0x3e,0x54,0};//stop at "T" to enforce max 46 names
 
+static char* packet_alloc(struct arena* arena, size_t pktsize) {
+    char* buf = arena_alloc(arena, PACKET_HEADROOM + pktsize + PACKET_TAILROOM);
+    return (buf == NULL) ? NULL : &buf[PACKET_HEADROOM];
+}
+
 char packet_next_filename(char prev_filename) {
     if (prev_filename <= 0) {
         return filenamepool_firsts[0];
@@ -60,7 +66,22 @@ char packet_next_filename(char prev_filename) {
     return -1;
 }
 
-int packet_buildmemconf(char** outputptr, struct bb_frame* frames) {
+int packet_memsize(struct bb_frame* frame) {
+    if (frame->frame_type == STRING_FRAME_TYPE) {
+        //always alloc full size, even if string is currently empty:
+        return MAX_STRINGFILE_DATA_SIZE;
+    }
+    //alloc only the size of the (static) data itself:
+    int datasize = (frame->data == NULL) ? 0 : strlen(frame->data);
+    if (datasize < (int)MIN_TEXTFILE_DATA_SIZE) {
+        datasize = MIN_TEXTFILE_DATA_SIZE;
+    } else if (datasize > (int)MAX_TEXTFILE_DATA_SIZE) {
+        datasize = MAX_TEXTFILE_DATA_SIZE;
+    }
+    return datasize;
+}
+
+int packet_buildmemconf(struct arena* arena, char** outputptr, struct bb_frame* frames) {
     //MEMCONFIG packet format:
     //0x0 0x0 0x0 0x0 0x0 0x1 Z 0x0 0x0 0x2 E $ filespec [filespec ...] 0x4
     //11-byte filespec for TEXT: filename A L 0xsize(4char) F F 0 0
@@ -78,7 +99,10 @@ int packet_buildmemconf(char** outputptr, struct bb_frame* frames) {
         curframe = curframe->next;
     }
 
-    char* data = (char*) calloc(pktsize,sizeof(char));
+    char* data = packet_alloc(arena, pktsize);
+    if (data == NULL) {
+        return -1;
+    }
 
     size_t offset = 0;
     memcpy(&data[offset], &cmdcode, sizeof(cmdcode));
@@ -90,27 +114,14 @@ int packet_buildmemconf(char** outputptr, struct bb_frame* frames) {
     while (curframe != NULL) {
         char flag;
         char* tail;
-        int datasize;
+        int datasize = packet_memsize(curframe);
         if (curframe->frame_type == TEXT_FRAME_TYPE) {
             flag = txtflag;
             tail = txttail;
-            //alloc only the size of the (static) data itself:
-            if (curframe->data == NULL) {
-                datasize = 0;
-            } else {
-                datasize = strlen(curframe->data);
-            }
-            if (datasize < (int)MIN_TEXTFILE_DATA_SIZE) {
-                datasize = MIN_TEXTFILE_DATA_SIZE;
-            } else if (datasize > (int)MAX_TEXTFILE_DATA_SIZE) {
-                datasize = MAX_TEXTFILE_DATA_SIZE;
-            }
             config_debug("datasize=%d (0x%x) for %s",datasize,datasize,curframe->data);
         } else if (curframe->frame_type == STRING_FRAME_TYPE) {
             flag = stringflag;
             tail = stringtail;
-            //always alloc full size, even if string is currently empty:
-            datasize = MAX_STRINGFILE_DATA_SIZE;
         } else {
             config_error("Internal error: Unknown frame type %d",curframe->frame_type);
             return -1;
@@ -138,7 +149,65 @@ int packet_buildmemconf(char** outputptr, struct bb_frame* frames) {
     return pktsize;
 }
 
-int packet_buildstring(char** outputptr, char filename, char* text) {
+int packet_buildclock(struct arena* arena, char** outputptr, enum clock_packet_t what,
+                      const struct tm* now) {
+    //SPECIAL FUNCTION packet formats for the sign's clock:
+    //0x0 0x0 0x0 0x0 0x0 0x1 Z 0x0 0x0 0x2 E 0x20 HHMM 0x4 (time of day, 24h)
+    //0x0 0x0 0x0 0x0 0x0 0x1 Z 0x0 0x0 0x2 E ; MMDDYY 0x4 (date)
+    //0x0 0x0 0x0 0x0 0x0 0x1 Z 0x0 0x0 0x2 E & day 0x4 (day of week, '1'=sunday)
+    //0x0 0x0 0x0 0x0 0x0 0x1 Z 0x0 0x0 0x2 E ' S|M 0x4 (am/pm or 24h display)
+    const char cmdcode = 'E';
+    //longest is MMDDYY, but with room for three whole ints as far as the
+    //compiler knows (-Wformat-truncation), plus \0 from snprintf:
+    char args[3*11 + 1];
+    char specfuncode;
+    switch (what) {
+    case CLOCK_TIME:
+        specfuncode = 0x20;
+        snprintf(args, sizeof(args), "%02d%02d", now->tm_hour, now->tm_min);
+        break;
+    case CLOCK_DATE:
+        specfuncode = ';';
+        snprintf(args, sizeof(args), "%02d%02d%02d",
+                now->tm_mon + 1, now->tm_mday, now->tm_year % 100);
+        break;
+    case CLOCK_WEEKDAY:
+        specfuncode = '&';
+        snprintf(args, sizeof(args), "%c", '1' + now->tm_wday);
+        break;
+    case CLOCK_FORMAT_12H:
+        specfuncode = 0x27;
+        snprintf(args, sizeof(args), "S");
+        break;
+    case CLOCK_FORMAT_24H:
+        specfuncode = 0x27;
+        snprintf(args, sizeof(args), "M");
+        break;
+    default:
+        config_error("Internal error: Unknown clock packet %d", what);
+        return -1;
+    }
+
+    size_t argslen = strlen(args),
+        pktsize = sizeof(cmdcode) + sizeof(specfuncode) + argslen;
+
+    char* data = packet_alloc(arena, pktsize);
+    if (data == NULL) {
+        return -1;
+    }
+
+    size_t offset = 0;
+    memcpy(&data[offset], &cmdcode, sizeof(cmdcode));
+    offset = sizeof(cmdcode);
+    memcpy(&data[offset], &specfuncode, sizeof(specfuncode));
+    offset += sizeof(specfuncode);
+    memcpy(&data[offset], args, argslen);
+
+    *outputptr = data;
+    return pktsize;
+}
+
+int packet_buildstring(struct arena* arena, char** outputptr, char filename, char* text) {
     //STRING packet format:
     //0x0 0x0 0x0 0x0 0x0 0x1 Z 0x0 0x0 0x2 G filename text 0x4
     char cmdcode = 'G';
@@ -154,7 +223,10 @@ int packet_buildstring(char** outputptr, char filename, char* text) {
 
     size_t pktsize = sizeof(cmdcode) + sizeof(filename) + textlen;
 
-    char* data = (char*) calloc(pktsize,sizeof(char));
+    char* data = packet_alloc(arena, pktsize);
+    if (data == NULL) {
+        return -1;
+    }
 
     size_t offset = 0;
     memcpy(&data[offset], &cmdcode, sizeof(cmdcode));
@@ -170,7 +242,7 @@ int packet_buildstring(char** outputptr, char filename, char* text) {
     return pktsize;//negative return: this is a fragment
 }
 
-int packet_buildtext(char** outputptr, char filename,
+int packet_buildtext(struct arena* arena, char** outputptr, char filename,
                      char mode, char special, char* text) {
     //TEXT packet format:
     //0x0 0x0 0x0 0x0 0x0 0x1 Z 0x0 0x0 0x2 A filename 0x1B 0x30 mode (special) text 0x4
@@ -192,7 +264,10 @@ int packet_buildtext(char** outputptr, char filename,
         pktsize += sizeof(special);
     }
 
-    char* data = (char*) calloc(pktsize,sizeof(char));
+    char* data = packet_alloc(arena, pktsize);
+    if (data == NULL) {
+        return -1;
+    }
 
     size_t offset = 0;
     memcpy(&data[offset], &cmdcode, sizeof(cmdcode));
@@ -219,7 +294,27 @@ int packet_buildtext(char** outputptr, char filename,
     return pktsize;
 }
 
-int packet_buildrunseq(char** outputptr, struct bb_frame* frames) {
+int packet_buildpriority(struct arena* arena, char** outputptr,
+                         char mode, char special, char* text) {
+    if (text == NULL) {
+        //a priority file with no data cancels it:
+        //0x0 0x0 0x0 0x0 0x0 0x1 Z 0x0 0x0 0x2 A 0 0x3 0x4
+        const char cmdcode = 'A', filename = PRIORITY_FILENAME;
+        size_t pktsize = sizeof(cmdcode) + sizeof(filename);
+        char* data = packet_alloc(arena, pktsize);
+        if (data == NULL) {
+            return -1;
+        }
+        data[0] = cmdcode;
+        data[1] = filename;
+        *outputptr = data;
+        return pktsize;
+    }
+    //otherwise it's an ordinary TEXT packet, which the sign shows at once
+    return packet_buildtext(arena, outputptr, PRIORITY_FILENAME, mode, special, text);
+}
+
+int packet_buildrunseq(struct arena* arena, char** outputptr, struct bb_frame* frames) {
     //RUNSEQ packet format:
     //0x0 0x0 0x0 0x0 0x0 0x1 Z 0x0 0x0 0x2 E 0x2e T U filename [filename ...] 0x4
     const char cmdcode = 'E', runseqcode = 0x2E,
@@ -236,7 +331,10 @@ int packet_buildrunseq(char** outputptr, struct bb_frame* frames) {
         curframe = curframe->next;
     }
 
-    char* data = (char*) calloc(pktsize,sizeof(char));
+    char* data = packet_alloc(arena, pktsize);
+    if (data == NULL) {
+        return -1;
+    }
 
     size_t offset = 0;
     memcpy(&data[offset], &cmdcode, sizeof(cmdcode));
@@ -263,13 +361,3 @@ int packet_buildrunseq(char** outputptr, struct bb_frame* frames) {
     *outputptr = data;
     return pktsize;
 }
-
-void packet_delete(struct bb_frame* delme) {
-    if (delme->next != NULL) {
-        packet_delete(delme->next);
-        free(delme->next);
-    }
-    if (delme->data != NULL) {
-        free(delme->data);
-    }
-}
@@ -21,6 +21,11 @@
 
 \************************************************************************/
 
+#include "arena.h"
+
+#include <stdint.h>
+#include <time.h>
+
 #define NO_SPECIAL 0
 
 #define MIN_TEXTFILE_DATA_SIZE 128
@@ -36,17 +41,40 @@ struct bb_frame {
     char filename;
     enum frame_type_t frame_type;
     char* data;
+    uint64_t key;//the config line it came from, see labelmap.h
     struct bb_frame* next;
 };
 
+//Packets are built in the arena with this much room left around them, so that
+//hardware_seq_addpkt() can frame them in place: the sequence header and STX
+//before, the ETX and then the next packet's STX (or the final EOT) after.
+#define PACKET_HEADROOM 10
+#define PACKET_TAILROOM 2
+
 char packet_next_filename(char prev_filename);
+//How much sign memory packet_buildmemconf() allocates for the frame.
+int packet_memsize(struct bb_frame* frame);
+
+//The priority TEXT file, which interrupts the run sequence for as long as it's
+//set. It's outside of the filename pool and isn't in the memory config, so it
+//can be set and cleared without touching any other file.
+#define PRIORITY_FILENAME '0'
+#define PRIORITY_TEXTFILE_DATA_SIZE 125
 
-int packet_buildrunseq(char** outputptr, struct bb_frame* frames);
-int packet_buildtext(char** outputptr, char filename,
+int packet_buildrunseq(struct arena* arena, char** outputptr, struct bb_frame* frames);
+int packet_buildtext(struct arena* arena, char** outputptr, char filename,
                      char mode, char special, char* text);
-int packet_buildstring(char** outputptr, char filename, char* text);
-int packet_buildmemconf(char** outputptr, struct bb_frame* frames);
+int packet_buildstring(struct arena* arena, char** outputptr, char filename, char* text);
+int packet_buildmemconf(struct arena* arena, char** outputptr, struct bb_frame* frames);
+//Sets the priority file to text (at most PRIORITY_TEXTFILE_DATA_SIZE bytes),
+//or clears it if text is NULL.
+int packet_buildpriority(struct arena* arena, char** outputptr,
+                         char mode, char special, char* text);
 
-void packet_delete(struct bb_frame* delme);
+//Sets one part of the sign's clock, which <time>/<date> markup then shows.
+enum clock_packet_t { CLOCK_TIME = 0, CLOCK_DATE, CLOCK_WEEKDAY,
+                      CLOCK_FORMAT_12H, CLOCK_FORMAT_24H };
+int packet_buildclock(struct arena* arena, char** outputptr, enum clock_packet_t what,
+                      const struct tm* now);
 
 #endif
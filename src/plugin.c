@@ -0,0 +1,194 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Content plugins
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "plugin.h"
+#include "bbusb-plugin.h"
+#include "config.h"
+#include "timing.h"
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct plugin {
+    char* spec;
+    char* path;//spec split into the library and its args, which init() may keep
+    void* lib;
+    const struct bbusb_plugin* abi;
+    void* state;
+    pthread_mutex_t lock;//held around every call into the plugin
+
+    char* output;//last good output, malloced
+    long long output_us;//when it was made
+    struct plugin* next;
+};
+
+static struct plugin* plugins_head = NULL;
+static pthread_mutex_t plugins_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void plugin_unload_all(void) {
+    pthread_mutex_lock(&plugins_lock);
+    while (plugins_head != NULL) {
+        struct plugin* plugin = plugins_head;
+        plugins_head = plugin->next;
+        if (plugin->abi->fini != NULL) {
+            plugin->abi->fini(plugin->state);
+        }
+        dlclose(plugin->lib);
+        pthread_mutex_destroy(&plugin->lock);
+        free(plugin->output);
+        free(plugin->path);
+        free(plugin->spec);
+        free(plugin);
+    }
+    pthread_mutex_unlock(&plugins_lock);
+}
+
+static struct plugin* plugin_new(const char* spec, int linenum) {
+    char* path = strdup(spec);
+    if (path == NULL) {
+        config_error("Memory allocation error!");
+        return NULL;
+    }
+    char* args = strchr(path, ' ');
+    if (args != NULL) {
+        *args++ = '\0';
+        while (*args == ' ') {
+            ++args;
+        }
+        if (*args == '\0') {
+            args = NULL;
+        }
+    }
+
+    struct plugin* plugin = NULL;
+    void* lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (lib == NULL) {
+        config_error("Line %d: Unable to load plugin %s: %s", linenum, path, dlerror());
+        goto end;
+    }
+    const struct bbusb_plugin* abi = dlsym(lib, "bbusb_plugin");
+    if (abi == NULL || abi->fill == NULL) {
+        config_error("Line %d: %s isn't a bbusb plugin (no bbusb_plugin symbol).", linenum, path);
+        dlclose(lib);
+        goto end;
+    }
+    if (abi->abi != BBUSB_PLUGIN_ABI) {
+        config_error("Line %d: Plugin %s was built for plugin ABI %d, this bbusb has %d.",
+                linenum, path, abi->abi, BBUSB_PLUGIN_ABI);
+        dlclose(lib);
+        goto end;
+    }
+    void* state = NULL;
+    if (abi->init != NULL && abi->init(args, &state) < 0) {
+        config_error("Line %d: Plugin %s failed to start.", linenum, path);
+        dlclose(lib);
+        goto end;
+    }
+
+    if ((plugin = calloc(1, sizeof(struct plugin))) == NULL ||
+        (plugin->spec = strdup(spec)) == NULL) {
+        config_error("Memory allocation error!");
+        if (abi->fini != NULL) {
+            abi->fini(state);
+        }
+        dlclose(lib);
+        free(plugin);
+        plugin = NULL;
+        goto end;
+    }
+    plugin->path = path;
+    path = NULL;
+    plugin->lib = lib;
+    plugin->abi = abi;
+    plugin->state = state;
+    pthread_mutex_init(&plugin->lock, NULL);
+    config_debug("Loaded plugin %s", plugin->path);
+ end:
+    free(path);
+    return plugin;
+}
+
+struct plugin* plugin_load(const char* spec, int linenum) {
+    pthread_mutex_lock(&plugins_lock);
+    struct plugin* plugin = plugins_head;
+    while (plugin != NULL && strcmp(plugin->spec, spec) != 0) {
+        plugin = plugin->next;
+    }
+    if (plugin == NULL && (plugin = plugin_new(spec, linenum)) != NULL) {
+        if (plugins_head == NULL) {
+            atexit(plugin_unload_all);
+        }
+        plugin->next = plugins_head;
+        plugins_head = plugin;
+    }
+    pthread_mutex_unlock(&plugins_lock);
+    return plugin;
+}
+
+int plugin_run(struct plugin* plugin, char* buf, size_t size, int ttl_secs) {
+    if (size == 0) {
+        return -1;
+    }
+    if (ttl_secs < 0) {
+        ttl_secs = plugin->abi->ttl_secs;
+    }
+    pthread_mutex_lock(&plugin->lock);
+    long long now_us = timing_now_us();
+    int len;
+    if (plugin->output != NULL &&
+        now_us - plugin->output_us < (long long)ttl_secs*1000000) {
+        config_debug("cached: plugin %s", plugin->spec);
+    } else {
+        len = plugin->abi->fill(plugin->state, buf, size);
+        config_debug("plugin %s: %d bytes in %lldus",
+                plugin->spec, len, timing_now_us() - now_us);
+        if (len >= 0) {
+            if ((size_t)len >= size) {
+                len = size - 1;
+            }
+            buf[len] = '\0';
+            char* output = strdup(buf);
+            if (output != NULL) {
+                free(plugin->output);
+                plugin->output = output;
+                plugin->output_us = now_us;
+            }
+            pthread_mutex_unlock(&plugin->lock);
+            return len;
+        }
+        config_error("Plugin %s failed.", plugin->spec);
+        if (plugin->output != NULL) {
+            config_error("Using last good output of plugin %s instead.", plugin->spec);
+        } else {
+            config_error("Leaving output of plugin %s blank instead.", plugin->spec);
+        }
+    }
+    //reuse the last output:
+    buf[0] = '\0';
+    if (plugin->output != NULL) {
+        strncat(buf, plugin->output, size - 1);
+    }
+    len = strlen(buf);
+    pthread_mutex_unlock(&plugin->lock);
+    return len;
+}
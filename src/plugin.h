@@ -0,0 +1,40 @@
+#ifndef __PLUGIN_H__
+#define __PLUGIN_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include <stddef.h>
+
+//Content plugins loaded with dlopen(), see bbusb-plugin.h for their side.
+//Once loaded, a plugin stays loaded until exit, shared by every parse.
+struct plugin;
+
+//Loads the plugin for a config line's "<lib.so> [args]", or finds the one
+//already loaded for the same line. Returns NULL on failure.
+struct plugin* plugin_load(const char* spec, int linenum);
+
+//Writes the plugin's output into buf (\0-terminated), calling the plugin
+//unless its last output is less than ttl_secs old (<0: the plugin's own
+//ttl). If the plugin fails, its last good output is used, or else nothing.
+//Returns the output's length, or <0 if nothing could be written at all.
+int plugin_run(struct plugin* plugin, char* buf, size_t size, int ttl_secs);
+
+#endif
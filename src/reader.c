@@ -0,0 +1,197 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Chunked input reader
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "reader.h"
+#include "config.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define READ_CHUNK 4096
+
+static int reader_grow(struct reader* reader, size_t minfree) {
+    if (reader->buflen - reader->end >= minfree) {
+        return 0;
+    }
+    size_t buflen = (reader->buflen == 0) ? READ_CHUNK*2 : reader->buflen;
+    while (buflen - reader->end < minfree) {
+        buflen *= 2;
+    }
+    char* newbuf = realloc(reader->buf, buflen);
+    if (newbuf == NULL) {
+        config_error("Memory allocation error!");
+        return -1;
+    }
+    reader->buf = newbuf;
+    reader->buflen = buflen;
+    return 0;
+}
+
+void reader_init_file(struct reader* reader, FILE* file) {
+    memset(reader, 0, sizeof(struct reader));
+    reader->file = file;
+    reader->fd = -1;
+
+    //map regular files which haven't been read from yet, no copying needed:
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_size > 0 && ftell(file) == 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+        if (map != MAP_FAILED) {
+            reader->buf = map;
+            reader->buflen = reader->end = st.st_size;
+            reader->eof = 1;
+            reader->mapped = 1;
+        }
+    }
+}
+
+void reader_init_fd(struct reader* reader, int fd, size_t max) {
+    memset(reader, 0, sizeof(struct reader));
+    reader->fd = fd;
+    reader->max = max;
+}
+
+//appends the next chunk of a config file to the buffer
+static int file_fill(struct reader* reader) {
+    if (reader->start > 0) {
+        //make room by dropping what's already been consumed:
+        memmove(reader->buf, &reader->buf[reader->start], reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader_grow(reader, READ_CHUNK) < 0) {
+        return -1;
+    }
+    size_t len = fread(&reader->buf[reader->end], 1, reader->buflen - reader->end, reader->file);
+    if (len == 0) {
+        if (ferror(reader->file)) {
+            config_error("Error reading config: %s", strerror(errno));
+            return -1;
+        }
+        reader->eof = 1;
+    }
+    reader->end += len;
+    return 0;
+}
+
+int reader_line(struct reader* reader, struct arena* arena, char** lineptr) {
+    while (1) {
+        char* start = &reader->buf[reader->start];
+        size_t avail = reader->end - reader->start;
+        char* newline = (avail == 0) ? NULL : memchr(start, '\n', avail);
+        if (newline == NULL && !reader->eof) {
+            if (file_fill(reader) < 0) {
+                return -1;
+            }
+            continue;
+        }
+
+        size_t len = (newline == NULL) ? avail : (size_t)(newline - start);
+        reader->start += (newline == NULL) ? len : len+1;
+
+        size_t i, linelen = 0;
+        for (i = 0; i < len; i++) {
+            if (start[i] != '\r') {
+                ++linelen;
+            }
+        }
+        if (linelen == 0) {
+            if (newline == NULL) {
+                return 0;//end of input
+            }
+            continue;//its an empty line, keep going to next line
+        }
+
+        char* line = arena_alloc(arena, linelen+1);
+        if (line == NULL) {
+            return -1;
+        }
+        if (linelen == len) {
+            memcpy(line, start, len);
+        } else {
+            size_t j = 0;
+            for (i = 0; i < len; i++) {
+                if (start[i] != '\r') {
+                    line[j++] = start[i];
+                }
+            }
+        }
+        line[linelen] = '\0';
+        *lineptr = line;
+        return linelen;
+    }
+}
+
+int reader_fill(struct reader* reader) {
+    char discard[READ_CHUNK];
+    char* dest = discard;
+    size_t destlen = sizeof(discard);
+    if (reader->end < reader->max) {
+        if (reader_grow(reader, READ_CHUNK+1) < 0) {
+            return -1;
+        }
+        dest = &reader->buf[reader->end];
+        destlen = reader->max - reader->end;
+        if (destlen > READ_CHUNK) {
+            destlen = READ_CHUNK;
+        }
+    }
+    ssize_t len = read(reader->fd, dest, destlen);
+    if (len < 0) {
+        return (errno == EINTR || errno == EAGAIN) ? 1 : -1;
+    }
+    if (dest != discard) {
+        reader->end += len;
+    } else if (len > 0) {
+        reader->truncated = 1;
+    }
+    return (len == 0) ? 0 : 1;
+}
+
+char* reader_take(struct reader* reader, size_t* len) {
+    if (reader_grow(reader, 1) < 0) {
+        return NULL;
+    }
+    char* data = reader->buf;
+    data[reader->end] = '\0';
+    *len = reader->end;
+    reader->buf = NULL;
+    reader->buflen = reader->start = reader->end = 0;
+    return data;
+}
+
+void reader_close(struct reader* reader) {
+    if (reader->buf != NULL) {
+        if (reader->mapped) {
+            munmap(reader->buf, reader->buflen);
+        } else {
+            free(reader->buf);
+        }
+        reader->buf = NULL;
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef __READER_H__
+#define __READER_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "arena.h"
+
+#include <stdio.h>
+#include <sys/types.h>
+
+//Chunked input for config files and command output, in place of per-byte fgetc.
+struct reader {
+    FILE* file;//config: read with fread(), or mapped if it's a regular file
+    int fd;//command output: read with read()
+    size_t max;//fd only: further output is read and discarded
+    int truncated;//fd only: set once anything has been discarded
+
+    char* buf;//reused across reads, only grows for lines longer than it
+    size_t buflen, start, end;
+    int eof;
+    int mapped;
+};
+
+void reader_init_file(struct reader* reader, FILE* file);
+void reader_init_fd(struct reader* reader, int fd, size_t max);
+
+//Returns the length of the next non-empty line (without '\r'/'\n'), copied
+//into arena at *lineptr, 0 at end of input, or <0 on error.
+int reader_line(struct reader* reader, struct arena* arena, char** lineptr);
+
+//One read() of command output. Returns 1 if there may be more, 0 at end of
+//output, or <0 on error.
+int reader_fill(struct reader* reader);
+//Hands over everything read so far, \0-terminated. The reader is left empty.
+char* reader_take(struct reader* reader, size_t* len);
+
+void reader_close(struct reader* reader);
+
+#endif
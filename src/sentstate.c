@@ -0,0 +1,156 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Last-sent STRING state
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "sentstate.h"
+#include "config.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <string.h>
+
+#define SENTSTATE_HEADER_V1 "bbusb-sentstate 1"//STRING hashes only
+#define SENTSTATE_HEADER "bbusb-sentstate 2"
+typedef char node_len_check[(SENTSTATE_NODE_LEN == 64) ? 1 : -1];//see "%63s" below
+
+void sentstate_clear(struct sentstate* state) {
+    memset(state, 0, sizeof(struct sentstate));
+}
+
+//v1: "<label> <hash>" lines
+static void load_v1(struct sentstate* state, FILE* file) {
+    unsigned int label;
+    uint64_t hash;
+    while (fscanf(file, "%x %" SCNx64, &label, &hash) == 2) {
+        if (label < SENTSTATE_LABEL_COUNT) {
+            state->hash[label] = hash;
+            state->valid[label] = 1;
+        }
+    }
+}
+
+//v2: "H <label> <hash>", "R <hash>", "L <label> <A|B> <size> <key>" and
+//"N <node>" lines
+static void load_v2(struct sentstate* state, FILE* file) {
+    char line[128];
+    while (fgets(line, sizeof(line), file) != NULL) {
+        unsigned int label, size;
+        uint64_t hash;
+        char type;
+        if (sscanf(line, "H %x %" SCNx64, &label, &hash) == 2 &&
+            label < SENTSTATE_LABEL_COUNT) {
+            state->hash[label] = hash;
+            state->valid[label] = 1;
+        } else if (sscanf(line, "R %" SCNx64, &hash) == 1) {
+            state->runseq_hash = hash;
+            state->runseq_valid = 1;
+        } else if (sscanf(line, "L %x %c %x %" SCNx64, &label, &type, &size, &hash) == 4 &&
+                   label < SENTSTATE_LABEL_COUNT && (type == 'A' || type == 'B')) {
+            state->layout[label].type = type;
+            state->layout[label].size = size;
+            state->layout[label].key = hash;
+            state->has_layout = 1;
+        } else if (line[0] == 'N') {
+            sscanf(line, "N %63s", state->node);
+        }
+    }
+}
+
+int sentstate_load(struct sentstate* state, const char* path) {
+    sentstate_clear(state);
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            return 0;//nothing sent yet
+        }
+        config_error("Unable to open state file %s: %s", path, strerror(errno));
+        return -1;
+    }
+
+    char header[32];
+    if (fgets(header, sizeof(header), file) == NULL) {
+        header[0] = '\0';
+    }
+    if (strncmp(header, SENTSTATE_HEADER, strlen(SENTSTATE_HEADER)) == 0) {
+        load_v2(state, file);
+    } else if (strncmp(header, SENTSTATE_HEADER_V1, strlen(SENTSTATE_HEADER_V1)) == 0) {
+        load_v1(state, file);//no layout: the next init is a full one
+    } else {
+        config_error("Ignoring unrecognized state file %s", path);
+    }
+    fclose(file);
+    return 0;
+}
+
+int sentstate_save(struct sentstate* state, const char* path) {
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        config_error("Unable to write state file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    fprintf(file, SENTSTATE_HEADER "\n");
+    int i;
+    for (i = 0; i < SENTSTATE_LABEL_COUNT; i++) {
+        struct sentstate_file* layout = &state->layout[i];
+        if (state->has_layout && layout->type != 0) {
+            fprintf(file, "L %02x %c %04x %016" PRIx64 "\n",
+                    i, layout->type, layout->size, layout->key);
+        }
+        if (state->valid[i]) {
+            fprintf(file, "H %02x %016" PRIx64 "\n", i, state->hash[i]);
+        }
+    }
+    if (state->runseq_valid) {
+        fprintf(file, "R %016" PRIx64 "\n", state->runseq_hash);
+    }
+    if (state->node[0] != '\0') {
+        fprintf(file, "N %s\n", state->node);
+    }
+    if (fclose(file) != 0) {
+        config_error("Unable to write state file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+uint64_t sentstate_hash(const char* data, unsigned int size) {
+    //64-bit FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    unsigned int i;
+    for (i = 0; i < size; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int sentstate_matches(struct sentstate* state, char filename, uint64_t hash) {
+    unsigned char label = (unsigned char)filename;
+    return (label < SENTSTATE_LABEL_COUNT &&
+            state->valid[label] && state->hash[label] == hash);
+}
+
+void sentstate_set(struct sentstate* state, char filename, uint64_t hash) {
+    unsigned char label = (unsigned char)filename;
+    if (label < SENTSTATE_LABEL_COUNT) {
+        state->hash[label] = hash;
+        state->valid[label] = 1;
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef __SENTSTATE_H__
+#define __SENTSTATE_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include <stdint.h>
+
+//Hashes of the data last written to each file on the sign, by label.
+//Lets an update skip any file whose contents haven't changed.
+#define SENTSTATE_LABEL_COUNT 128
+#define SENTSTATE_NODE_LEN 64
+
+//One file in the sign's memory config, see labelmap.h.
+struct sentstate_file {
+    char type;//'A' TEXT or 'B' STRING as in the memory config, 0 if not allocated
+    unsigned int size;
+    uint64_t key;//the config line it's holding, see bb_frame
+};
+
+struct sentstate {
+    uint64_t hash[SENTSTATE_LABEL_COUNT];
+    char valid[SENTSTATE_LABEL_COUNT];
+
+    //the run sequence last sent:
+    uint64_t runseq_hash;
+    char runseq_valid;
+
+    //the memory config last sent, if known:
+    char has_layout;
+    struct sentstate_file layout[SENTSTATE_LABEL_COUNT];
+
+    //where the sign was last opened, to go straight there next time ("" if unknown)
+    char node[SENTSTATE_NODE_LEN];
+};
+
+void sentstate_clear(struct sentstate* state);
+//A missing file is treated as an empty state.
+int sentstate_load(struct sentstate* state, const char* path);
+int sentstate_save(struct sentstate* state, const char* path);
+
+uint64_t sentstate_hash(const char* data, unsigned int size);
+int sentstate_matches(struct sentstate* state, char filename, uint64_t hash);
+void sentstate_set(struct sentstate* state, char filename, uint64_t hash);
+
+#endif
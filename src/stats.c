@@ -0,0 +1,185 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Update statistics
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "stats.h"
+#include "config.h"
+
+#include <string.h>
+
+static const char* pkt_names[STATS_PKT_TYPES] = {
+    "memconf", "runseq", "text", "string", "other"
+};
+static const char* cmd_status_names[] = { "ok", "failed", "timedout" };
+
+void stats_clear(struct stats* stats) {
+    memset(stats, 0, sizeof(struct stats));
+}
+
+int stats_copy_parse(struct arena* arena, struct stats* stats, const struct stats* parsed) {
+    stats_clear(stats);
+    stats->parse_us = parsed->parse_us;
+    stats->read_us = parsed->read_us;
+    stats->cmds_us = parsed->cmds_us;
+    stats->markup_us = parsed->markup_us;
+    if (parsed->cmdcount == 0) {
+        return 0;
+    }
+    stats->cmds = arena_alloc(arena, parsed->cmdcount * sizeof(struct stats_cmd));
+    if (stats->cmds == NULL) {
+        return -1;
+    }
+    int i;
+    for (i = 0; i < parsed->cmdcount; i++) {
+        size_t len = strlen(parsed->cmds[i].command) + 1;
+        char* command = arena_alloc(arena, len);
+        if (command == NULL) {
+            return -1;
+        }
+        memcpy(command, parsed->cmds[i].command, len);
+        stats->cmds[i] = parsed->cmds[i];
+        stats->cmds[i].command = command;
+    }
+    stats->cmdcount = parsed->cmdcount;
+    return 0;
+}
+
+void stats_packet(struct stats* stats, const char* data, int size) {
+    enum stats_pkt_t type = STATS_PKT_OTHER;
+    if (data[0] == 'A') {
+        type = STATS_PKT_TEXT;
+    } else if (data[0] == 'G') {
+        type = STATS_PKT_STRING;
+    } else if (data[0] == 'E' && size > 1 && data[1] == '$') {
+        type = STATS_PKT_MEMCONF;
+    } else if (data[0] == 'E' && size > 1 && data[1] == '.') {
+        type = STATS_PKT_RUNSEQ;
+    }
+    ++stats->pktcount[type];
+    stats->pktbytes[type] += size;
+}
+
+static int pkt_total(struct stats* stats) {
+    int i, total = 0;
+    for (i = 0; i < STATS_PKT_TYPES; i++) {
+        total += stats->pktcount[i];
+    }
+    return total;
+}
+
+void stats_log_timing(struct stats* stats) {
+    config_log("Timing: parse %lldms, build %lldms, open %lldms (%lldms finding the sign), send %lldms (%d packets in %d transfers, %d skipped, %dms delays), total %lldms",
+            stats->parse_us/1000, stats->build_us/1000,
+            stats->open_us/1000, stats->enum_us/1000, stats->send_us/1000,
+            pkt_total(stats), stats->transfercount, stats->skipped, stats->delay_ms,
+            (stats->parse_us+stats->build_us+stats->open_us+stats->send_us)/1000);
+}
+
+static void json_string(const char* str) {
+    config_lognn("\"");
+    for (; *str != '\0'; str++) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            config_lognn("\\%c", c);
+        } else if (c < 0x20) {
+            config_lognn("\\u%04x", c);
+        } else {
+            config_lognn("%c", c);
+        }
+    }
+    config_lognn("\"");
+}
+
+static void print_json(struct stats* stats, int status) {
+    int i;
+    config_lognn("{\"version\":%d,\"status\":%d", STATS_FORMAT_VERSION, status);
+    config_lognn(",\"parse_us\":%lld,\"read_us\":%lld,\"cmds_us\":%lld,\"markup_us\":%lld",
+            stats->parse_us, stats->read_us, stats->cmds_us, stats->markup_us);
+    config_lognn(",\"build_us\":%lld,\"open_us\":%lld,\"enum_us\":%lld,\"send_us\":%lld,\"sleep_us\":%lld",
+            stats->build_us, stats->open_us, stats->enum_us, stats->send_us, stats->sleep_us);
+    config_lognn(",\"cmds\":[");
+    for (i = 0; i < stats->cmdcount; i++) {
+        struct stats_cmd* cmd = &stats->cmds[i];
+        config_lognn("%s{\"command\":", (i == 0) ? "" : ",");
+        json_string(cmd->command);
+        config_lognn(",\"us\":%lld,\"status\":\"%s\",\"cached\":%s,\"bytes\":%lu}",
+                cmd->us, cmd_status_names[cmd->status],
+                cmd->cached ? "true" : "false", (unsigned long)cmd->bytes);
+    }
+    config_lognn("],\"packets\":{");
+    for (i = 0; i < STATS_PKT_TYPES; i++) {
+        config_lognn("%s\"%s\":{\"count\":%d,\"bytes\":%lu}", (i == 0) ? "" : ",",
+                pkt_names[i], stats->pktcount[i], (unsigned long)stats->pktbytes[i]);
+    }
+    config_lognn("},\"skipped\":%d,\"transfers\":[", stats->skipped);
+    for (i = 0; i < stats->transfercount; i++) {
+        struct hardware_seg* seg = &stats->transfers[i];
+        config_lognn("%s{\"bytes\":%lu,\"us\":%lld,\"delay_ms\":%d}", (i == 0) ? "" : ",",
+                (unsigned long)seg->size, seg->us, seg->delay_ms);
+    }
+    config_log("],\"wire_bytes\":%lu,\"delay_ms\":%d,\"retries\":%d,\"resets\":%d}",
+            (unsigned long)stats->wirebytes, stats->delay_ms,
+            stats->retries, stats->resets);
+}
+
+//one line per value, plus one per cmd and per transfer
+static void print_text(struct stats* stats, int status) {
+    int i;
+    config_log("stats version %d", STATS_FORMAT_VERSION);
+    config_log("stats status %d", status);
+    config_log("stats parse_us %lld", stats->parse_us);
+    config_log("stats read_us %lld", stats->read_us);
+    config_log("stats cmds_us %lld", stats->cmds_us);
+    config_log("stats markup_us %lld", stats->markup_us);
+    config_log("stats build_us %lld", stats->build_us);
+    config_log("stats open_us %lld", stats->open_us);
+    config_log("stats enum_us %lld", stats->enum_us);
+    config_log("stats send_us %lld", stats->send_us);
+    config_log("stats sleep_us %lld", stats->sleep_us);
+    for (i = 0; i < stats->cmdcount; i++) {
+        struct stats_cmd* cmd = &stats->cmds[i];
+        //command goes last, it may contain spaces
+        config_log("stats cmd %d us=%lld status=%s cached=%d bytes=%lu command=%s",
+                i, cmd->us, cmd_status_names[cmd->status], cmd->cached,
+                (unsigned long)cmd->bytes, cmd->command);
+    }
+    for (i = 0; i < STATS_PKT_TYPES; i++) {
+        config_log("stats packets_%s %d", pkt_names[i], stats->pktcount[i]);
+        config_log("stats bytes_%s %lu", pkt_names[i], (unsigned long)stats->pktbytes[i]);
+    }
+    config_log("stats skipped %d", stats->skipped);
+    for (i = 0; i < stats->transfercount; i++) {
+        struct hardware_seg* seg = &stats->transfers[i];
+        config_log("stats transfer %d bytes=%lu us=%lld delay_ms=%d",
+                i, (unsigned long)seg->size, seg->us, seg->delay_ms);
+    }
+    config_log("stats wire_bytes %lu", (unsigned long)stats->wirebytes);
+    config_log("stats delay_ms %d", stats->delay_ms);
+    config_log("stats retries %d", stats->retries);
+    config_log("stats resets %d", stats->resets);
+}
+
+void stats_print(struct stats* stats, int status, enum stats_format_t format) {
+    if (format == STATS_JSON) {
+        print_json(stats, status);
+    } else if (format == STATS_TEXT) {
+        print_text(stats, status);
+    }
+}
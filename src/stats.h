@@ -0,0 +1,78 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "hardware.h"
+
+#include <stddef.h>
+
+//Bumped whenever a field is renamed or removed, adding fields doesn't change it.
+#define STATS_FORMAT_VERSION 1
+
+enum stats_format_t { STATS_NONE = 0, STATS_TEXT, STATS_JSON };
+
+enum stats_pkt_t { STATS_PKT_MEMCONF = 0, STATS_PKT_RUNSEQ, STATS_PKT_TEXT,
+                   STATS_PKT_STRING, STATS_PKT_OTHER, STATS_PKT_TYPES };
+
+struct stats_cmd {
+    const char* command;
+    long long us;
+    int status;//enum cmdrun_status_t
+    int cached;//output came from the ttl cache, the command didn't run
+    size_t bytes;
+};
+
+//Where the time went in one update, for -t and --stats.
+//The cmds and transfers live in the update's arena.
+struct stats {
+    long long parse_us;//everything up to having frames, which includes:
+    long long read_us, cmds_us, markup_us;
+    long long build_us, open_us, send_us, sleep_us;
+    long long enum_us;//part of open_us spent looking through the bus for the sign
+
+    struct stats_cmd* cmds;
+    int cmdcount;
+
+    int pktcount[STATS_PKT_TYPES];
+    size_t pktbytes[STATS_PKT_TYPES];
+    int skipped;
+
+    struct hardware_seg* transfers;
+    int transfercount;
+    size_t wirebytes;
+    int delay_ms;
+
+    int retries, resets;
+};
+
+void stats_clear(struct stats* stats);
+//Sets stats to just the parse phase of parsed, with its cmds copied into arena.
+int stats_copy_parse(struct arena* arena, struct stats* stats, const struct stats* parsed);
+void stats_packet(struct stats* stats, const char* data, int size);
+
+//one line summary for -t
+void stats_log_timing(struct stats* stats);
+//everything, in a stable format which can be parsed by scripts:
+//"stats <key> <value>" lines for STATS_TEXT, a one-line object for STATS_JSON
+void stats_print(struct stats* stats, int status, enum stats_format_t format);
+
+#endif
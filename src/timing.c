@@ -0,0 +1,49 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Clock and delay helpers
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "timing.h"
+
+#include <time.h>
+
+long long timing_now_us(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long long)now.tv_sec*1000000 + now.tv_nsec/1000;
+}
+
+void timing_sleep_ms(int ms) {
+    struct timespec delay;
+    delay.tv_sec = ms / 1000;
+    delay.tv_nsec = (long)(ms % 1000)*1000000;
+    nanosleep(&delay, NULL);
+}
+
+void timing_sleep_until_us(long long when_us) {
+    long long now;
+    while ((now = timing_now_us()) < when_us) {
+        struct timespec delay;
+        delay.tv_sec = (when_us - now) / 1000000;
+        delay.tv_nsec = (long)((when_us - now) % 1000000)*1000;
+        nanosleep(&delay, NULL);
+    }
+}
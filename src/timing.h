@@ -0,0 +1,30 @@
+#ifndef __TIMING_H__
+#define __TIMING_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+//monotonic clock, in microseconds since an arbitrary start point
+long long timing_now_us(void);
+void timing_sleep_ms(int ms);
+//sleeps until timing_now_us() reaches when_us, returning at once if it already has
+void timing_sleep_until_us(long long when_us);
+
+#endif
@@ -0,0 +1,399 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Config-to-sign update cycle
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include "update.h"
+#include "hardware.h"
+#include "infile.h"
+#include "labelmap.h"
+#include "timing.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+//Whether a packet is the same as the one last sent for a label (if state is
+//non-NULL), marking it as sent otherwise.
+static int already_sent(struct sentstate* state, char filename,
+                        const char* packet, int pktsize) {
+    if (state == NULL) {
+        return 0;
+    }
+    uint64_t hash = sentstate_hash(packet, pktsize);
+    if (sentstate_matches(state, filename, hash)) {
+        return 1;
+    }
+    sentstate_set(state, filename, hash);
+    return 0;
+}
+
+static int build_seq(struct arena* arena, struct hardware_seq* seq, struct bb_frame* startframe,
+                     int do_memconf, int do_init, struct sentstate* state, struct stats* stats) {
+    char* packet = NULL;
+    int pktsize;
+
+    if (do_memconf) {
+        //this packet allocates sign memory for messages:
+        if ((pktsize = packet_buildmemconf(arena,&packet,startframe)) < 0 ||
+            hardware_seq_addpkt(seq,packet,pktsize) < 0) {
+            return -1;
+        }
+        stats_packet(stats,packet,pktsize);
+    }
+
+    //now on to the real messages:
+    struct bb_frame* curframe = startframe;
+    while (curframe != NULL) {
+        config_debug("result: data=%s",curframe->data);
+        if (curframe->frame_type == STRING_FRAME_TYPE) {
+            if (state != NULL) {
+                size_t datalen = (curframe->data == NULL) ? 0 : strlen(curframe->data);
+                if (datalen > MAX_STRINGFILE_DATA_SIZE) {
+                    datalen = MAX_STRINGFILE_DATA_SIZE;//see packet_buildstring
+                }
+                uint64_t hash = sentstate_hash(curframe->data, datalen);
+                if (sentstate_matches(state, curframe->filename, hash)) {
+                    curframe = curframe->next;
+                    config_debug(" ^-- SKIPPING: unchanged since last sent");
+                    ++stats->skipped;
+                    continue;
+                }
+                sentstate_set(state, curframe->filename, hash);
+            }
+            //data will be updated often, store in a STRING file
+            pktsize = packet_buildstring(arena,&packet,curframe->filename,
+                                           curframe->data);
+        } else if (curframe->frame_type == TEXT_FRAME_TYPE) {
+            if (!do_init) {
+                curframe = curframe->next;
+                config_debug(" ^-- SKIPPING: init-only packet");
+                continue;
+            }
+            //data wont be updated often, use a TEXT file
+            pktsize = packet_buildtext(arena,&packet,curframe->filename,
+                                         curframe->mode,curframe->mode_special,
+                                         curframe->data);
+            if (pktsize >= 0 && already_sent(state, curframe->filename, packet, pktsize)) {
+                curframe = curframe->next;
+                config_debug(" ^-- SKIPPING: unchanged since last sent");
+                ++stats->skipped;
+                continue;
+            }
+        } else {
+            config_error("Internal error: Unknown frame type %d",curframe->frame_type);
+            return -1;
+        }
+
+        if (pktsize < 0 || hardware_seq_addpkt(seq,packet,pktsize) < 0) {
+            return -1;
+        }
+        stats_packet(stats,packet,pktsize);
+
+        curframe = curframe->next;
+    }
+
+    if (do_init) {
+        //set display order for the messages:
+        if ((pktsize = packet_buildrunseq(arena,&packet,startframe)) < 0) {
+            return -1;
+        }
+        uint64_t hash = sentstate_hash(packet, pktsize);
+        if (state != NULL && state->runseq_valid && state->runseq_hash == hash) {
+            config_debug("Run sequence unchanged since last sent");
+            ++stats->skipped;
+        } else {
+            if (hardware_seq_addpkt(seq,packet,pktsize) < 0) {
+                return -1;
+            }
+            stats_packet(stats,packet,pktsize);
+            if (state != NULL) {
+                state->runseq_hash = hash;
+                state->runseq_valid = 1;
+            }
+        }
+    }
+
+    //finish it off with a sequence footer
+    return hardware_seq_finish(seq);
+}
+
+//Waits before the next attempt at the sign, twice as long as the last time
+//(up to a limit) but no later than giveup_us, and no longer than it takes for
+//the sign to be plugged back in. Returns <0 once it's time to give up instead.
+static int backoff(struct hardware_sign* sign, long long giveup_us, int* backoff_ms) {
+    long long left_ms = (giveup_us - timing_now_us()) / 1000;
+    if (left_ms <= 0) {
+        return -1;
+    }
+    int wait_ms = (*backoff_ms < left_ms) ? *backoff_ms : (int)left_ms;
+    config_log("Retrying in %dms, or once the sign is plugged back in", wait_ms);
+    hardware_wait(sign, -1, wait_ms);
+    *backoff_ms = (*backoff_ms*2 < HARDWARE_BACKOFF_MAX_MS) ? *backoff_ms*2 : HARDWARE_BACKOFF_MAX_MS;
+    return 0;
+}
+
+//hardware_init(), counting the time it spends looking for the sign on the bus
+static int open_sign(struct hardware_sign* sign, struct stats* stats) {
+    int ret = hardware_init(sign);
+    stats->enum_us += sign->enum_us;
+    return ret;
+}
+
+//Opens the sign if need be and sends seq. If that fails, resets the sign and
+//carries on from the packet which didn't get through, then keeps reopening it
+//with backoff() and carrying on for up to sign->retry_ms. If send_at_us isn't
+//0, waits until then to send.
+static int send_seq(struct hardware_sign* sign, struct hardware_seq* seq, struct stats* stats,
+                    long long send_at_us) {
+    int error = -1, backoff_ms = HARDWARE_BACKOFF_MIN_MS;
+    long long time_built = timing_now_us(), waited_us = 0;
+    long long giveup_us = time_built + sign->retry_ms*1000LL;
+    while (sign->devh == NULL && open_sign(sign, stats) < 0) {
+        if (backoff(sign, giveup_us, &backoff_ms) < 0) {
+            config_error("USB init failed. ");
+            goto end;
+        }
+    }
+    long long time_opened = timing_now_us();
+    stats->open_us = time_opened - time_built;
+    if (send_at_us > time_opened) {
+        timing_sleep_until_us(send_at_us);
+        waited_us = timing_now_us() - time_opened;
+        time_opened += waited_us;
+    }
+
+    config_log("Writing to sign");
+
+    int ret = hardware_seq_send(sign->devh,seq);
+    while (ret < 0) {
+        ++stats->resets;
+        if (stats->retries == 0) {
+            //the sign may only need a reset
+            config_error("Initial write failed, attempting reset.");
+            if (hardware_reset(sign) < 0) {
+                config_error("Reset failed.");
+                hardware_close(sign);
+            }
+        } else {
+            hardware_close(sign);
+            if (backoff(sign, giveup_us, &backoff_ms) < 0) {
+                config_error("Write retry failed, giving up.");
+                goto end;
+            }
+        }
+        while (sign->devh == NULL && open_sign(sign, stats) < 0) {
+            if (backoff(sign, giveup_us, &backoff_ms) < 0) {
+                config_error("Unable to reopen the sign, giving up.");
+                goto end;
+            }
+        }
+        ++stats->retries;
+        if (seq->segs_sent > 0) {
+            config_log("Resuming at packet %d of %d", seq->segs_sent, seq->pktcount);
+        }
+        ret = hardware_seq_resume(sign->devh,seq);
+    }
+    if (stats->retries > 0) {
+        config_log("Retry successful, continuing");
+    }
+    stats->send_us = timing_now_us() - time_opened;
+
+    error = 0;
+ end:
+    stats->transfers = seq->segs;
+    stats->transfercount = seq->segs_sent;
+    int i;
+    for (i = 0; i < seq->segs_sent; i++) {
+        stats->wirebytes += seq->segs[i].size;
+    }
+    stats->wirebytes += seq->restart_bytes;
+    stats->sleep_us = seq->sleep_us + waited_us;
+    stats->delay_ms = seq->delay_total_ms;
+    return error;
+}
+
+int update_parse(struct arena* arena, struct bb_frame** frames, FILE* config,
+                 const char* configname, struct stats* stats) {
+    long long time_start = timing_now_us();
+    stats_clear(stats);
+    config_log("Parsing %s",configname);
+
+    //Get and parse bb_frames (both STRINGs and TEXTs) from config:
+    *frames = NULL;
+    if (parsefile(arena,frames,config,stats) < 0) {
+        config_error("Error encountered when parsing config file. ");
+        return -2;
+    }
+    if (*frames == NULL) {
+        config_error("Empty config file, nothing to do. ");
+        return -2;
+    }
+    stats->parse_us = timing_now_us() - time_start;
+    return 0;
+}
+
+int update_run(struct arena* arena, struct hardware_sign* sign, FILE* config, const char* configname,
+               int do_init, struct sentstate* state, struct stats* stats) {
+    struct bb_frame* startframe;
+    int ret = update_parse(arena,&startframe,config,configname,stats);
+    if (ret < 0) {
+        return ret;
+    }
+    return update_send(arena,sign,startframe,do_init,state,stats);
+}
+
+int update_send(struct arena* arena, struct hardware_sign* sign, struct bb_frame* startframe,
+                int do_init, struct sentstate* state, struct stats* stats) {
+    long long time_parsed = timing_now_us();
+    struct hardware_seq seq;
+    hardware_seq_init(&seq,arena);
+
+    //Build the whole sequence before touching the device.
+    //Files are checked against what was last sent, but that state is only
+    //updated once the sign has actually received the new sequence:
+    struct sentstate nextstate;
+    int do_memconf = do_init;
+    if (state != NULL) {
+        nextstate = *state;
+        //frames go wherever their lines already are on the sign, if they fit:
+        int fits = labelmap_plan(startframe,&nextstate);
+        if (do_init && fits) {
+            config_log("Config fits the sign's current memory layout, updating in place");
+            do_memconf = 0;
+        } else if (do_init) {
+            sentstate_clear(&nextstate);//memconf wipes every file
+            labelmap_record(startframe,&nextstate);
+        } else if (!fits && nextstate.has_layout) {
+            config_error("Warning: Config doesn't match the sign's memory layout, it may need an init.");
+        }
+    }
+    if (build_seq(arena,&seq,startframe,do_memconf,do_init,
+                  (state != NULL) ? &nextstate : NULL,stats) < 0) {
+        return -1;
+    }
+    long long time_built = timing_now_us();
+    stats->build_us = time_built - time_parsed;
+    if (stats->skipped > 0) {
+        config_log("Skipping %d unchanged packets", stats->skipped);
+    }
+    if (seq.pktcount == 0) {
+        config_log("Nothing changed, not writing to sign");
+        return 0;
+    }
+
+    int error = send_seq(sign,&seq,stats,0);
+    if (error == 0 && state != NULL) {
+        *state = nextstate;
+    } else if (do_memconf && seq.segs_sent > 0 && state != NULL) {
+        sentstate_clear(state);//the sign's memory was wiped, but with what?
+    }
+    return error;
+}
+
+void update_clock_next(time_t* minute, long long* send_at_us) {
+    //The sign only takes hours and minutes, so give it the coming minute
+    //and send that right as it starts. If this minute only just started (as
+    //when woken up for it), send it now instead:
+    long long now_us = timing_now_us();
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    *minute = now.tv_sec - (now.tv_sec % 60);
+    if (now.tv_sec % 60 != 0) {
+        *minute += 60;
+    }
+    *send_at_us = now_us + (long long)(*minute - now.tv_sec)*1000000 - now.tv_nsec/1000;
+}
+
+int update_clock(struct arena* arena, struct hardware_sign* sign, int use_24h,
+                 time_t minute, long long send_at_us, struct stats* stats) {
+    stats_clear(stats);
+    long long time_start = timing_now_us();
+    struct tm tm;
+    localtime_r(&minute, &tm);
+
+    //time first, as it's the one which goes stale while the rest are sent
+    enum clock_packet_t packets[] = { CLOCK_TIME, CLOCK_DATE, CLOCK_WEEKDAY,
+        (use_24h) ? CLOCK_FORMAT_24H : CLOCK_FORMAT_12H };
+    struct hardware_seq seq;
+    hardware_seq_init(&seq,arena);
+    size_t i;
+    for (i = 0; i < sizeof(packets)/sizeof(packets[0]); i++) {
+        char* packet;
+        int pktsize = packet_buildclock(arena,&packet,packets[i],&tm);
+        if (pktsize < 0 || hardware_seq_addpkt(&seq,packet,pktsize) < 0) {
+            return -1;
+        }
+        stats_packet(stats,packet,pktsize);
+    }
+    if (hardware_seq_finish(&seq) < 0) {
+        return -1;
+    }
+    stats->build_us = timing_now_us() - time_start;
+
+    config_log("Setting sign clock to %04d-%02d-%02d %02d:%02d at the start of the minute",
+            tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min);
+    return send_seq(sign,&seq,stats,send_at_us);
+}
+
+int update_alert(struct arena* arena, struct hardware_sign* sign, const char* mode,
+                 const char* text, struct stats* stats) {
+    stats_clear(stats);
+    long long time_start = timing_now_us();
+    char* data = NULL;
+    char modechar = 0, special = NO_SPECIAL;
+    if (text != NULL) {
+        //same rules as a txt line's mode:
+        size_t modelen = (mode == NULL) ? 0 : strlen(mode);
+        if (modelen < 1 || modelen > 2 || (modelen == 2) != (mode[0] == 'n')) {
+            config_error("Invalid alert mode \"%s\".", (mode == NULL) ? "" : mode);
+            return -2;
+        }
+        modechar = tolower(mode[0]);
+        if (modelen > 1) {
+            special = toupper(mode[1]);
+        }
+        int is_trimmed = 0;
+        if (parse_inline_cmds(arena,&data,&is_trimmed,text,PRIORITY_TEXTFILE_DATA_SIZE) < 0) {
+            return -1;
+        }
+        if (is_trimmed) {
+            config_error("Warning: Alert has been truncated to fit %d available output bytes.",
+                    PRIORITY_TEXTFILE_DATA_SIZE);
+        }
+    }
+    stats->parse_us = timing_now_us() - time_start;
+
+    struct hardware_seq seq;
+    hardware_seq_init(&seq,arena);
+    char* packet;
+    int pktsize = packet_buildpriority(arena,&packet,modechar,special,data);
+    if (pktsize < 0 || hardware_seq_addpkt(&seq,packet,pktsize) < 0 ||
+        hardware_seq_finish(&seq) < 0) {
+        return -1;
+    }
+    stats_packet(stats,packet,pktsize);
+    stats->build_us = timing_now_us() - time_start - stats->parse_us;
+
+    config_log((text != NULL) ? "Showing alert" : "Clearing alert");
+    return send_seq(sign,&seq,stats,0);
+}
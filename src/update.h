@@ -0,0 +1,68 @@
+#ifndef __UPDATE_H__
+#define __UPDATE_H__
+
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "arena.h"
+#include "hardware.h"
+#include "packet.h"
+#include "sentstate.h"
+#include "stats.h"
+
+#include <stdio.h>
+#include <time.h>
+
+//Parses a config and sends its contents to the sign, opening the sign first
+//if it isn't open yet. If state is non-NULL, files which match it are skipped,
+//an init only reallocates the sign's memory if the config doesn't fit in the
+//layout already there (see labelmap.h), and state is updated once the sign
+//has the new data. Everything built along the way is left in arena, for the
+//caller to reset once it's done (stats included).
+//Returns -2 for a bad/empty config, -1 for other failures.
+int update_run(struct arena* arena, struct hardware_sign* sign, FILE* config, const char* configname,
+               int do_init, struct sentstate* state, struct stats* stats);
+
+//The first half of update_run(): parses a config into frames, clearing stats.
+int update_parse(struct arena* arena, struct bb_frame** frames, FILE* config,
+                 const char* configname, struct stats* stats);
+
+//The second half of update_run(), for frames which have already been built.
+//frames may be moved to other labels (see labelmap_plan()). Adds to stats
+//rather than clearing it first.
+int update_send(struct arena* arena, struct hardware_sign* sign, struct bb_frame* frames,
+                int do_init, struct sentstate* state, struct stats* stats);
+
+//The sign's clock has no seconds, so it's set to the start of a minute, right
+//as that minute starts: this finds the coming one, and when (timing_now_us())
+//to send it. Several signs can be set to the same minute with one wait.
+void update_clock_next(time_t* minute, long long* send_at_us);
+
+//Sets the sign's clock to minute (local time), waiting until send_at_us to send
+//it, see update_clock_next(). use_24h picks how it shows <time>.
+int update_clock(struct arena* arena, struct hardware_sign* sign, int use_24h,
+                 time_t minute, long long send_at_us, struct stats* stats);
+
+//Shows text (markup) in the priority file, interrupting the run sequence until
+//it's cleared by a NULL text. mode is as on a txt line, unused when clearing.
+int update_alert(struct arena* arena, struct hardware_sign* sign, const char* mode,
+                 const char* text, struct stats* stats);
+
+#endif
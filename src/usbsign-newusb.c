@@ -20,37 +20,276 @@
 \************************************************************************/
 
 #include "usbsign.h"
+#include "timing.h"
 
-int usbsign_open(int vendorid, int productid,
-                 int interface, usbsign_handle** dev) {
-    int ret = libusb_init(NULL);
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define USB_TIMEOUT_MS 1000
+#define MAX_INFLIGHT 8//transfers allowed on the bus at once before submit() waits
+
+struct usbsign_newusb {
+    //each sign gets its own context, so that when several are sent to at once
+    //(from different threads), each thread only ever handles its own events:
+    libusb_context* ctx;
+    libusb_device_handle* dev;
+    int nodefd;//opened by usbsign_open_node(), -1 otherwise
+
+    //ring of reusable transfers, oldest in-flight first:
+    struct libusb_transfer* transfers[MAX_INFLIGHT];
+    //per-transfer buffers for gathering multi-piece submits, kept for reuse:
+    char* gather[MAX_INFLIGHT];
+    size_t gatherlen[MAX_INFLIGHT];
+    int next, inflight;
+    int error;//first failure reported by a completion since the last flush
+};
+
+static void transfer_done(struct libusb_transfer* transfer) {
+    usbsign_handle* dev = (usbsign_handle*)transfer->user_data;
+    --dev->inflight;
+    if (dev->error != 0) {
+        return;//keep the first error
+    }
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+        config_error("USB transfer of %d bytes failed with status %d",
+                transfer->length, transfer->status);
+        dev->error = -1;
+    } else if (transfer->actual_length != transfer->length) {
+        config_error("USB transfer sent %d of %d bytes",
+                transfer->actual_length, transfer->length);
+        dev->error = -1;
+    }
+}
+
+//run the event loop until at most 'max_inflight' transfers are outstanding
+static int wait_inflight(usbsign_handle* dev, int max_inflight) {
+    while (dev->inflight > max_inflight) {
+        int ret = libusb_handle_events(dev->ctx);
+        if (ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+            config_error("Got error %d when waiting for usb transfers", ret);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+//"bus-port.port...", as in /sys/bus/usb/devices
+static void device_path(libusb_device* usbdev, char* path, size_t size) {
+    uint8_t ports[8];
+    int count = libusb_get_port_numbers(usbdev, ports, sizeof(ports));
+    int len = snprintf(path, size, "%d", libusb_get_bus_number(usbdev));
+    int i;
+    for (i = 0; i < count && len < (int)size; i++) {
+        len += snprintf(&path[len], size - len, "%c%d", (i == 0) ? '-' : '.', ports[i]);
+    }
+}
+
+//Opens the matching sign picked by device, see usbsign.h
+static libusb_device_handle* open_device(libusb_context* ctx, int vendorid, int productid,
+                                         const char* device) {
+    if (device == NULL) {
+        return libusb_open_device_with_vid_pid(ctx, vendorid, productid);
+    }
+    libusb_device** list;
+    ssize_t count = libusb_get_device_list(ctx, &list);
+    if (count < 0) {
+        config_error("Got error %d when listing usb devices", (int)count);
+        return NULL;
+    }
+    size_t prefixlen = strlen(USBSIGN_SERIAL_PREFIX);
+    int by_serial = strncmp(device, USBSIGN_SERIAL_PREFIX, prefixlen) == 0;
+    libusb_device_handle* found = NULL;
+    ssize_t i;
+    for (i = 0; i < count && found == NULL; i++) {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) < 0 ||
+            desc.idVendor != vendorid || desc.idProduct != productid) {
+            continue;
+        }
+        if (by_serial) {
+            //only readable once it's open:
+            libusb_device_handle* handle;
+            unsigned char serial[128];
+            if (desc.iSerialNumber == 0 || libusb_open(list[i], &handle) < 0) {
+                continue;
+            }
+            if (libusb_get_string_descriptor_ascii(handle, desc.iSerialNumber,
+                                                   serial, sizeof(serial)) >= 0 &&
+                strcmp((char*)serial, &device[prefixlen]) == 0) {
+                found = handle;
+            } else {
+                libusb_close(handle);
+            }
+        } else {
+            char path[64];
+            device_path(list[i], path, sizeof(path));
+            if (strcmp(path, device) == 0 && libusb_open(list[i], &found) < 0) {
+                found = NULL;
+            }
+        }
+    }
+    libusb_free_device_list(list, 1);
+    return found;
+}
+
+//A handle with its own context and transfers, but no device yet. A context
+//with scan=0 is only handed fds, so it skips looking through the bus (which
+//needs libusb 1.0.27, older versions always do).
+static usbsign_handle* handle_new(int scan) {
+    usbsign_handle* dev = calloc(1, sizeof(usbsign_handle));
+    if (dev == NULL) {
+        config_error("Memory allocation error!");
+        return NULL;
+    }
+    dev->nodefd = -1;
+#if LIBUSB_API_VERSION >= 0x0100010A
+    struct libusb_init_option noscan = { LIBUSB_OPTION_NO_DEVICE_DISCOVERY, { 0 } };
+    int ret = libusb_init_context(&dev->ctx, &noscan, (scan) ? 0 : 1);
+#else
+    (void)scan;
+    int ret = libusb_init(&dev->ctx);
+#endif
     if (ret < 0) {
         config_error("Got error %d when initializing usb stack", ret);
-        return ret;
+        free(dev);
+        return NULL;
     }
-
-    *dev = libusb_open_device_with_vid_pid(NULL, vendorid, productid);
-    if (*dev == NULL) {
-        config_error("Could not find/open USB device with vid=0x%X pid=0x%X. Is the sign plugged in?",
-                vendorid, productid);
-        return -1;
+    int i;
+    for (i = 0; i < MAX_INFLIGHT; i++) {
+        dev->transfers[i] = libusb_alloc_transfer(0);
+        if (dev->transfers[i] == NULL) {
+            config_error("Memory allocation error!");
+            usbsign_close(dev, -1);
+            return NULL;
+        }
     }
+    return dev;
+}
 
-    ret = libusb_claim_interface(*dev, interface);
+static int handle_claim(usbsign_handle* dev, int interface, usbsign_handle** devp) {
+    int ret = libusb_claim_interface(dev->dev, interface);
     if (ret < 0) {
         config_error("Could not claim device (%d)", ret);
+        usbsign_close(dev, -1);
         return ret;
     }
+    *devp = dev;
     return 0;
 }
 
-int usbsign_reset(int vendorid, int productid,
-                  int interface, usbsign_handle** dev) {
-    int ret = libusb_reset_device(*dev);
+//Opens the sign on an fd for its usbfs node, checking that it's the one picked
+//by device. Quietly fails if not, it's up to the caller to look elsewhere.
+static int open_fd(usbsign_handle* dev, int vendorid, int productid,
+                   const char* device, int fd) {
+#if LIBUSB_API_VERSION >= 0x01000107
+    if (libusb_wrap_sys_device(dev->ctx, (intptr_t)fd, &dev->dev) < 0) {
+        dev->dev = NULL;
+        return -1;
+    }
+    struct libusb_device_descriptor desc;
+    libusb_device* usbdev = libusb_get_device(dev->dev);
+    int matches = libusb_get_device_descriptor(usbdev, &desc) == 0 &&
+        desc.idVendor == vendorid && desc.idProduct == productid;
+    if (matches && device != NULL &&
+        strncmp(device, USBSIGN_FD_PREFIX, strlen(USBSIGN_FD_PREFIX)) != 0) {
+        if (strncmp(device, USBSIGN_SERIAL_PREFIX, strlen(USBSIGN_SERIAL_PREFIX)) == 0) {
+            unsigned char serial[128];
+            matches = desc.iSerialNumber != 0 &&
+                libusb_get_string_descriptor_ascii(dev->dev, desc.iSerialNumber,
+                                                   serial, sizeof(serial)) >= 0 &&
+                strcmp((char*)serial, &device[strlen(USBSIGN_SERIAL_PREFIX)]) == 0;
+        } else {
+            char path[64];
+            device_path(usbdev, path, sizeof(path));
+            matches = strcmp(path, device) == 0;
+        }
+    }
+    if (!matches) {
+        libusb_close(dev->dev);
+        dev->dev = NULL;
+        return -1;
+    }
+    return 0;
+#else
+    (void)dev; (void)vendorid; (void)productid; (void)device; (void)fd;
+    return -1;//needs libusb 1.0.23
+#endif
+}
+
+int usbsign_open(int vendorid, int productid, int interface,
+                 const char* device, usbsign_handle** devp) {
+    size_t fdprefixlen = strlen(USBSIGN_FD_PREFIX);
+    if (device != NULL && strncmp(device, USBSIGN_FD_PREFIX, fdprefixlen) == 0) {
+        //handed to us already open: no looking for it
+        usbsign_handle* dev = handle_new(0);
+        if (dev == NULL) {
+            return -1;
+        }
+        if (open_fd(dev, vendorid, productid, device, atoi(&device[fdprefixlen])) < 0) {
+            config_error("No USB device with vid=0x%X pid=0x%X on %s (needs libusb 1.0.23 or newer)",
+                    vendorid, productid, device);
+            usbsign_close(dev, -1);
+            return -1;
+        }
+        return handle_claim(dev, interface, devp);
+    }
+
+    usbsign_handle* dev = handle_new(1);
+    if (dev == NULL) {
+        return -1;
+    }
+    dev->dev = open_device(dev->ctx, vendorid, productid, device);
+    if (dev->dev == NULL) {
+        config_error("Could not find/open USB device with vid=0x%X pid=0x%X%s%s. Is the sign plugged in?",
+                vendorid, productid, (device != NULL) ? " at " : "",
+                (device != NULL) ? device : "");
+        usbsign_close(dev, -1);
+        return -1;
+    }
+    return handle_claim(dev, interface, devp);
+}
+
+int usbsign_open_node(int vendorid, int productid, int interface,
+                      const char* device, const char* node, usbsign_handle** devp) {
+    int fd = open(node, O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        config_debug("Unable to open %s: %s", node, strerror(errno));
+        return -1;
+    }
+    usbsign_handle* dev = handle_new(0);
+    if (dev == NULL) {
+        close(fd);
+        return -1;
+    }
+    dev->nodefd = fd;
+    if (open_fd(dev, vendorid, productid, device, fd) < 0) {
+        config_debug("No matching sign at %s anymore", node);
+        usbsign_close(dev, -1);
+        return -1;
+    }
+    return handle_claim(dev, interface, devp);
+}
+
+int usbsign_node(usbsign_handle* dev, char* node, size_t size) {
+    libusb_device* usbdev = libusb_get_device(dev->dev);
+    int len = snprintf(node, size, "/dev/bus/usb/%03d/%03d",
+                       libusb_get_bus_number(usbdev), libusb_get_device_address(usbdev));
+    return (len > 0 && (size_t)len < size) ? 0 : -1;
+}
+
+int usbsign_reset(int vendorid, int productid, int interface,
+                  const char* device, usbsign_handle** devp) {
+    usbsign_handle* dev = *devp;
+    int ret = libusb_reset_device(dev->dev);
     if (ret == LIBUSB_ERROR_NOT_FOUND) {
         //need to close/reopen the device
-        usbsign_close(*dev, interface);
-        return usbsign_open(vendorid, productid, interface, dev);
+        usbsign_close(dev, interface);
+        *devp = NULL;
+        return usbsign_open(vendorid, productid, interface, device, devp);
     } else if (ret < 0) {
         config_error("Got error %d when resetting usb device", ret);
     }
@@ -58,20 +297,213 @@ int usbsign_reset(int vendorid, int productid,
 }
 
 void usbsign_close(usbsign_handle* dev, int interface) {
-    libusb_release_interface(dev, interface);
-    libusb_close(dev);
-    dev = NULL;
-    libusb_exit(NULL);
+    if (dev->dev != NULL) {
+        //don't free transfers which are still pointing at the device:
+        if (dev->inflight > 0) {
+            int i;
+            for (i = 0; i < MAX_INFLIGHT; i++) {
+                libusb_cancel_transfer(dev->transfers[i]);
+            }
+            wait_inflight(dev, 0);
+        }
+        if (interface >= 0) {
+            libusb_release_interface(dev->dev, interface);
+        }
+        libusb_close(dev->dev);
+    }
+    int i;
+    for (i = 0; i < MAX_INFLIGHT; i++) {
+        if (dev->transfers[i] != NULL) {
+            libusb_free_transfer(dev->transfers[i]);
+        }
+        free(dev->gather[i]);
+    }
+    libusb_exit(dev->ctx);
+    if (dev->nodefd >= 0) {
+        close(dev->nodefd);//libusb leaves wrapped fds open
+    }
+    free(dev);
 }
 
-int usbsign_send(usbsign_handle* dev, int endpoint,
-                 char* data, unsigned int size, int* sentcount) {
-    if (dev == NULL) {
+//a sign arriving, for usbsign_wait()
+struct hotplug_wait {
+    const char* device;
+    int arrived;
+};
+
+static int LIBUSB_CALL hotplug_arrived(libusb_context* ctx, libusb_device* usbdev,
+                                       libusb_hotplug_event event, void* arg) {
+    struct hotplug_wait* wait = arg;
+    (void)ctx;
+    (void)event;
+    //a serial number can't be read from in here: any sign may be the one
+    char path[64];
+    device_path(usbdev, path, sizeof(path));
+    if (wait->device == NULL ||
+        strncmp(wait->device, USBSIGN_SERIAL_PREFIX, strlen(USBSIGN_SERIAL_PREFIX)) == 0 ||
+        strcmp(path, wait->device) == 0) {
+        wait->arrived = 1;
+    }
+    return 0;//stay registered
+}
+
+int usbsign_wait(int vendorid, int productid, const char* device,
+                 int wakefd, int timeout_ms) {
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        return -1;
+    }
+    libusb_context* ctx;
+    int ret = libusb_init(&ctx);
+    if (ret < 0) {
+        config_error("Got error %d when initializing usb stack", ret);
+        return ret;
+    }
+    //only new arrivals: whatever is plugged in now has just failed to open
+    struct hotplug_wait wait = { device, 0 };
+    libusb_hotplug_callback_handle callback;
+    ret = libusb_hotplug_register_callback(ctx, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+            LIBUSB_HOTPLUG_NO_FLAGS, vendorid, productid, LIBUSB_HOTPLUG_MATCH_ANY,
+            hotplug_arrived, &wait, &callback);
+    if (ret < 0) {
+        config_error("Got error %d when waiting for usb devices", ret);
+        libusb_exit(ctx);
+        return ret;
+    }
+
+    //poll libusb's fds alongside wakefd, which goes first:
+    const struct libusb_pollfd** usbfds = libusb_get_pollfds(ctx);
+    int count = 1;
+    while (usbfds != NULL && usbfds[count-1] != NULL) {
+        ++count;
+    }
+    struct pollfd* fds = calloc(count, sizeof(struct pollfd));
+    if (usbfds == NULL || fds == NULL) {
+        config_error("Memory allocation error!");
+        ret = -1;
+        goto end;
+    }
+    fds[0].fd = wakefd;//ignored by poll() if < 0
+    fds[0].events = POLLIN;
+    int i;
+    for (i = 1; i < count; i++) {
+        fds[i].fd = usbfds[i-1]->fd;
+        fds[i].events = usbfds[i-1]->events;
+    }
+
+    long long deadline = timing_now_us() + timeout_ms*1000LL;
+    ret = 0;
+    while (!wait.arrived) {
+        long long left_ms = (deadline - timing_now_us()) / 1000;
+        if (left_ms <= 0) {
+            break;
+        }
+        int ready = poll(fds, count, (int)left_ms);
+        if (ready < 0) {
+            if (errno != EINTR) {
+                config_error("Got error %d when waiting for usb devices", errno);
+            }
+            break;//a signal: let the caller see to it
+        } else if (fds[0].revents != 0) {
+            ret = 1;
+            break;
+        } else if (ready > 0) {
+            struct timeval now = { 0, 0 };
+            libusb_handle_events_timeout_completed(ctx, &now, &wait.arrived);
+        }
+    }
+ end:
+    free(fds);
+    libusb_free_pollfds(usbfds);
+    libusb_hotplug_deregister_callback(ctx, callback);
+    libusb_exit(ctx);
+    return ret;
+}
+
+int usbsign_submitv(usbsign_handle* dev, int endpoint,
+                    const struct iovec* iov, int iovcnt) {
+    if (dev == NULL || dev->dev == NULL) {
         config_error("Unable to send: Device handle is null");
         return -1;
     }
 
-    return libusb_bulk_transfer(dev, (endpoint | LIBUSB_ENDPOINT_OUT),
-                                (unsigned char*)data, size,
-                                sentcount, 1000);
+    //bounded queue: wait for the oldest transfer to free up its slot
+    int ret = wait_inflight(dev, MAX_INFLIGHT-1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    //a single piece goes out in place, several are gathered into the slot's buffer:
+    char* data = iov[0].iov_base;
+    unsigned int size = iov[0].iov_len;
+    if (iovcnt > 1) {
+        int i;
+        for (i = 1; i < iovcnt; i++) {
+            size += iov[i].iov_len;
+        }
+        if (dev->gatherlen[dev->next] < size) {
+            char* newbuf = realloc(dev->gather[dev->next], size);
+            if (newbuf == NULL) {
+                config_error("Memory allocation error!");
+                return -1;
+            }
+            dev->gather[dev->next] = newbuf;
+            dev->gatherlen[dev->next] = size;
+        }
+        data = dev->gather[dev->next];
+        size_t offset = 0;
+        for (i = 0; i < iovcnt; i++) {
+            memcpy(&data[offset], iov[i].iov_base, iov[i].iov_len);
+            offset += iov[i].iov_len;
+        }
+    }
+
+    struct libusb_transfer* transfer = dev->transfers[dev->next];
+    libusb_fill_bulk_transfer(transfer, dev->dev,
+                              (endpoint | LIBUSB_ENDPOINT_OUT),
+                              (unsigned char*)data, size,
+                              transfer_done, dev, USB_TIMEOUT_MS);
+    ret = libusb_submit_transfer(transfer);
+    if (ret < 0) {
+        config_error("Got error %d when submitting %d bytes", ret, size);
+        return ret;
+    }
+    dev->next = (dev->next + 1) % MAX_INFLIGHT;
+    ++dev->inflight;
+    return 0;
+}
+
+int usbsign_flush(usbsign_handle* dev) {
+    if (dev == NULL) {
+        return -1;
+    }
+    int ret = wait_inflight(dev, 0);
+    if (ret == 0) {
+        ret = dev->error;
+    }
+    dev->error = 0;
+    return ret;
+}
+
+int usbsign_sendv(usbsign_handle* dev, int endpoint,
+                  const struct iovec* iov, int iovcnt, int* sentcount) {
+    //blocking facade over the transfer queue:
+    int ret = usbsign_submitv(dev, endpoint, iov, iovcnt);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = usbsign_flush(dev);
+    *sentcount = 0;
+    if (ret == 0) {
+        int i;
+        for (i = 0; i < iovcnt; i++) {
+            *sentcount += iov[i].iov_len;
+        }
+    }
+    return ret;
+}
+
+int usbsign_send(usbsign_handle* dev, int endpoint,
+                 char* data, unsigned int size, int* sentcount) {
+    struct iovec iov = {data, size};
+    return usbsign_sendv(dev, endpoint, &iov, 1, sentcount);
 }
@@ -21,15 +21,30 @@
 
 #include "usbsign.h"
 
-int usbsign_open(int vendorid, int productid,
-                 int interface, usbsign_handle** dev) {
-    config_log("USB Open %X:%X %p:%d",vendorid,productid,(void*)dev,interface);
+int usbsign_open(int vendorid, int productid, int interface,
+                 const char* device, usbsign_handle** dev) {
+    config_log("USB Open %X:%X %p:%d %s",vendorid,productid,(void*)dev,interface,
+               (device != NULL) ? device : "(first found)");
     return 0;
 }
 
-int usbsign_reset(int vendorid, int productid,
-                  int interface, usbsign_handle** dev) {
-    config_log("USB Reset %X:%X %p:%d",vendorid,productid,(void*)dev,interface);
+int usbsign_open_node(int vendorid, int productid, int interface,
+                      const char* device, const char* node, usbsign_handle** dev) {
+    config_log("USB Open %X:%X %p:%d %s at %s",vendorid,productid,(void*)dev,interface,
+               (device != NULL) ? device : "(first found)",node);
+    return 0;
+}
+
+int usbsign_node(usbsign_handle* dev, char* node, size_t size) {
+    (void)dev;
+    snprintf(node, size, "/dev/null");
+    return 0;
+}
+
+int usbsign_reset(int vendorid, int productid, int interface,
+                  const char* device, usbsign_handle** dev) {
+    config_log("USB Reset %X:%X %p:%d %s",vendorid,productid,(void*)dev,interface,
+               (device != NULL) ? device : "(first found)");
     return 0;
 }
 
@@ -37,6 +52,14 @@ void usbsign_close(usbsign_handle* dev, int interface) {
     config_log("USB Close %p:%d",dev, interface);
 }
 
+int usbsign_wait(int vendorid, int productid, const char* device,
+                 int wakefd, int timeout_ms) {
+    config_log("USB Wait %X:%X %s: %dms",vendorid,productid,
+               (device != NULL) ? device : "(first found)",timeout_ms);
+    (void)wakefd;
+    return -1;
+}
+
 int usbsign_send(usbsign_handle* dev, int endpoint,
                  char* data, unsigned int size, int* sentcount) {
     *sentcount = size;
@@ -44,3 +67,27 @@ int usbsign_send(usbsign_handle* dev, int endpoint,
            size,data,dev,endpoint);
     return 0;
 }
+
+int usbsign_sendv(usbsign_handle* dev, int endpoint,
+                  const struct iovec* iov, int iovcnt, int* sentcount) {
+    unsigned int size = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    *sentcount = size;
+    config_log("USB Send %d bytes of data in %d pieces *%p to device *%p:%d",
+           size,iovcnt,iov[0].iov_base,dev,endpoint);
+    return 0;
+}
+
+int usbsign_submitv(usbsign_handle* dev, int endpoint,
+                    const struct iovec* iov, int iovcnt) {
+    int sent;
+    return usbsign_sendv(dev, endpoint, iov, iovcnt, &sent);
+}
+
+int usbsign_flush(usbsign_handle* dev) {
+    config_debug("USB Flush %p",dev);
+    return 0;
+}
@@ -21,41 +21,63 @@
 
 #include "usbsign.h"
 
-int usbsign_open(int vendorid, int productid,
-                 int interface, usbsign_handle** dev) {
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+//libusb-0.1 keeps its bus list in globals, so only one sign is opened at a time
+static pthread_mutex_t open_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//Whether an (open) sign has the serial number in device, see usbsign.h
+static int serial_matches(usb_dev_handle* handle, struct usb_device* usbdev,
+                          const char* device) {
+    char serial[128];
+    return usbdev->descriptor.iSerialNumber != 0 &&
+        usb_get_string_simple(handle, usbdev->descriptor.iSerialNumber,
+                              serial, sizeof(serial)) >= 0 &&
+        strcmp(serial, &device[strlen(USBSIGN_SERIAL_PREFIX)]) == 0;
+}
+
+int usbsign_open(int vendorid, int productid, int interface,
+                 const char* device, usbsign_handle** dev) {
+    if (device != NULL &&
+        strncmp(device, USBSIGN_SERIAL_PREFIX, strlen(USBSIGN_SERIAL_PREFIX)) != 0) {
+        config_error("Picking a sign by USB port path or fd needs libusb-1.0, use %s<serial> instead.",
+                USBSIGN_SERIAL_PREFIX);
+        return -1;
+    }
+    pthread_mutex_lock(&open_lock);
     usb_init();
     usb_find_busses();
     usb_find_devices();
 
     struct usb_bus* bus;
     struct usb_device* usbdev;
-    int found = 0;
+    *dev = NULL;
 
-    for (bus = usb_get_busses(); bus; bus = bus->next) {
+    for (bus = usb_get_busses(); bus && *dev == NULL; bus = bus->next) {
         config_debug("BUS: %s",bus->dirname);
         for (usbdev = bus->devices; usbdev; usbdev = usbdev->next) {
             struct usb_device_descriptor *desc = &(usbdev->descriptor);
             config_debug("    Device: %s", usbdev->filename);
             config_debug("        %x:%x",desc->idVendor,desc->idProduct);
             if (usbdev->descriptor.idVendor == vendorid &&
-                usbdev->descriptor.idProduct == productid) {
-                found = 1;
-                break;
+                usbdev->descriptor.idProduct == productid &&
+                (*dev = usb_open(usbdev)) != NULL) {
+                if (device == NULL || serial_matches(*dev, usbdev, device)) {
+                    break;
+                }
+                usb_close(*dev);
+                *dev = NULL;
             }
         }
-        if (found > 0) {
-            break;
-        }
-    }
-    if (found > 0) {
-        *dev = usb_open(usbdev);
-    } else {
-        *dev = NULL;
     }
+    pthread_mutex_unlock(&open_lock);
 
     if (*dev == NULL) {
-        config_error("Could not find/open USB device with vid=0x%X pid=0x%X. Is the sign plugged in?",
-                vendorid, productid);
+        config_error("Could not find/open USB device with vid=0x%X pid=0x%X%s%s. Is the sign plugged in?",
+                vendorid, productid, (device != NULL) ? " with " : "",
+                (device != NULL) ? device : "");
         return -1;
     }
 
@@ -67,14 +89,26 @@ int usbsign_open(int vendorid, int productid,
     return 0;
 }
 
-int usbsign_reset(int vendorid, int productid,
-                  int interface, usbsign_handle** dev) {
+int usbsign_open_node(int vendorid, int productid, int interface,
+                      const char* device, const char* node, usbsign_handle** dev) {
+    //libusb-0.1 can only find a sign by looking through the bus
+    (void)vendorid; (void)productid; (void)interface; (void)device; (void)node; (void)dev;
+    return -1;
+}
+
+int usbsign_node(usbsign_handle* dev, char* node, size_t size) {
+    (void)dev; (void)node; (void)size;
+    return -1;
+}
+
+int usbsign_reset(int vendorid, int productid, int interface,
+                  const char* device, usbsign_handle** dev) {
     int ret = usb_reset(*dev);
     if (ret < 0) {
         config_error("Got error %d when resetting usb device", ret);
         return ret;
     }
-    return usbsign_open(vendorid, productid, interface, dev);
+    return usbsign_open(vendorid, productid, interface, device, dev);
 }
 
 void usbsign_close(usbsign_handle* dev, int interface) {
@@ -83,6 +117,13 @@ void usbsign_close(usbsign_handle* dev, int interface) {
     dev = NULL;
 }
 
+int usbsign_wait(int vendorid, int productid, const char* device,
+                 int wakefd, int timeout_ms) {
+    //no hotplug in libusb-0.1: callers poll by reopening
+    (void)vendorid; (void)productid; (void)device; (void)wakefd; (void)timeout_ms;
+    return -1;
+}
+
 int usbsign_send(usbsign_handle* dev, int endpoint,
                  char* data, unsigned int size, int* sentcount) {
     if (dev == NULL) {
@@ -98,3 +139,48 @@ int usbsign_send(usbsign_handle* dev, int endpoint,
         return ret;
     }
 }
+
+int usbsign_sendv(usbsign_handle* dev, int endpoint,
+                  const struct iovec* iov, int iovcnt, int* sentcount) {
+    if (iovcnt == 1) {
+        return usbsign_send(dev, endpoint, iov[0].iov_base, iov[0].iov_len, sentcount);
+    }
+    //no scatter-gather in libusb-0.1: gather the pieces into one buffer
+    unsigned int size = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    char* data = malloc(size);
+    if (data == NULL) {
+        config_error("Memory allocation error!");
+        return -1;
+    }
+    size_t offset = 0;
+    for (i = 0; i < iovcnt; i++) {
+        memcpy(&data[offset], iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    int ret = usbsign_send(dev, endpoint, data, size, sentcount);
+    free(data);
+    return ret;
+}
+
+int usbsign_submitv(usbsign_handle* dev, int endpoint,
+                    const struct iovec* iov, int iovcnt) {
+    //no async API in libusb-0.1: just send it now
+    unsigned int size = 0;
+    int i, sent;
+    for (i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    int ret = usbsign_sendv(dev, endpoint, iov, iovcnt, &sent);
+    if (ret < 0) {
+        return ret;
+    }
+    return (sent == (int)size) ? 0 : -1;
+}
+
+int usbsign_flush(usbsign_handle* dev) {
+    return (dev == NULL) ? -1 : 0;
+}
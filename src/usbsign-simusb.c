@@ -0,0 +1,471 @@
+/************************************************************************\
+
+  bbusb - BetaBrite Prism LED Sign Communicator
+  Simulated sign backend
+  Copyright (C) 2009-2011  Nicholas Parker <nickbp@gmail.com>
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+\************************************************************************/
+
+#include "usbsign.h"
+#include "packet.h"
+#include "timing.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+//A stand-in for the sign, for measuring updates without one plugged in.
+//It parses what would have gone over the wire, and blocks each transfer for
+//as long as the sign would take to receive and process it:
+// - bytes cross a serial link at BBUSB_SIM_BAUD (8N1)
+// - each packet keeps the sign busy after its ETX, per command code
+// - a packet body arriving too soon after its STX is missed by the sign
+//The per-code figures can be overridden as "E=100,A=100,G=100" lists in
+//BBUSB_SIM_STX_MS and BBUSB_SIM_PROC_MS. BBUSB_SIM_UNPLUG="<bytes>,<ms>" has
+//the sign unplugged for <ms> once it's been sent <bytes>, as when its cable is
+//bumped: the transfer which crosses <bytes> fails, as do opens until it's back.
+
+#define SIM_DEFAULT_BAUD 9600
+#define SIM_NODE "simulated"//for usbsign_node()
+#define SIM_MAX_LABELS 128
+
+//command code -> ms, 0 code is the fallback for any other code
+struct sim_timing {
+    char cmdcode;
+    int ms;
+};
+#define SIM_TIMING_CODES 4
+static const struct sim_timing default_stx_ms[SIM_TIMING_CODES] = {
+    {'E', 100}, {'A', 100}, {'G', 100}, {0, 100}
+};
+static const struct sim_timing default_proc_ms[SIM_TIMING_CODES] = {
+    {'E', 40}, {'A', 15}, {'G', 3}, {0, 15}
+};
+
+enum sim_state_t { SIM_IDLE, SIM_TYPE, SIM_ADDR, SIM_BETWEEN, SIM_PACKET };
+
+struct sim_file {
+    char type;//'A' TEXT or 'B' STRING, 0 if memconf didn't allocate it
+    int size;
+    char* data;
+    int datalen;
+};
+
+struct usbsign_simusb {
+    long long byte_us;
+    struct sim_timing stx_ms[SIM_TIMING_CODES], proc_ms[SIM_TIMING_CODES];
+
+    //parser:
+    enum sim_state_t state;
+    int nulls, addrlen;
+    long long stx_at;
+    char* pkt;
+    int pktlen, pktbuflen;
+    int pkt_missed;
+
+    //sign contents:
+    struct sim_file files[SIM_MAX_LABELS];
+    struct sim_file priority;//always there, whatever memconf allocates
+    char runseq[SIM_MAX_LABELS+1];
+
+    //time the sign is done with everything it's been sent so far:
+    long long clock_us;
+
+    int sequences, packets, missed;
+    unsigned long bytes;
+    long long busy_us;
+};
+
+//BBUSB_SIM_UNPLUG, for the whole process (ie a single simulated sign)
+static struct {
+    int parsed, active;
+    unsigned long after_bytes, sent;
+    int ms;
+    long long back_us;//when it's plugged back in, 0 until it's unplugged
+} sim_unplug;
+
+//Counts size more bytes sent, returning 1 if the sign is (now) unplugged.
+static int sim_unplugged(unsigned long size) {
+    if (!sim_unplug.parsed) {
+        sim_unplug.parsed = 1;
+        const char* env = getenv("BBUSB_SIM_UNPLUG");
+        if (env != NULL) {
+            if (sscanf(env, "%lu,%d", &sim_unplug.after_bytes, &sim_unplug.ms) == 2 &&
+                sim_unplug.ms >= 0) {
+                sim_unplug.active = 1;
+            } else {
+                config_error("Ignoring malformed BBUSB_SIM_UNPLUG: %s", env);
+            }
+        }
+    }
+    if (!sim_unplug.active) {
+        return 0;
+    }
+    long long now = timing_now_us();
+    if (sim_unplug.back_us != 0) {
+        return now < sim_unplug.back_us;
+    }
+    sim_unplug.sent += size;
+    if (sim_unplug.sent > sim_unplug.after_bytes) {
+        config_log("Simulated sign unplugged for %dms", sim_unplug.ms);
+        sim_unplug.back_us = now + sim_unplug.ms*1000LL;
+        return 1;
+    }
+    return 0;
+}
+
+static int sim_ms(const struct sim_timing* table, char cmdcode) {
+    int i = 0;
+    while (table[i].cmdcode != 0 && table[i].cmdcode != cmdcode) {
+        ++i;
+    }
+    return table[i].ms;
+}
+
+//applies "E=100,A=100,G=10" style overrides from the environment to table
+static void sim_timing_env(struct sim_timing* table, const char* envname) {
+    const char* env = getenv(envname);
+    while (env != NULL && *env != '\0') {
+        char code;
+        int ms, len;
+        if (sscanf(env, "%c=%d%n", &code, &ms, &len) != 2 || ms < 0) {
+            config_error("Ignoring malformed %s: %s", envname, env);
+            return;
+        }
+        int i = 0;
+        while (table[i].cmdcode != 0 && table[i].cmdcode != code) {
+            ++i;
+        }
+        table[i].ms = ms;
+        env += len;
+        if (*env == ',') {
+            ++env;
+        }
+    }
+}
+
+static struct sim_file* sim_file(usbsign_handle* dev, char label, char type) {
+    struct sim_file* file = (label == PRIORITY_FILENAME) ? &dev->priority :
+        &dev->files[(unsigned char)label % SIM_MAX_LABELS];
+    if (file->type != type) {
+        config_error("Simulated sign: file 0x%02x isn't allocated as a %s",
+                label, (type == 'A') ? "TEXT" : "STRING");
+        return NULL;
+    }
+    return file;
+}
+
+static void sim_file_write(struct sim_file* file, const char* data, int len) {
+    if (len > file->size) {
+        config_error("Simulated sign: %d bytes don't fit in a %d byte file, truncating",
+                len, file->size);
+        len = file->size;
+    }
+    char* newdata = realloc(file->data, len+1);
+    if (newdata == NULL) {
+        return;
+    }
+    memcpy(newdata, data, len);
+    newdata[len] = '\0';
+    file->data = newdata;
+    file->datalen = len;
+}
+
+//the sign acting on a complete packet body
+static void sim_packet(usbsign_handle* dev) {
+    ++dev->packets;
+    if (dev->pkt_missed) {
+        ++dev->missed;
+        return;
+    }
+    char* pkt = dev->pkt;
+    int len = dev->pktlen, i;
+    if (len >= 2 && pkt[0] == 'E' && pkt[1] == '$') {
+        //memconf: wipes everything, then allocates each 11-byte filespec
+        for (i = 0; i < SIM_MAX_LABELS; i++) {
+            free(dev->files[i].data);
+        }
+        memset(dev->files, 0, sizeof(dev->files));
+        dev->runseq[0] = '\0';
+        for (i = 2; i + 11 <= len; i += 11) {
+            struct sim_file* file = &dev->files[(unsigned char)pkt[i] % SIM_MAX_LABELS];
+            char size[5] = {pkt[i+3], pkt[i+4], pkt[i+5], pkt[i+6], '\0'};
+            file->type = pkt[i+1];
+            file->size = (int)strtol(size, NULL, 16);
+        }
+        config_debug("Simulated sign: memconf with %d files", (len-2)/11);
+    } else if (len >= 4 && pkt[0] == 'E' && pkt[1] == '.') {
+        //runseq: type, lock, then the TEXT labels to show
+        int count = 0;
+        for (i = 4; i < len; i++) {
+            if (sim_file(dev, pkt[i], 'A') != NULL) {
+                dev->runseq[count++] = pkt[i];
+            }
+        }
+        dev->runseq[count] = '\0';
+    } else if (len >= 2 && pkt[0] == 'E') {
+        config_debug("Simulated sign: special function '%c'", pkt[1]);
+    } else if (len >= 5 && pkt[0] == 'A' && pkt[2] == 0x1b) {
+        //TEXT: label, ESC, position, mode, [special if mode is 'n'], text
+        struct sim_file* file = sim_file(dev, pkt[1], 'A');
+        int start = (pkt[4] == 'n' && len > 5) ? 6 : 5;
+        if (file != NULL) {
+            sim_file_write(file, &pkt[start], len - start);
+        }
+    } else if (len == 2 && pkt[0] == 'A') {
+        //TEXT with nothing after the label empties it, eg to clear an alert
+        struct sim_file* file = sim_file(dev, pkt[1], 'A');
+        if (file != NULL) {
+            sim_file_write(file, "", 0);
+        }
+    } else if (len >= 2 && pkt[0] == 'G') {
+        //STRING: label, text
+        struct sim_file* file = sim_file(dev, pkt[1], 'B');
+        if (file != NULL) {
+            sim_file_write(file, &pkt[2], len - 2);
+        }
+    } else {
+        config_error("Simulated sign: ignoring unknown packet '%c' (%d bytes)",
+                (len > 0) ? pkt[0] : ' ', len);
+    }
+}
+
+//feeds one byte which finished arriving at the sign at time 'at'
+static void sim_byte(usbsign_handle* dev, char byte, long long* at) {
+    if (dev->state != SIM_IDLE) {
+        //a sync header starts over from anywhere, dropping any partial packet:
+        if (byte == 1 && dev->nulls >= 5) {
+            config_log("Simulated sign: sync header mid-sequence, starting over");
+            dev->state = SIM_TYPE;
+            return;
+        }
+        dev->nulls = (byte == 0) ? dev->nulls + 1 : 0;
+    }
+    switch (dev->state) {
+    case SIM_IDLE:
+        if (byte == 0) {
+            ++dev->nulls;
+        } else if (byte == 1 && dev->nulls >= 5) {
+            dev->state = SIM_TYPE;
+        } else {
+            config_error("Simulated sign: expected sync header, got 0x%02x", byte);
+            dev->nulls = 0;
+        }
+        return;
+    case SIM_TYPE:
+        if (byte != 'Z') {
+            config_error("Simulated sign: unsupported sign type '%c'", byte);
+        }
+        dev->addrlen = 0;
+        dev->state = SIM_ADDR;
+        return;
+    case SIM_ADDR:
+        if (++dev->addrlen == 2) {
+            dev->state = SIM_BETWEEN;
+        }
+        return;
+    case SIM_BETWEEN:
+        if (byte == 2) {
+            dev->stx_at = *at;
+            dev->pktlen = 0;
+            dev->pkt_missed = 0;
+            dev->state = SIM_PACKET;
+        } else if (byte == 4) {
+            ++dev->sequences;
+            dev->nulls = 0;
+            dev->state = SIM_IDLE;
+            int i;
+            if (dev->priority.datalen > 0) {
+                //...in place of the run sequence, until it's emptied
+                config_debug("Simulated sign: showing priority file (%d bytes)",
+                        dev->priority.datalen);
+                return;
+            }
+            for (i = 0; dev->runseq[i] != '\0'; i++) {
+                struct sim_file* file = &dev->files[(unsigned char)dev->runseq[i] % SIM_MAX_LABELS];
+                config_debug("Simulated sign: showing 0x%02x (%d bytes)",
+                        dev->runseq[i], file->datalen);
+            }
+        } else {
+            config_error("Simulated sign: expected STX or EOT, got 0x%02x", byte);
+        }
+        return;
+    case SIM_PACKET:
+        if (byte == 3) {
+            sim_packet(dev);
+            *at += (long long)sim_ms(dev->proc_ms, (dev->pktlen > 0) ? dev->pkt[0] : 0)*1000;
+            dev->state = SIM_BETWEEN;
+            return;
+        }
+        if (dev->pktlen == 0) {
+            //the sign needs a moment after STX before it can take the body:
+            long long need_us = (long long)sim_ms(dev->stx_ms, byte)*1000;
+            long long waited_us = *at - dev->byte_us - dev->stx_at;
+            dev->pkt_missed = (waited_us < need_us);
+            if (dev->pkt_missed) {
+                config_error("Simulated sign: '%c' packet started %lldms after its STX, needs %lldms. Packet missed.",
+                        byte, waited_us/1000, need_us/1000);
+            }
+        }
+        if (dev->pktlen == dev->pktbuflen) {
+            int buflen = (dev->pktbuflen == 0) ? 256 : dev->pktbuflen*2;
+            char* newpkt = realloc(dev->pkt, buflen);
+            if (newpkt == NULL) {
+                return;
+            }
+            dev->pkt = newpkt;
+            dev->pktbuflen = buflen;
+        }
+        dev->pkt[dev->pktlen++] = byte;
+        return;
+    }
+}
+
+int usbsign_open(int vendorid, int productid, int interface,
+                 const char* device, usbsign_handle** devp) {
+    if (sim_unplugged(0)) {
+        config_error("Could not find/open USB device with vid=0x%X pid=0x%X. Is the sign plugged in?",
+                vendorid, productid);
+        return -1;
+    }
+    usbsign_handle* dev = calloc(1, sizeof(usbsign_handle));
+    if (dev == NULL) {
+        config_error("Memory allocation error!");
+        return -1;
+    }
+    const char* baudenv = getenv("BBUSB_SIM_BAUD");
+    int baud = (baudenv != NULL) ? atoi(baudenv) : SIM_DEFAULT_BAUD;
+    if (baud <= 0) {
+        config_error("Ignoring invalid BBUSB_SIM_BAUD: %s", baudenv);
+        baud = SIM_DEFAULT_BAUD;
+    }
+    dev->byte_us = 10*1000000LL / baud;//start + 8 data + stop bits
+    memcpy(dev->stx_ms, default_stx_ms, sizeof(default_stx_ms));
+    memcpy(dev->proc_ms, default_proc_ms, sizeof(default_proc_ms));
+    dev->priority.type = 'A';
+    dev->priority.size = PRIORITY_TEXTFILE_DATA_SIZE;
+    sim_timing_env(dev->stx_ms, "BBUSB_SIM_STX_MS");
+    sim_timing_env(dev->proc_ms, "BBUSB_SIM_PROC_MS");
+
+    config_log("USB Open %X:%X:%d (simulated sign%s%s, %d baud)",
+            vendorid, productid, interface,
+            (device != NULL) ? " " : "", (device != NULL) ? device : "", baud);
+    *devp = dev;
+    return 0;
+}
+
+int usbsign_open_node(int vendorid, int productid, int interface,
+                      const char* device, const char* node, usbsign_handle** devp) {
+    //there's no bus to skip looking through, just the one simulated sign
+    if (strcmp(node, SIM_NODE) != 0) {
+        return -1;
+    }
+    return usbsign_open(vendorid, productid, interface, device, devp);
+}
+
+int usbsign_node(usbsign_handle* dev, char* node, size_t size) {
+    (void)dev;
+    snprintf(node, size, "%s", SIM_NODE);
+    return 0;
+}
+
+int usbsign_reset(int vendorid, int productid, int interface,
+                  const char* device, usbsign_handle** devp) {
+    (void)device;
+    config_log("USB Reset %X:%X:%d (simulated sign)", vendorid, productid, interface);
+    if (sim_unplugged(0)) {
+        config_error("Unable to reset the simulated sign: it is unplugged");
+        return -1;
+    }
+    usbsign_handle* dev = *devp;
+    dev->state = SIM_IDLE;
+    dev->nulls = 0;
+    return 0;
+}
+
+void usbsign_close(usbsign_handle* dev, int interface) {
+    config_log("USB Close (simulated sign, interface %d): %d sequences, %d packets (%d missed), %lu bytes, %lldms busy",
+            interface, dev->sequences, dev->packets, dev->missed,
+            dev->bytes, dev->busy_us/1000);
+    int i;
+    for (i = 0; i < SIM_MAX_LABELS; i++) {
+        free(dev->files[i].data);
+    }
+    free(dev->priority.data);
+    free(dev->pkt);
+    free(dev);
+}
+
+int usbsign_wait(int vendorid, int productid, const char* device,
+                 int wakefd, int timeout_ms) {
+    //no hotplug events from a simulated sign: callers poll by reopening
+    (void)vendorid; (void)productid; (void)device; (void)wakefd; (void)timeout_ms;
+    return -1;
+}
+
+int usbsign_sendv(usbsign_handle* dev, int endpoint,
+                  const struct iovec* iov, int iovcnt, int* sentcount) {
+    if (dev == NULL) {
+        config_error("Unable to send: Device handle is null");
+        return -1;
+    }
+    (void)endpoint;
+    int i, size = 0;
+    for (i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    if (sim_unplugged(size)) {
+        config_error("USB transfer of %d bytes failed: the simulated sign is unplugged", size);
+        return -1;
+    }
+    //bytes queue up behind whatever the sign is still busy with:
+    long long at = timing_now_us();
+    if (at < dev->clock_us) {
+        at = dev->clock_us;
+    }
+    long long start = at;
+    for (i = 0; i < iovcnt; i++) {
+        const char* data = iov[i].iov_base;
+        size_t j;
+        for (j = 0; j < iov[i].iov_len; j++) {
+            at += dev->byte_us;
+            sim_byte(dev, data[j], &at);
+        }
+    }
+    dev->clock_us = at;
+    dev->busy_us += at - start;
+    dev->bytes += size;
+    //the transfer is done once the sign has taken all of it:
+    timing_sleep_until_us(at);
+    *sentcount = size;
+    return 0;
+}
+
+int usbsign_send(usbsign_handle* dev, int endpoint,
+                 char* data, unsigned int size, int* sentcount) {
+    struct iovec iov = {data, size};
+    return usbsign_sendv(dev, endpoint, &iov, 1, sentcount);
+}
+
+int usbsign_submitv(usbsign_handle* dev, int endpoint,
+                    const struct iovec* iov, int iovcnt) {
+    //the simulated link is synchronous, like libusb-0.1
+    int sent;
+    return usbsign_sendv(dev, endpoint, iov, iovcnt, &sent);
+}
+
+int usbsign_flush(usbsign_handle* dev) {
+    return (dev == NULL) ? -1 : 0;
+}
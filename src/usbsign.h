@@ -23,9 +23,13 @@
 
 #include "config.h"
 
+#include <stddef.h>
+#include <sys/uio.h>
+
 #ifdef USE_LIBUSB_10
 #include <libusb-1.0/libusb.h>
-typedef libusb_device_handle usbsign_handle;
+struct usbsign_newusb;//device plus its queue of in-flight transfers
+typedef struct usbsign_newusb usbsign_handle;
 #endif
 
 #ifdef USE_LIBUSB_01
@@ -37,12 +41,50 @@ typedef usb_dev_handle usbsign_handle;
 typedef void usbsign_handle;
 #endif
 
-int usbsign_open(int vendorid, int productid,
-        int interface, usbsign_handle** devh);
-int usbsign_reset(int vendorid, int productid,
-        int interface, usbsign_handle** devh);
+#ifdef USE_SIMUSB
+struct usbsign_simusb;//parser and timing model standing in for the sign
+typedef struct usbsign_simusb usbsign_handle;
+#endif
+
+//device picks which of several matching signs to open: NULL for the first one
+//found, a USB port path like "1-1.4" (bus-port.port..., as in
+///sys/bus/usb/devices), or USBSIGN_SERIAL_PREFIX followed by a serial number.
+//Or USBSIGN_FD_PREFIX followed by an fd for the sign's usbfs node, already
+//opened by a supervising process, which is used without looking on the bus.
+#define USBSIGN_SERIAL_PREFIX "serial="
+#define USBSIGN_FD_PREFIX "fd="
+int usbsign_open(int vendorid, int productid, int interface,
+        const char* device, usbsign_handle** devh);
+//Opens the sign straight from its usbfs node (eg /dev/bus/usb/001/004, from an
+//earlier usbsign_node()) without looking through the bus. Fails (quietly) if
+//nothing is there anymore or it isn't the sign picked by device, or if the
+//backend can't open signs this way.
+int usbsign_open_node(int vendorid, int productid, int interface,
+        const char* device, const char* node, usbsign_handle** devh);
+//Where an open sign is, for usbsign_open_node(). <0 if the backend can't tell.
+int usbsign_node(usbsign_handle* dev, char* node, size_t size);
+int usbsign_reset(int vendorid, int productid, int interface,
+        const char* device, usbsign_handle** devh);
 void usbsign_close(usbsign_handle* dev, int interface);
+//Waits up to timeout_ms for a matching sign to be plugged in, returning early
+//if wakefd (when >= 0) becomes readable. Returns 1 for wakefd, 0 once a sign
+//arrives or on timeout, and <0 if this backend has no hotplug events to wait
+//for (libusb-0.1, or a libusb-1.0 without hotplug support on this platform).
+int usbsign_wait(int vendorid, int productid, const char* device,
+        int wakefd, int timeout_ms);
 int usbsign_send(usbsign_handle* dev, int endpoint,
         char* data, unsigned int size, int* sentcount);
+//Scatter-gather send: the pieces go out back to back as one transfer. A single
+//piece is sent straight from the caller's buffer.
+int usbsign_sendv(usbsign_handle* dev, int endpoint,
+        const struct iovec* iov, int iovcnt, int* sentcount);
+
+//Queue data to be sent without waiting for it to go out. The data must remain
+//valid until the next usbsign_flush(). Backends without async I/O send it
+//immediately, so usbsign_sendv() stays a blocking submitv+flush everywhere.
+int usbsign_submitv(usbsign_handle* dev, int endpoint,
+        const struct iovec* iov, int iovcnt);
+//Wait for all submitted data to be sent, returning <0 if any of it failed.
+int usbsign_flush(usbsign_handle* dev);
 
 #endif